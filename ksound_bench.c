@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ksound_render.h"
+#include "ksound_simd.h"
+
+// NOTE: рендер в S16 стерео (make_sine_waves), 48 кГц по умолчанию у потока
+#define BENCH_RATE 48000
+#define BENCH_FRAME_BYTES 4
+
+// NOTE: в snd_ksound_capture_hw period_bytes_min=256 .. period_bytes_max=64K,
+// кадр от 2 байт (S16 моно) до 32 (S32 8 каналов), то есть от 8 до 32768
+// кадров на период. Время рендера от формата почти не зависит, поэтому
+// размеры периода в кадрах покрывают весь этот диапазон
+static size_t const period_sizes[] = {8,    64,   256,   1024,
+                                      4096, 8192, 16384, 32768};
+static int const voice_counts[] = {1, 8, 64, 512, 4096};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static struct ksound_wavetables wavetables;
+
+static double now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Заполняет набор волн частотами разнесёнными по звуковому диапазону.
+ * partials > 0 - каждая волна банк из стольких гармоник с амплитудами 1/k.
+ */
+static void make_voices(struct ksound_voices *waves, int shape, int partials) {
+    u8 amps[KSOUND_PARTIALS] = {0};
+    int i;
+
+    for (i = 0; i < partials; i++) amps[i] = 127 / (i + 1);
+
+    for (i = 0; i < waves->count; i++) {
+        // NOTE: банки ниже 1500 Гц, чтобы все гармоники звучали
+        u32 const wave = MAKEWAVE(100, (i * 7) % 360,
+                                  partials ? 55 + (i * 37) % 1400
+                                           : 110 + (i * 37) % 8000);
+
+        if (partials)
+            ksound_voices_set_bank(waves, i, &wavetables, wave, amps);
+        else
+            ksound_voices_set(waves, i, &wavetables, wave, shape);
+    }
+}
+
+/*
+ * Замеряет один случай: рендер периодов по period_size кадров пока не пройдёт
+ * min_time секунд. Возвращает количество кадров в секунду.
+ */
+static double bench_case(struct ksound_render_kernel const *kernel,
+                         int voices, size_t period_size, int shape,
+                         int partials, double min_time) {
+    s16 *const samples = calloc(period_size * 2, sizeof(s16));
+    s32 *const accum = calloc(period_size, sizeof(s32));
+    void *const mem = calloc(1, ksound_voices_bytes(voices));
+    // NOTE: запас на все волны, вывод не уходит в ограничение
+    struct ksound_master const master = {
+        .gain = KSOUND_MASTER_GAIN(voices),
+        .clip = wavetables.clip,
+    };
+    struct ksound_voices *waves;
+    double start, elapsed;
+    u64 frames = 0;
+    volatile s16 sink;
+
+    if (!samples || !accum || !mem) {
+        fprintf(stderr, "failed to allocate buffers\n");
+        exit(1);
+    }
+
+    waves = ksound_voices_layout(mem, voices, BENCH_RATE);
+    make_voices(waves, shape, partials);
+
+    // NOTE: прогрев кэшей и предсказателя переходов
+    make_sine_waves(samples, accum, period_size, BENCH_RATE, waves,
+                    kernel, &master);
+
+    start = now_sec();
+    do {
+        make_sine_waves(samples, accum, period_size, BENCH_RATE, waves,
+                        kernel, &master);
+        frames += period_size;
+        elapsed = now_sec() - start;
+    } while (elapsed < min_time);
+
+    // NOTE: не дать компилятору выкинуть рендер
+    sink = samples[period_size - 1];
+    (void)sink;
+
+    free(mem);
+    free(accum);
+    free(samples);
+    return frames / elapsed;
+}
+
+int main(int argc, char **argv) {
+    double min_time = 0.2;
+    int shape = KSOUND_SHAPE_SINE, partials = 0;
+    char const *kernel_name = NULL;
+    int opt, k;
+    size_t i, j;
+
+    while ((opt = getopt(argc, argv, "t:s:k:b:")) != -1) {
+        if (opt == 't') {
+            min_time = atof(optarg);
+        } else if (opt == 's') {
+            shape = atoi(optarg);
+        } else if (opt == 'k') {
+            kernel_name = optarg;
+        } else if (opt == 'b') {
+            partials = atoi(optarg);
+        } else {
+            fprintf(stderr,
+                    "usage: %s [-t seconds per case] [-s shape 0..3] "
+                    "[-k render kernel] [-b bank partials 1..%d]\n",
+                    argv[0], KSOUND_PARTIALS);
+            return 1;
+        }
+    }
+
+    if (partials < 0 || partials > KSOUND_PARTIALS) {
+        fprintf(stderr, "bank partials must be 0..%d\n", KSOUND_PARTIALS);
+        return 1;
+    }
+
+    if (kernel_name && !ksound_render_kernel_find(kernel_name)) {
+        fprintf(stderr, "render kernel %s is not supported\n", kernel_name);
+        return 1;
+    }
+
+    ksound_tables_init(&wavetables);
+
+    printf("%8s %8s %8s %14s %12s %10s\n", "kernel", "voices", "period",
+           "frames/s", "ns/frame", "realtime");
+
+    // NOTE: без -k сравниваются все ядра доступные на этом процессоре
+    for (k = 0; k < ksound_render_kernel_count; k++) {
+        struct ksound_render_kernel const *const kernel =
+            &ksound_render_kernels[k];
+
+        if (!kernel->supported()) continue;
+        if (kernel_name && strcmp(kernel_name, kernel->name) != 0) continue;
+
+        for (i = 0; i < ARRAY_SIZE(voice_counts); i++) {
+            for (j = 0; j < ARRAY_SIZE(period_sizes); j++) {
+                double const fps =
+                    bench_case(kernel, voice_counts[i], period_sizes[j], shape,
+                               partials, min_time);
+
+                // NOTE: realtime - во сколько раз рендер быстрее реального
+                // времени, меньше 1 означает неминуемый buffer underrun
+                printf("%8s %8d %8zu %14.0f %12.2f %9.1fx\n", kernel->name,
+                       voice_counts[i], period_sizes[j], fps, 1e9 / fps,
+                       fps / BENCH_RATE);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,110 @@
+#ifndef KSOUND_EVENTS_H
+#define KSOUND_EVENTS_H
+
+/*
+ * Очередь событий с метками времени в кадрах потока. Рендер разбирает её
+ * внутри периода и делит период на отрезки по границам событий, поэтому
+ * волны начинаются и заканчиваются точно на заданном кадре. Как и
+ * ksound_render.h собирается и в ядре, и в пространстве пользователя.
+ */
+
+#include "ksound_render.h"  // u64, u32, ...
+
+/*
+ * Событие рендера. Операции те же что у кольца команд (ksound_ring_op), плюс
+ * внутренние которые рендер ставит сам.
+ */
+struct ksound_event {
+    u64 frame;     // кадр потока, с которого событие действует
+    u32 seq;       // порядок поступления, при равных кадрах первым идёт раньший
+    u32 wave;      // упакованная волна (MAKEWAVE) или id для KSOUND_EVENT_END
+    u32 duration;  // для ADD: кадров до автоматического удаления, 0 - навсегда
+    u16 op;
+    u16 shape;
+};
+
+// NOTE: внутренняя операция, конец волны с ограниченной длительностью
+#define KSOUND_EVENT_END 0x100
+
+/*
+ * Двоичная куча событий по (frame, seq) в массиве фиксированной ёмкости.
+ * Память выделяет владелец, очередь её только размечает.
+ */
+struct ksound_event_queue {
+    struct ksound_event *ev;
+    int count;
+    int capacity;
+    u32 seq;
+};
+
+static inline int ksound_event_before(struct ksound_event const *a,
+                                      struct ksound_event const *b) {
+    if (a->frame != b->frame) return a->frame < b->frame;
+    // NOTE: разность вместо сравнения переживает переполнение seq
+    return (s32)(a->seq - b->seq) < 0;
+}
+
+static inline void ksound_event_swap(struct ksound_event *a,
+                                     struct ksound_event *b) {
+    struct ksound_event const t = *a;
+
+    *a = *b;
+    *b = t;
+}
+
+/*
+ * Добавляет событие, seq назначается здесь. Возвращает 0 если очередь полна.
+ */
+static inline int ksound_events_push(struct ksound_event_queue *q,
+                                     struct ksound_event const *e) {
+    int i = q->count;
+
+    if (q->count >= q->capacity) return 0;
+
+    q->ev[i] = *e;
+    q->ev[i].seq = q->seq++;
+    q->count++;
+
+    while (i > 0) {
+        int const parent = (i - 1) / 2;
+
+        if (!ksound_event_before(&q->ev[i], &q->ev[parent])) break;
+        ksound_event_swap(&q->ev[i], &q->ev[parent]);
+        i = parent;
+    }
+
+    return 1;
+}
+
+/*
+ * Ближайшее событие или NULL если очередь пуста.
+ */
+static inline struct ksound_event const *ksound_events_peek(
+    struct ksound_event_queue const *q) {
+    return q->count > 0 ? &q->ev[0] : NULL;
+}
+
+/*
+ * Убирает ближайшее событие и копирует его в e. Очередь не должна быть пуста.
+ */
+static inline void ksound_events_pop(struct ksound_event_queue *q,
+                                     struct ksound_event *e) {
+    int i = 0;
+
+    *e = q->ev[0];
+    q->ev[0] = q->ev[--q->count];
+
+    for (;;) {
+        int const l = 2 * i + 1, r = l + 1;
+        int m = i;
+
+        if (l < q->count && ksound_event_before(&q->ev[l], &q->ev[m])) m = l;
+        if (r < q->count && ksound_event_before(&q->ev[r], &q->ev[m])) m = r;
+        if (m == i) break;
+
+        ksound_event_swap(&q->ev[i], &q->ev[m]);
+        i = m;
+    }
+}
+
+#endif  // KSOUND_EVENTS_H
@@ -0,0 +1,142 @@
+#ifndef KSOUND_IOCTL_H
+#define KSOUND_IOCTL_H
+
+/*
+ * Команды /dev/ksound_device. Заголовок общий для модуля ядра и программ
+ * пользовательского пространства (us_oscillator), поэтому только типы из
+ * linux/types.h и макросы из linux/ioctl.h.
+ */
+
+#include <linux/ioctl.h>  // _IOW, _IO, ...
+#include <linux/types.h>  // __u32, __u64, ...
+
+// NOTE:
+// https://embetronicx.com/tutorials/linux/device-drivers/ioctl-tutorial-in-linux/
+#define MYDEVMAGIC 's'
+
+/*
+ * Пакет волн для групповых команд. Вся группа применяется одной публикацией
+ * набора, то есть на границе одного периода.
+ */
+struct ksound_wave_batch {
+    __u32 count;  // количество волн в массиве waves
+    __u32 flags;  // пока не используется, должен быть 0
+    __u64 waves;  // указатель на массив упакованных волн (MAKEWAVE)
+};
+
+// NOTE: CMDADDWAVE и CMDREMOVEWAVE возвращают код ошибки положительным
+// числом, остальные команды - как обычно -1 и errno
+// NOTE: одна волна, аргумент - указатель на упакованную волну
+#define CMDADDWAVE _IOW(MYDEVMAGIC, 0, __u32)
+// NOTE: удалить все волны с частотой, аргумент - указатель на частоту
+#define CMDREMOVEWAVE _IOW(MYDEVMAGIC, 1, __u32)
+// NOTE: добавить все волны пакета
+#define CMDADDWAVES _IOW(MYDEVMAGIC, 2, struct ksound_wave_batch)
+// NOTE: заменить весь набор волнами пакета
+#define CMDSETWAVES _IOW(MYDEVMAGIC, 3, struct ksound_wave_batch)
+// NOTE: удалить все волны, без аргумента
+#define CMDCLEARWAVES _IO(MYDEVMAGIC, 4)
+// NOTE: обновить амплитуду волн с той же частотой, фаза продолжается
+#define CMDUPDATEWAVES _IOW(MYDEVMAGIC, 5, struct ksound_wave_batch)
+
+// NOTE: eventfd который сигналит когда рендер освободил место в кольце команд,
+// аргумент - указатель на дескриптор, -1 чтобы отключить
+#define CMDSETRINGEVENTFD _IOW(MYDEVMAGIC, 6, __s32)
+
+// NOTE: выбрать поток захвата (substream) для всех следующих команд, mmap и
+// read() этого открытого файла, аргумент - указатель на номер потока
+#define CMDSETSTREAM _IOW(MYDEVMAGIC, 7, __u32)
+// NOTE: количество потоков захвата (параметр substreams), аргумент - указатель
+// куда записать
+#define CMDGETSTREAMS _IOR(MYDEVMAGIC, 8, __u32)
+
+/*
+ * Волна с дескриптором. Дескриптор выдаёт CMDADDVOICE, он остаётся верным пока
+ * волну не удалят, и различает волны с одной частотой.
+ */
+struct ksound_voice_req {
+    __u32 wave;    // упакованная волна (MAKEWAVE)
+    __u32 handle;  // дескриптор волны, 0 никогда не выдаётся
+};
+
+// NOTE: добавить волну, ядро пишет её дескриптор в handle
+#define CMDADDVOICE _IOWR(MYDEVMAGIC, 9, struct ksound_voice_req)
+// NOTE: удалить волну, аргумент - указатель на дескриптор
+#define CMDREMOVEVOICE _IOW(MYDEVMAGIC, 10, __u32)
+// NOTE: заменить описание волны handle на wave, фаза продолжается
+#define CMDUPDATEVOICE _IOW(MYDEVMAGIC, 11, struct ksound_voice_req)
+
+// NOTE: гармоник в банке, первая - основной тон
+#define KSOUND_PARTIALS 16
+
+/*
+ * Банк гармоник: одна волна с основным тоном wave и гармониками 1, 2, ...
+ * KSOUND_PARTIALS с относительными амплитудами partials (0..127). Все
+ * гармоники считаются от одной фазы, поэтому банк занимает один слот и
+ * стоит намного меньше отдельной волны на гармонику. Амплитуда wave задаёт
+ * пик всего банка. Дескриптор общий с волнами: CMDREMOVEVOICE удаляет банк,
+ * CMDUPDATEVOICE меняет основной тон и уровень, не трогая гармоники.
+ */
+struct ksound_bank_req {
+    __u32 wave;    // упакованная волна основного тона (MAKEWAVE)
+    __u32 handle;  // дескриптор, как в ksound_voice_req
+    __u8 partials[KSOUND_PARTIALS];
+};
+
+// NOTE: добавить банк гармоник, ядро пишет его дескриптор в handle
+#define CMDADDBANK _IOWR(MYDEVMAGIC, 12, struct ksound_bank_req)
+// NOTE: заменить основной тон и гармоники банка handle, фаза продолжается
+#define CMDUPDATEBANK _IOW(MYDEVMAGIC, 13, struct ksound_bank_req)
+
+// NOTE: количество команд, номера идут подряд с 0
+#define KSOUND_IOCTL_COUNT 14
+
+/*
+ * Кольцо команд, отображается через mmap /dev/ksound_device (смещение 0). У
+ * каждого потока захвата своё кольцо, отображается кольцо потока выбранного
+ * через CMDSETSTREAM.
+ * Один писатель в пространстве пользователя и один читатель - рендер, который
+ * разбирает кольцо раз за период, поэтому ни системных вызовов, ни блокировок.
+ *
+ * Писатель заполняет cmds[head % KSOUND_RING_SIZE] и затем публикует head
+ * (store-release). Рендер читает head (load-acquire), применяет команды и
+ * публикует tail. Свободно KSOUND_RING_SIZE - (head - tail) мест. Счётчики
+ * растут непрерывно и заворачиваются через 2^32.
+ *
+ * Волны кольца - отдельный набор рендера, ioctl его не видят и не меняют.
+ *
+ * Команда может нести метку времени frame в кадрах потока (счёт от START, тот
+ * же что у указателя захвата ALSA), тогда рендер применит её точно на этом
+ * кадре внутри периода. Текущий кадр указателя рендер пишет в ring->frame.
+ */
+#define KSOUND_RING_BITS 12
+#define KSOUND_RING_SIZE (1 << KSOUND_RING_BITS)
+
+enum ksound_ring_op {
+    KSOUND_RING_NOP = 0,
+    KSOUND_RING_ADD,     // добавить волну wave формы shape
+    KSOUND_RING_REMOVE,  // удалить волны с частотой GETWAVEFREQ(wave)
+    KSOUND_RING_UPDATE,  // обновить волны с той же частотой, фаза продолжается
+    KSOUND_RING_CLEAR,   // удалить все волны кольца
+};
+
+struct ksound_ring_cmd {
+    __u64 frame;     // кадр потока когда применить, 0 или прошедший - сразу
+    __u32 wave;      // упакованная волна (MAKEWAVE)
+    __u32 duration;  // для ADD: кадров до удаления волны, 0 - пока не удалят
+    __u16 op;        // enum ksound_ring_op
+    __u16 shape;     // для ADD: 0 синус, 1 пила, 2 меандр, 3 треугольник
+    __u32 pad;
+};
+
+struct ksound_ring {
+    __u32 head;  // пишет только пространство пользователя
+    __u32 pad0[15];
+    __u32 tail;  // пишет только рендер
+    __u32 pad1;
+    __u64 frame;  // пишет только рендер: кадр потока под указателем захвата
+    __u32 pad2[12];
+    struct ksound_ring_cmd cmds[KSOUND_RING_SIZE];
+};
+
+#endif  // KSOUND_IOCTL_H
@@ -0,0 +1,2971 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/cdev.h>     // struct cdev, ...
+#include <linux/debugfs.h>  // debugfs_create_dir, debugfs_create_file, ...
+#include <linux/eventfd.h>  // eventfd_ctx_fdget, eventfd_signal, ...
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/kfifo.h>    // kfifo_in, kfifo_to_user, ...
+#include <linux/kthread.h>  // kthread_create, kthread_stop, ...
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>  // kvzalloc, kvfree, ...
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/platform_device.h>
+#include <linux/poll.h>  // poll_wait, EPOLLOUT, ...
+#include <linux/rculist.h>   // list_add_rcu, list_for_each_entry_rcu, ...
+#include <linux/rcupdate.h>  // rcu_assign_pointer, kfree_rcu, ...
+#include <linux/sched.h>     // sched_set_fifo, ...
+#include <linux/seq_file.h>  // seq_printf, DEFINE_SHOW_ATTRIBUTE, ...
+#include <linux/slab.h>
+#include <linux/types.h>   // s16, u64, size_t, atomic_t, ...
+#include <linux/vmalloc.h>  // vmalloc_user, remap_vmalloc_range, ...
+#include <linux/wait.h>    // wait_queue_head_t, wake_up, ...
+#include <sound/asound.h>  // snd_pcm_uframes_t, ...
+#include <sound/core.h>
+#include <sound/initval.h>
+#include <sound/pcm.h>  // SNDRV_PCM_TRIGGER_START, SNDRV_PCM_TRIGGER_STOP, ...
+#include <sound/pcm_params.h>
+
+#include "ksound_events.h"  // ksound_event_queue, ...
+#include "ksound_ioctl.h"   // CMDADDWAVE, ksound_wave_batch, ...
+#include "ksound_pool.h"    // ksound_pool_add, ksound_pool_sync, ...
+#include "ksound_render.h"  // make_sine_waves, ksound_voices, MAKEWAVE, ...
+#include "ksound_simd.h"    // ksound_render_kernel, ...
+#include "ksound_stats.h"   // ksound_hist, ...
+#include "ksound_workers.h"  // ksound_workers_render, ...
+
+#define CREATE_TRACE_POINTS
+#include "ksound_trace.h"  // trace_ksound_render_start, ...
+
+// NOTE:
+// https://www.kernel.org/doc/html/v4.15/sound/kernel-api/alsa-driver-api.html
+// NOTE:
+// https://github.com/torvalds/linux/blob/master/include/linux/fixp-arith.h
+// NOTE:
+// https://github.com/eclipse-cdt/cdt/tree/main/FAQ#whats-the-best-way-to-set-up-the-cdt-to-navigate-linux-kernel-source
+// NOTE:
+// https://embetronicx.com/tutorials/linux/device-drivers/ioctl-tutorial-in-linux/
+
+// NOTE: alsaloop -C hw:1,0 -P hw:0,0 -c 2 -f S16_LE -r 48000
+// NOTE: speaker-test -D hw:1,0 -c 1 -t sine -r 48000 -f 400 | aplay -D hw:0,0
+// -r 48000 -f S16_LE -c 2 -B 100000 -v
+// NOTE: aplay -l
+// NOTE: arecord -l
+
+#define DEVICE_NAME "ksound_device"
+#define CLASS_NAME "ksound_class"
+#define DRIVER_NAME "ksound"
+#define CARD_NAME "KernelSoundCard"
+
+// NOTE: частота дискретизации по умолчанию, пока поток не открыт
+#define DEFAULT_RATE 48000
+
+/*
+ * Петля воспроизведения в стиле snd-aloop: устройство 1 карты, один
+ * substream воспроизведения и парный ему substream захвата. Что клиент пишет
+ * в воспроизведение, таймер петли период за периодом переносит в fifo, а
+ * рендер парного захвата добавляет поверх своих волн. Обе стороны работают в
+ * одном формате, частоте и числе каналов, первая настроенная сторона
+ * ограничивает вторую.
+ */
+struct ksound_loop {
+    struct hrtimer timer;
+    struct snd_pcm_substream *substream;  // воспроизведение
+    atomic_t running;
+    snd_pcm_uframes_t hw_ptr;  // в байтах, только на границах периодов
+    unsigned long hw_period;
+    ktime_t start_time;  // начало часов петли, см. ksound_clock_frames
+
+    // NOTE: один писатель (таймер петли) и один читатель (рендер парного
+    // захвата), блокировки не нужны
+    struct kfifo fifo;
+    unsigned long overruns;  // захват не забирает, период воспроизведения
+                             // потерян
+
+    // NOTE: параметры сторон, под lock. Обе стороны в одном формате
+    struct mutex lock;
+    bool playback_set, capture_set;
+    snd_pcm_format_t format;
+    unsigned int rate, channels;
+
+    ksound_add_fn add;  // сложение в формате пары, выбирается в hw_params
+    u8 *scratch;        // период воспроизведения для рендера захвата
+};
+
+/*
+ * Один поток захвата (substream) виртуальной карты. У каждого свой таймер,
+ * указатель, набор волн, кольцо команд и поток read(), друг от друга они не
+ * зависят. К типам принадлежащим этому модулу добавляю префикс ksound_.
+ */
+struct ksound_stream {
+    int index;  // номер substream, по нему его выбирает CMDSETSTREAM
+    struct ksound_loop *loop;  // только у захвата петли, иначе NULL
+    struct hrtimer timer;
+    struct snd_pcm_substream *substream;
+    atomic_t running;
+    ktime_t start_time;  // начало часов потока, см. ksound_clock_frames
+    s32 *accum;  // буфер накопления на один период, см. make_sine_waves
+    ksound_emit_fn emit;  // вывод в формат и число каналов потока, hw_params
+
+    // NOTE: волны кольца команд (см. ksound_ring_drain), тоже ёмкостью
+    // max_voices и тоже только для рендера
+    struct ksound_voices *ring_voices;
+    u32 ring_tail;  // собственная копия tail, кольцо может испортить писатель
+    unsigned long ring_dropped;  // ADD не поместился в max_voices
+
+    // NOTE: команды кольца ждут своего кадра здесь, ёмкость max_events
+    struct ksound_event_queue events;
+    u32 ring_next_id;  // id волн кольца, нужны чтобы снять волну по duration
+    bool ring_reset;   // START: рендер снимет волны и события кольца
+
+    // NOTE: счётчики периодов от START. hw_period - сколько периодов отдано
+    // ALSA, render_period - сколько уже отрендерено (в режиме thread может
+    // быть впереди hw_period на render_ahead периодов). Указатель захвата идёт
+    // по часам потока, но не дальше render_period
+    unsigned long hw_period;
+    unsigned long render_period;
+    int render_ahead;  // текущая глубина, меняет ksound_adapt_ahead
+    int ahead_min, ahead_max;  // пределы глубины для этого буфера
+    unsigned long late_periods;  // поток рендера не успел к таймеру
+
+    // NOTE: запас времени рендера до срока периода, пишет только рендер
+    s64 slack_min;              // наименьший запас в текущем окне
+    unsigned int slack_window;  // периодов в текущем окне
+    unsigned long xruns;        // период готов позже срока
+    unsigned long near_xruns;   // запас меньше четверти периода
+
+    // NOTE: поток рендера, только для render_mode=thread
+    struct task_struct *render_task;
+    wait_queue_head_t render_wq;
+    struct mutex render_lock;  // держит поток пока пишет в DMA буфер
+
+    // NOTE: простой без волн. После буфера тишины DMA больше не трогаем, а
+    // таймер тикает раз в idle_step периодов и только двигает указатель
+    unsigned long silent_periods;  // подряд отрендеренных периодов тишины
+    bool idle;
+    unsigned long idle_step;
+    enum hrtimer_mode timer_mode;
+    spinlock_t kick_lock;  // ksound_stream_wake против TRIGGER_STOP
+
+    // NOTE: волны ioctl, по сессии на каждый открытый файл который добавлял
+    // волны в этот поток. Список меняется под sessions_lock, рендер обходит
+    // его под RCU
+    struct list_head sessions;
+    spinlock_t sessions_lock;
+    int reserved_voices;  // ёмкость всех сессий потока, под sessions_lock
+
+    // NOTE: кольцо команд для mmap, выделяется в ksound_init раньше чем
+    // появится /dev/ksound_device. eventfd меняется под mutex, рендер читает
+    // его под RCU
+    struct ksound_ring *cmd_ring;
+    struct eventfd_ctx __rcu *cmd_ring_eventfd;
+    wait_queue_head_t cmd_ring_wq;
+
+    // NOTE: копия отрендеренных периодов для read() на /dev/ksound_device.
+    // Один писатель (рендер) и один читатель (под pcm_read_lock), kfifo для
+    // такого случая блокировок не требует. Формат кадра как у потока захвата
+    int pcm_frame_bytes;
+    struct kfifo pcm_fifo;
+    wait_queue_head_t pcm_wq;
+    struct mutex pcm_read_lock;
+    atomic_t pcm_readers;
+    unsigned long pcm_overruns;  // период не поместился, читатель отстал
+
+    // NOTE: статистика для debugfs. Всё пишет рендер или таймер, кроме
+    // счётчиков которые и так есть выше
+    u64 rendered_periods;
+    u64 ticks;
+    struct ksound_hist render_hist;  // время рендера периода
+    struct ksound_hist jitter_hist;  // опоздание тика таймера
+    struct ksound_hist apply_hist;   // от изменения пула до рендера
+    struct ksound_hist slack_hist;   // запас рендера до срока периода
+    struct dentry *debugfs;
+};
+
+/*
+ * Описание виртуальной карты: ALSA карта и её потоки захвата.
+ */
+struct ksound_card {
+    struct snd_card *card;
+    struct ksound_loop *loop;  // NULL если loopback=0
+    int stream_count;  // substreams и захват петли последним
+    struct ksound_stream streams[];
+};
+
+/*
+ * Волны ioctl одного открытого файла в одном потоке. У каждой сессии свой пул
+ * со своей блокировкой, поэтому клиенты друг друга не ждут. Рендер смешивает
+ * все сессии потока, а при закрытии файла его волны пропадают вместе с
+ * сессией.
+ */
+struct ksound_session {
+    struct list_head node;  // в stream->sessions
+    struct ksound_stream *stream;
+    pid_t pid;  // процесс открывший файл, для debugfs
+    struct ksound_pool *pool;
+    // NOTE: состояние рендера ёмкостью session_voices, трогает только рендер
+    struct ksound_voices *voices;
+};
+
+/*
+ * Открытый /dev/ksound_device. Команды, mmap и read() относятся к выбранному
+ * потоку, по умолчанию к нулевому.
+ */
+struct ksound_file {
+    struct ksound_stream *stream;
+    bool reader;  // учтён в stream->pcm_readers
+
+    // NOTE: сессии по номеру потока, создаются первой добавленной волной.
+    // lock только для создания, команды разных файлов друг друга не ждут
+    struct ksound_session **sessions;
+    struct mutex lock;
+};
+
+// NOTE: выбор потока файла, читатели read() и eventfd кольца. Рендер её
+// никогда не берёт
+static DEFINE_MUTEX(mutex);
+
+static void ksound_stream_wake(struct ksound_stream *stream);
+static struct ksound_stream *ksound_stream_at(int index);
+static int ksound_stream_count(void);
+
+/*
+ * Описывает PCM поток
+ */
+static struct snd_pcm_hardware snd_ksound_capture_hw = {
+    .info = (SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_INTERLEAVED |
+             SNDRV_PCM_INFO_BLOCK_TRANSFER | SNDRV_PCM_INFO_MMAP_VALID),
+    .formats = (SNDRV_PCM_FMTBIT_S16_LE | SNDRV_PCM_FMTBIT_S24_LE |
+                SNDRV_PCM_FMTBIT_S32_LE),
+    .rates = SNDRV_PCM_RATE_CONTINUOUS | SNDRV_PCM_RATE_8000_192000,
+    .rate_min =
+        8000,  // NOTE: минимальная частота дискретизации (runtime->rate)
+    .rate_max =
+        192000,  // NOTE: максимальная частота дискретизации (runtime->rate)
+    .channels_min = 1,
+    .channels_max = KSOUND_MAX_CHANNELS,
+    // NOTE: 8 каналов S32 это 32 байта на кадр, размеры с запасом под них
+    .buffer_bytes_max = 512 * 1024,  // BUFFER_SIZE,
+    .period_bytes_min = 256,
+    .period_bytes_max = 64 * 1024,  // BUFFER_SIZE,
+    .periods_min = 4,
+    .periods_max = 1024,
+};
+
+// NOTE: форма волны для CMDADDWAVE, в упакованном u32 нет места для формы
+static char *waveform = "sine";
+module_param(waveform, charp, 0644);
+MODULE_PARM_DESC(waveform,
+                 "wave shape for new voices: sine, saw, square, triangle");
+
+static char const *const shape_names[KSOUND_SHAPE_COUNT] = {
+    [KSOUND_SHAPE_SINE] = "sine",
+    [KSOUND_SHAPE_SAW] = "saw",
+    [KSOUND_SHAPE_SQUARE] = "square",
+    [KSOUND_SHAPE_TRIANGLE] = "triangle",
+};
+
+// NOTE: ядро рендера, выбирается в ksound_init по возможностям процессора или
+// принудительно через параметр simd (можно менять на лету через sysfs)
+static struct ksound_render_kernel const *render_kernel = NULL;
+
+static int simd_param_set(char const *val, struct kernel_param const *kp) {
+    struct ksound_render_kernel const *kernel;
+
+    if (sysfs_streq(val, "auto"))
+        kernel = ksound_render_kernel_best();
+    else
+        kernel = ksound_render_kernel_find(val);
+
+    if (!kernel) {
+        pr_info("render kernel %s is not supported\n", val);
+        return -EINVAL;
+    }
+
+    pr_info("render kernel %s\n", kernel->name);
+    WRITE_ONCE(render_kernel, kernel);
+    return 0;
+}
+
+static int simd_param_get(char *buffer, struct kernel_param const *kp) {
+    struct ksound_render_kernel const *const kernel = READ_ONCE(render_kernel);
+
+    return sysfs_emit(buffer, "%s\n", kernel ? kernel->name : "auto");
+}
+
+static struct kernel_param_ops const simd_param_ops = {
+    .set = simd_param_set,
+    .get = simd_param_get,
+};
+
+module_param_cb(simd, &simd_param_ops, NULL, 0644);
+MODULE_PARM_DESC(simd, "render kernel: auto, scalar, sse2, avx2, neon");
+
+/*
+ * Где рендерятся периоды: hardirq - прямо в таймере (как было), softirq -
+ * таймер HRTIMER_MODE_REL_SOFT, thread - отдельный поток реального времени
+ * рендерит заранее, а таймер только двигает указатель.
+ */
+enum ksound_render_mode {
+    KSOUND_RENDER_HARDIRQ,
+    KSOUND_RENDER_SOFTIRQ,
+    KSOUND_RENDER_THREAD,
+    KSOUND_RENDER_MODE_COUNT,
+};
+
+static char const *const render_mode_names[KSOUND_RENDER_MODE_COUNT] = {
+    [KSOUND_RENDER_HARDIRQ] = "hardirq",
+    [KSOUND_RENDER_SOFTIRQ] = "softirq",
+    [KSOUND_RENDER_THREAD] = "thread",
+};
+
+// NOTE: поток создаётся в ksound_init, поэтому режим меняется только при
+// загрузке модуля
+static int render_mode = KSOUND_RENDER_HARDIRQ;
+
+static int render_mode_param_set(char const *val,
+                                 struct kernel_param const *kp) {
+    int i;
+
+    for (i = 0; i < KSOUND_RENDER_MODE_COUNT; i++) {
+        if (sysfs_streq(val, render_mode_names[i])) {
+            render_mode = i;
+            return 0;
+        }
+    }
+
+    pr_info("unknown render mode %s\n", val);
+    return -EINVAL;
+}
+
+static int render_mode_param_get(char *buffer, struct kernel_param const *kp) {
+    return sysfs_emit(buffer, "%s\n", render_mode_names[render_mode]);
+}
+
+static struct kernel_param_ops const render_mode_param_ops = {
+    .set = render_mode_param_set,
+    .get = render_mode_param_get,
+};
+
+module_param_cb(render_mode, &render_mode_param_ops, NULL, 0444);
+MODULE_PARM_DESC(render_mode, "where periods are rendered: hardirq, softirq, "
+                              "thread");
+
+/*
+ * Режим таймеров захвата и петли. В режиме thread таймер тоже мягкий,
+ * рендера в нём нет.
+ */
+static enum hrtimer_mode ksound_timer_mode(void) {
+    return render_mode == KSOUND_RENDER_HARDIRQ ? HRTIMER_MODE_REL
+                                                : HRTIMER_MODE_REL_SOFT;
+}
+
+static int render_ahead = 2;
+module_param(render_ahead, int, 0644);
+MODULE_PARM_DESC(render_ahead,
+                 "periods rendered ahead of the pointer in thread mode");
+
+// NOTE: пределы для подстройки render_ahead по запасу времени рендера, см.
+// ksound_adapt_ahead. Равные пределы отключают подстройку
+static int render_ahead_min = 1;
+module_param(render_ahead_min, int, 0644);
+MODULE_PARM_DESC(render_ahead_min, "lower limit of adaptive render_ahead");
+
+static int render_ahead_max = 8;
+module_param(render_ahead_max, int, 0644);
+MODULE_PARM_DESC(render_ahead_max, "upper limit of adaptive render_ahead");
+
+// NOTE: запас громкости смеси, обратное к нему считается здесь один раз, а
+// рендер только умножает (см. KSOUND_MASTER_GAIN)
+static int headroom = 4;
+static s32 master_gain = KSOUND_MASTER_GAIN(4);
+
+static int headroom_param_set(char const *val, struct kernel_param const *kp) {
+    int value;
+    int const err = kstrtoint(val, 0, &value);
+
+    if (err) return err;
+
+    if (value < 1 || value > KSOUND_MASTER_ONE) {
+        pr_info("headroom %d out of range 1..%d\n", value, KSOUND_MASTER_ONE);
+        return -EINVAL;
+    }
+
+    headroom = value;
+    WRITE_ONCE(master_gain, KSOUND_MASTER_GAIN(value));
+    return 0;
+}
+
+static int headroom_param_get(char *buffer, struct kernel_param const *kp) {
+    return sysfs_emit(buffer, "%d\n", headroom);
+}
+
+static struct kernel_param_ops const headroom_param_ops = {
+    .set = headroom_param_set,
+    .get = headroom_param_get,
+};
+
+module_param_cb(headroom, &headroom_param_ops, NULL, 0644);
+MODULE_PARM_DESC(headroom,
+                 "full-scale voices that fit in the mix before soft clipping");
+
+static int max_events = 16384;
+module_param(max_events, int, 0444);
+MODULE_PARM_DESC(max_events, "maximum number of pending timestamped commands");
+
+static bool idle_enable = true;
+module_param_named(idle, idle_enable, bool, 0644);
+MODULE_PARM_DESC(idle, "stop rendering after a buffer of silence");
+
+static int render_cpu = -1;
+module_param(render_cpu, int, 0444);
+MODULE_PARM_DESC(render_cpu, "cpu to pin the render thread to, -1 for any");
+
+// NOTE: помощники параллельного рендера, создаются в ksound_init
+static char *render_workers = "";
+module_param(render_workers, charp, 0444);
+MODULE_PARM_DESC(render_workers,
+                 "cpu list for parallel render helpers, e.g. 2-5, empty - off");
+
+static int parallel_voices = 512;
+module_param(parallel_voices, int, 0644);
+MODULE_PARM_DESC(parallel_voices,
+                 "voice count from which a period is split across helpers");
+
+static struct ksound_workers *workers = NULL;
+
+static int worker_stats_set(char const *val, struct kernel_param const *kp) {
+    return -EPERM;
+}
+
+static int worker_stats_get(char *buffer, struct kernel_param const *kp) {
+    return ksound_workers_stats(workers, buffer);
+}
+
+static struct kernel_param_ops const worker_stats_ops = {
+    .set = worker_stats_set,
+    .get = worker_stats_get,
+};
+
+module_param_cb(worker_stats, &worker_stats_ops, NULL, 0444);
+MODULE_PARM_DESC(worker_stats, "per-cpu timing of the parallel render helpers");
+
+// NOTE: таблицы ~130 КБ, строятся один раз в ksound_init
+static struct ksound_wavetables wavetables;
+
+static int max_voices = 4096;
+module_param(max_voices, int, 0444);
+MODULE_PARM_DESC(max_voices, "maximum number of voices per command ring");
+
+// NOTE: слоты сессии выделяются при её создании, поэтому ёмкость сессии
+// меньше max_voices, а stream_voices ограничивает память всех сессий потока
+static int session_voices = 1024;
+module_param(session_voices, int, 0444);
+MODULE_PARM_DESC(session_voices,
+                 "number of voices per ioctl session, at most max_voices");
+
+static int stream_voices = 16384;
+module_param(stream_voices, int, 0444);
+MODULE_PARM_DESC(stream_voices,
+                 "total number of voices of all ioctl sessions of a stream");
+
+// NOTE: ALSA сама ограничивает число substream, больше и не нужно
+#define KSOUND_MAX_SUBSTREAMS 32
+
+static int substreams = 1;
+module_param(substreams, int, 0444);
+MODULE_PARM_DESC(substreams, "number of independent capture substreams");
+
+static bool loopback = true;
+module_param(loopback, bool, 0444);
+MODULE_PARM_DESC(loopback, "add a playback/capture loopback pair as device 1");
+
+static int pcm_buffer_bytes = 64 * 1024;
+module_param(pcm_buffer_bytes, int, 0444);
+MODULE_PARM_DESC(pcm_buffer_bytes,
+                 "size of the read() stream buffer, rounded up to power of 2");
+
+/*
+ * Форма волны по имени из параметра модуля, неизвестное имя - синус.
+ */
+static int ksound_shape_from_name(char const *name) {
+    int i;
+
+    for (i = 0; i < KSOUND_SHAPE_COUNT; i++)
+        if (name && sysfs_streq(name, shape_names[i])) return i;
+
+    return KSOUND_SHAPE_SINE;
+}
+
+/*
+ * Генерирует один пилообразный сигнал.
+ */
+// static void make_saw_wave(s16 *samples, size_t count, int rate, u32 wave) {
+//     size_t i;
+//     // TODO: int const amp = GETWAVEAMP(wave);
+//     int phase = GETWAVEPHASE(wave);
+//     int const freq = GETWAVEFREQ(wave);
+//
+//     for (i = 0; i < count; i++) {
+//         // NOTE: 65536, 32768, 16384, 8192, 4096 чтобы сделать потише
+//         s16 const sample = (s16)(((phase * 8192) / rate) - 4096);
+//
+//         phase += freq;
+//         if (phase >= rate) phase -= rate;
+//
+//         // NOTE: записать дискрету L+R, не работает с другим количество
+//         каналов samples[i * 2 + 0] = sample; samples[i * 2 + 1] = sample;
+//     }
+// }
+
+/*
+ * Генерирует один гармонический сигнал.
+ */
+// static void make_sine_wave(s16 *samples, size_t count, int rate, u32 wave) {
+//     int i;
+//     // TODO: int const amp = GETWAVEAMP(wave);
+//     int phase = GETWAVEPHASE(wave);
+//     int const freq = GETWAVEFREQ(wave);
+//     int const step = (360 * freq) / rate;
+//
+//     for (i = 0; i < count; i++) {
+//         // NOTE: -0x7fffffff .. +0x7fffffff
+//         s32 const sample = __fixp_sin32(phase) >> 16;
+//
+//         phase += step;
+//         if (phase >= 360) phase -= 360;
+//
+//         samples[i * 2 + 0] = (s16)sample;
+//         samples[i * 2 + 1] = (s16)sample;
+//     }
+// }
+
+/*
+ * Применяет одно событие к волнам кольца.
+ */
+static void ksound_event_apply(struct ksound_stream *stream,
+                               struct ksound_event const *e) {
+    struct ksound_voices *const v = stream->ring_voices;
+
+    switch (e->op) {
+        case KSOUND_RING_ADD:
+            if (v->count >= max_voices) {
+                stream->ring_dropped++;
+                break;
+            }
+
+            ksound_voices_set(
+                v, v->count, &wavetables, e->wave,
+                e->shape < KSOUND_SHAPE_COUNT ? e->shape : KSOUND_SHAPE_SINE);
+            v->id[v->count] = stream->ring_next_id++;
+
+            // NOTE: конец волны тоже точно по кадру. Место в очереди есть:
+            // само событие только что из неё вынуто
+            if (e->duration) {
+                struct ksound_event const end = {
+                    .frame = e->frame + e->duration,
+                    .wave = v->id[v->count],
+                    .op = KSOUND_EVENT_END,
+                };
+
+                ksound_events_push(&stream->events, &end);
+            }
+
+            v->count++;
+            break;
+
+        case KSOUND_RING_REMOVE:
+            ksound_voices_remove_freq(v, GETWAVEFREQ(e->wave));
+            break;
+
+        case KSOUND_RING_UPDATE:
+            ksound_voices_update_freq(v, &wavetables, e->wave);
+            break;
+
+        case KSOUND_RING_CLEAR:
+            v->count = 0;
+            break;
+
+        case KSOUND_EVENT_END:
+            ksound_voices_remove_id(v, e->wave);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*
+ * Применяет все события с кадром не позже frame и возвращает сколько кадров
+ * (не больше limit) можно рендерить до следующего события.
+ */
+static size_t ksound_events_run(struct ksound_stream *stream, u64 frame,
+                                size_t limit) {
+    struct ksound_event const *next;
+
+    while ((next = ksound_events_peek(&stream->events)) &&
+           next->frame <= frame) {
+        struct ksound_event e;
+
+        ksound_events_pop(&stream->events, &e);
+        ksound_event_apply(stream, &e);
+    }
+
+    if (next && next->frame - frame < limit) return next->frame - frame;
+    return limit;
+}
+
+/*
+ * Переносит новые команды кольца в очередь событий. Вызывается из рендера раз
+ * за период, now - первый кадр периода: команды без метки или с прошедшей
+ * меткой применяются с него. Кольцо пишет пространство пользователя, поэтому
+ * каждое поле команды читается один раз и проверяется. Если очередь полна,
+ * команды остаются в кольце до следующего периода.
+ */
+static void ksound_ring_drain(struct ksound_stream *stream, u64 now) {
+    struct ksound_ring *const ring = stream->cmd_ring;
+    u32 const head = smp_load_acquire(&ring->head);
+    u32 tail = stream->ring_tail;
+    u32 pending = head - tail;
+    struct eventfd_ctx *ctx;
+
+    if (pending == 0) return;
+
+    // NOTE: испорченный head, больше одного круга не читаем
+    if (pending > KSOUND_RING_SIZE) pending = KSOUND_RING_SIZE;
+
+    for (; pending > 0; pending--, tail++) {
+        struct ksound_ring_cmd const *const cmd =
+            &ring->cmds[tail & (KSOUND_RING_SIZE - 1)];
+        struct ksound_event const e = {
+            .frame = max_t(u64, READ_ONCE(cmd->frame), now),
+            .wave = READ_ONCE(cmd->wave),
+            .duration = READ_ONCE(cmd->duration),
+            .op = READ_ONCE(cmd->op),
+            .shape = READ_ONCE(cmd->shape),
+        };
+
+        // NOTE: внутренние операции пространству пользователя недоступны
+        if (e.op == KSOUND_RING_NOP || e.op > KSOUND_RING_CLEAR) continue;
+
+        if (!ksound_events_push(&stream->events, &e)) break;
+    }
+
+    stream->ring_tail = tail;
+    smp_store_release(&ring->tail, tail);
+
+    // NOTE: в кольце появилось место, разбудить poll и eventfd
+    wake_up(&stream->cmd_ring_wq);
+
+    rcu_read_lock();
+    ctx = rcu_dereference(stream->cmd_ring_eventfd);
+    if (ctx) eventfd_signal(ctx, 1);
+    rcu_read_unlock();
+}
+
+/*
+ * Кладёт отрендеренный период в поток для read(). Если читатель отстал и места
+ * нет, период теряется целиком, чтобы в потоке не было половин периодов.
+ */
+static void ksound_pcm_push(struct ksound_stream *stream, void const *samples,
+                            size_t bytes) {
+    if (kfifo_avail(&stream->pcm_fifo) < bytes) {
+        stream->pcm_overruns++;
+        return;
+    }
+
+    kfifo_in(&stream->pcm_fifo, samples, bytes);
+    wake_up(&stream->pcm_wq);
+}
+
+/*
+ * Добавляет к периоду захвата столько же байт из петли воспроизведения, чего
+ * не хватило остаётся как есть. Возвращает 1 если звук петли был.
+ */
+static int ksound_loop_mix(struct ksound_loop *loop,
+                           struct snd_pcm_runtime *runtime, u8 *samples,
+                           size_t bytes) {
+    ksound_add_fn const add = loop->add;
+    unsigned int got;
+
+    if (!add || !loop->scratch) return 0;
+
+    got = kfifo_out(&loop->fifo, loop->scratch, bytes);
+    if (got == 0) return 0;
+
+    add(samples, loop->scratch, bytes_to_samples(runtime, got));
+    return 1;
+}
+
+/*
+ * Как ksound_mix_waves, но набор от parallel_voices волн делится между
+ * помощниками (параметр render_workers). Если пул занят другим потоком,
+ * набор рендерится целиком здесь. Каждая сессия делится отдельно: много
+ * сессий, в каждой меньше parallel_voices волн, рендерятся на одном
+ * процессоре.
+ */
+static int ksound_mix_parallel(s32 *accum, size_t frame_count, int rate,
+                               struct ksound_voices *v,
+                               struct ksound_render_kernel const *kernel) {
+    if (workers && v->count >= READ_ONCE(parallel_voices)) {
+        ksound_voices_retune(v, rate);
+        if (ksound_workers_render(workers, accum, frame_count, v, kernel))
+            return v->count;
+    }
+
+    return ksound_mix_waves(accum, frame_count, rate, v, kernel);
+}
+
+/*
+ * Переносит изменения пулов всех сессий потока в их состояние рендера.
+ * Возвращает сколько волн ioctl звучит во всех сессиях.
+ */
+static int ksound_sessions_sync(struct ksound_stream *stream, int rate) {
+    struct ksound_session *session;
+    int voice_count = 0;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(session, &stream->sessions, node) {
+        u64 apply_ns;
+        int const changes = ksound_pool_sync(session->pool, session->voices,
+                                             &wavetables, rate, &apply_ns);
+
+        if (changes) {
+            ksound_hist_add(&stream->apply_hist, apply_ns);
+            trace_ksound_set_apply(stream->index, changes,
+                                   session->voices->count, apply_ns);
+        }
+        voice_count += session->voices->count;
+    }
+    rcu_read_unlock();
+
+    return voice_count;
+}
+
+/*
+ * Смешивает волны всех сессий потока в accum. Сессия добавленная после
+ * ksound_sessions_sync ещё пуста. Возвращает количество волн.
+ */
+static int ksound_sessions_mix(struct ksound_stream *stream, s32 *accum,
+                               size_t frame_count, int rate,
+                               struct ksound_render_kernel const *kernel) {
+    struct ksound_session *session;
+    int wave_count = 0;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(session, &stream->sessions, node)
+        wave_count += ksound_mix_parallel(accum, frame_count, rate,
+                                          session->voices, kernel);
+    rcu_read_unlock();
+
+    return wave_count;
+}
+
+/*
+ * Рендер одного периода с индексом period (счёт от START) в его место в DMA
+ * буфере. Вызывается из таймера (hardirq или softirq) или из потока рендера,
+ * но всегда только из одного места за раз: состояние рендера сессий и кольца
+ * ничем не защищено.
+ */
+static void ksound_render_period(struct ksound_stream *stream,
+                                 unsigned long period) {
+    struct snd_pcm_runtime *const runtime = stream->substream->runtime;
+
+    // NOTE: period - аудио фрагмент, frames - количество дискрет на фрагмент.
+    // frames_to_bytes учитывает формат и число каналов потока
+    size_t const period_bytes = frames_to_bytes(runtime, runtime->period_size);
+    size_t const offset = (period % runtime->periods) * period_bytes;
+    u8 *const samples = runtime->dma_area + offset;
+    struct ksound_render_kernel const *const kernel = READ_ONCE(render_kernel);
+    u64 const start = (u64)period * runtime->period_size;
+    u64 const start_ns = ktime_get_ns();
+    struct ksound_master const master = {
+        .gain = READ_ONCE(master_gain),
+        .clip = wavetables.clip,
+    };
+    size_t pos, len;
+    int wave_count, voice_count;
+    bool silent;
+    u64 ns;
+
+    // NOTE: runtime->dma_bytes размер DMA области в байтах, заметил что DMA
+    // область может быть чуть больше чем размер буфера
+    BUG_ON(runtime->dma_bytes < offset + period_bytes);
+
+    // NOTE: только изменённые с прошлого периода волны ioctl
+    voice_count = ksound_sessions_sync(stream, runtime->rate);
+
+    if (READ_ONCE(stream->ring_reset)) {
+        stream->events.count = 0;
+        stream->ring_voices->count = 0;
+        WRITE_ONCE(stream->ring_reset, false);
+    }
+
+    ksound_ring_drain(stream, start);
+
+    voice_count += stream->ring_voices->count;
+    trace_ksound_render_start(stream->index, period, voice_count);
+
+    // NOTE: после удаления последней волны тишину нужно записать в DMA
+    // буфер, иначе там остаётся старый звук. Поэтому периоды тишины
+    // считаются, и только после целого буфера тишины таймер перестаёт
+    // рендерить (см. ksound_timer_callback)
+    // NOTE: волны ioctl и волны кольца смешиваются в одном буфере накопления
+    memset(stream->accum, 0, runtime->period_size * sizeof(*stream->accum));
+    wave_count = ksound_sessions_mix(stream, stream->accum,
+                                     runtime->period_size, runtime->rate,
+                                     kernel);
+    silent = wave_count == 0;
+
+    // NOTE: волны кольца меняются событиями, поэтому период режется на
+    // отрезки по кадрам событий и каждый отрезок рендерится своим набором
+    for (pos = 0; pos < runtime->period_size; pos += len) {
+        int count;
+
+        len =
+            ksound_events_run(stream, start + pos, runtime->period_size - pos);
+        count = ksound_mix_waves(stream->accum + pos, len, runtime->rate,
+                                 stream->ring_voices, kernel);
+        stream->emit(samples + frames_to_bytes(runtime, pos),
+                     stream->accum + pos, len, &master);
+        silent &= count == 0;
+    }
+
+    // NOTE: звук петли поверх волн, уже в формате потока
+    if (stream->loop &&
+        ksound_loop_mix(stream->loop, runtime, samples, period_bytes))
+        silent = false;
+
+    WRITE_ONCE(stream->silent_periods, silent ? stream->silent_periods + 1 : 0);
+
+    // NOTE: без читателей копию не делаем
+    if (atomic_read(&stream->pcm_readers))
+        ksound_pcm_push(stream, samples, period_bytes);
+
+    ns = ktime_get_ns() - start_ns;
+    stream->rendered_periods++;
+    ksound_hist_add(&stream->render_hist, ns);
+    trace_ksound_render_end(stream->index, period, voice_count, ns);
+}
+
+/*
+ * Часы потока. Кадр под указателем каждый раз считается заново от времени
+ * START, а не складывается из периодов округлённых до нс, поэтому дробная
+ * часть кадра не теряется и указатель не уплывает от частоты. Произведение
+ * 128 битное (mul_u64_u32_div), переполнения нет.
+ */
+static u64 ksound_clock_frames(ktime_t start, unsigned int rate, ktime_t now) {
+    s64 const ns = ktime_to_ns(ktime_sub(now, start));
+
+    if (ns <= 0) return 0;
+    return mul_u64_u32_div(ns, rate, NSEC_PER_SEC);
+}
+
+/*
+ * Момент не раньше которого ksound_clock_frames дойдёт до кадра frame.
+ */
+static ktime_t ksound_clock_time(ktime_t start, unsigned int rate, u64 frame) {
+    return ktime_add_ns(start, mul_u64_u32_div(frame, NSEC_PER_SEC, rate) + 1);
+}
+
+// NOTE: окно в периодах, после которого глубина может уменьшиться
+#define KSOUND_SLACK_WINDOW 64
+
+/*
+ * Запас в нс между концом рендера и моментом, когда часы потока дойдут до
+ * кадра deadline. Отрицательный запас - xrun: указатель ждал рендер. Запас
+ * меньше четверти периода считается близким к xrun.
+ */
+static s64 ksound_render_slack(struct ksound_stream *stream, u64 deadline) {
+    struct snd_pcm_runtime *const runtime = stream->substream->runtime;
+    s64 const period_ns =
+        div_u64(runtime->period_size * NSEC_PER_SEC, runtime->rate);
+    s64 const slack = ktime_to_ns(ktime_sub(
+        ksound_clock_time(stream->start_time, runtime->rate, deadline),
+        ktime_get()));
+
+    if (slack < 0) {
+        stream->xruns++;
+    } else {
+        ksound_hist_add(&stream->slack_hist, slack);
+        if (slack < period_ns / 4) stream->near_xruns++;
+    }
+
+    if (slack < stream->slack_min) stream->slack_min = slack;
+    return slack;
+}
+
+/*
+ * Подстройка render_ahead в режиме thread после рендера периода period. Срок
+ * периода - начало периода по часам потока. Если запас близок к xrun, глубина
+ * сразу растёт на период. Если за KSOUND_SLACK_WINDOW периодов запас ни разу
+ * не был меньше периода с четвертью, глубина уменьшается на период: на
+ * меньшей глубине запаса всё равно останется больше четверти.
+ */
+static void ksound_adapt_ahead(struct ksound_stream *stream,
+                               unsigned long period) {
+    struct snd_pcm_runtime *const runtime = stream->substream->runtime;
+    s64 const period_ns =
+        div_u64(runtime->period_size * NSEC_PER_SEC, runtime->rate);
+    s64 const slack =
+        ksound_render_slack(stream, (u64)period * runtime->period_size);
+    int depth = stream->render_ahead;
+
+    if (slack < period_ns / 4) {
+        if (depth < stream->ahead_max) depth++;
+    } else if (++stream->slack_window >= KSOUND_SLACK_WINDOW) {
+        if (stream->slack_min >= period_ns + period_ns / 4 &&
+            depth > stream->ahead_min)
+            depth--;
+    } else {
+        return;
+    }
+
+    // NOTE: новое окно после каждого решения
+    stream->slack_window = 0;
+    stream->slack_min = S64_MAX;
+
+    if (depth == stream->render_ahead) return;
+
+    trace_ksound_render_ahead(stream->index, depth, slack);
+    pr_debug("stream %d render_ahead %d, slack %lld ns\n", stream->index,
+             depth, slack);
+    WRITE_ONCE(stream->render_ahead, depth);
+}
+
+/*
+ * Есть ли у потока рендера работа: поток запущен и впереди указателя меньше
+ * render_ahead готовых периодов.
+ */
+static bool ksound_render_pending(struct ksound_stream *stream) {
+    return atomic_read(&stream->running) && !READ_ONCE(stream->idle) &&
+           (long)(stream->render_period - READ_ONCE(stream->hw_period)) <
+               READ_ONCE(stream->render_ahead);
+}
+
+/*
+ * Поток рендера для render_mode=thread. Держит render_ahead периодов готовыми
+ * впереди указателя, таймер только двигает указатель и будит поток.
+ */
+static int ksound_render_thread(void *data) {
+    struct ksound_stream *const stream = data;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(stream->render_wq,
+                                 kthread_should_stop() ||
+                                     ksound_render_pending(stream));
+
+        // NOTE: sync_stop ждёт этот мьютекс перед prepare и hw_free
+        mutex_lock(&stream->render_lock);
+
+        while (ksound_render_pending(stream)) {
+            unsigned long const hw_period = READ_ONCE(stream->hw_period);
+
+            // NOTE: опоздали, догоняем указатель вместо рендера прошлого
+            if ((long)(stream->render_period - hw_period) < 0)
+                WRITE_ONCE(stream->render_period, hw_period);
+
+            ksound_render_period(stream, stream->render_period);
+            smp_store_release(&stream->render_period,
+                              stream->render_period + 1);
+            ksound_adapt_ahead(stream, stream->render_period - 1);
+        }
+
+        mutex_unlock(&stream->render_lock);
+    }
+
+    return 0;
+}
+
+/*
+ * Есть ли что играть: волны ioctl, волны и события кольца, необработанные
+ * команды в кольце или читатели потока read(), которым нужны периоды тишины.
+ */
+static bool ksound_has_work(struct ksound_stream *stream) {
+    struct ksound_session *session;
+    bool voices = false;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(session, &stream->sessions, node) {
+        if (session->voices->count || ksound_pool_pending(session->pool)) {
+            voices = true;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return voices || stream->ring_voices->count || stream->events.count ||
+           READ_ONCE(stream->cmd_ring->head) != READ_ONCE(stream->ring_tail) ||
+           atomic_read(&stream->pcm_readers) ||
+           (stream->loop && atomic_read(&stream->loop->running));
+}
+
+/*
+ * Обработка сэмплов буфера. runtime->rate частота дискретизации канала.
+ * Таймер срабатывает на границах периодов по часам потока, указатель между
+ * ними считает snd_ksound_capture_pointer.
+ */
+static enum hrtimer_restart ksound_timer_callback(struct hrtimer *timer) {
+    struct ksound_stream *const stream =
+        container_of(timer, struct ksound_stream, timer);
+    struct snd_pcm_substream *const substream = stream->substream;
+    struct snd_pcm_runtime *const runtime = substream->runtime;
+    ktime_t const now = ktime_get();
+    s64 const late_ns =
+        ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer)));
+    u64 const frame =
+        ksound_clock_frames(stream->start_time, runtime->rate, now);
+    unsigned long const hw_period = div_u64(frame, runtime->period_size);
+    bool const was_idle = stream->idle;
+    bool idle = was_idle;
+    unsigned long next;
+
+    if (!atomic_read(&stream->running)) return HRTIMER_NORESTART;
+
+    stream->ticks++;
+    ksound_hist_add(&stream->jitter_hist, max_t(s64, late_ns, 0));
+    trace_ksound_timer(stream->index, hw_period, late_ns, was_idle);
+
+    if (idle && ksound_has_work(stream)) {
+        // NOTE: до указателя в DMA тишина простоя. Таймер отрендерит текущий
+        // период ниже, поток рендера начнёт со следующего, чтобы указатель
+        // не откатился назад
+        stream->silent_periods = 0;
+        WRITE_ONCE(stream->render_period,
+                   hw_period + (render_mode == KSOUND_RENDER_THREAD));
+        idle = false;
+    }
+
+    if (idle) {
+        // NOTE: в DMA уже целый буфер тишины, рендерить нечего
+    } else if (render_mode == KSOUND_RENDER_THREAD) {
+        // NOTE: поток не успел, указатель стоит на начале этого периода
+        if (!was_idle &&
+            (long)(smp_load_acquire(&stream->render_period) - hw_period) <= 0)
+            stream->late_periods++;
+    } else {
+        long const behind = hw_period - stream->render_period;
+
+        // NOTE: период под указателем рендерится целиком в его начале, поэтому
+        // всё левее указателя уже в DMA. Опоздание на целый буфер не догоняем
+        if (behind >= (long)runtime->periods) {
+            stream->late_periods += behind;
+            WRITE_ONCE(stream->render_period, hw_period);
+        } else if (behind > 0) {
+            stream->late_periods += behind;
+        }
+
+        while ((long)(stream->render_period - hw_period) <= 0) {
+            ksound_render_period(stream, stream->render_period);
+            smp_store_release(&stream->render_period,
+                              stream->render_period + 1);
+        }
+
+        // NOTE: глубины здесь нет, срок периода под указателем - его конец
+        ksound_render_slack(stream,
+                            (u64)(hw_period + 1) * runtime->period_size);
+    }
+
+    // NOTE: указатель снова ограничен отрендеренным только после рендера
+    if (idle != was_idle) smp_store_release(&stream->idle, false);
+
+    if (hw_period != stream->hw_period) {
+        WRITE_ONCE(stream->hw_period, hw_period);
+        WRITE_ONCE(stream->cmd_ring->frame, frame);
+
+        if (render_mode == KSOUND_RENDER_THREAD) wake_up(&stream->render_wq);
+
+        // NOTE: уведомить ALSA
+        snd_pcm_period_elapsed(substream);
+    } else if (render_mode == KSOUND_RENDER_THREAD) {
+        wake_up(&stream->render_wq);
+    }
+
+    // NOTE: весь буфер уже из тишины и играть нечего, переходим на грубый тик
+    if (!stream->idle && READ_ONCE(idle_enable) &&
+        READ_ONCE(stream->silent_periods) >= runtime->periods &&
+        !ksound_has_work(stream))
+        WRITE_ONCE(stream->idle, true);
+
+    // NOTE: следующая граница периода по часам потока, а не now + период:
+    // опоздание одного тика не сдвигает следующие
+    next = hw_period + (stream->idle ? stream->idle_step : 1);
+    hrtimer_set_expires(timer,
+                        ksound_clock_time(stream->start_time, runtime->rate,
+                                          (u64)next * runtime->period_size));
+
+    return HRTIMER_RESTART;
+}
+
+/*
+ * Если вторая сторона петли уже настроена, ограничивает runtime её форматом,
+ * частотой и числом каналов. Возвращает отрицательный код ошибки.
+ */
+static int ksound_loop_constrain(struct ksound_loop *loop,
+                                 struct snd_pcm_runtime *runtime,
+                                 bool playback) {
+    int err = 0;
+
+    mutex_lock(&loop->lock);
+    if (playback ? loop->capture_set : loop->playback_set) {
+        err = snd_pcm_hw_constraint_single(runtime, SNDRV_PCM_HW_PARAM_FORMAT,
+                                           (__force unsigned int)loop->format);
+        if (err >= 0)
+            err = snd_pcm_hw_constraint_single(
+                runtime, SNDRV_PCM_HW_PARAM_RATE, loop->rate);
+        if (err >= 0)
+            err = snd_pcm_hw_constraint_single(
+                runtime, SNDRV_PCM_HW_PARAM_CHANNELS, loop->channels);
+    }
+    mutex_unlock(&loop->lock);
+
+    return err < 0 ? err : 0;
+}
+
+/*
+ * Запоминает параметры стороны петли. Вторая сторона могла настроиться между
+ * open и hw_params этой, тогда параметры должны совпасть. Возвращает
+ * отрицательный код ошибки.
+ */
+static int ksound_loop_configure(struct ksound_loop *loop,
+                                 struct snd_pcm_hw_params *hw_params,
+                                 bool playback) {
+    int err = 0;
+
+    mutex_lock(&loop->lock);
+    if ((playback ? loop->capture_set : loop->playback_set) &&
+        (params_format(hw_params) != loop->format ||
+         params_rate(hw_params) != loop->rate ||
+         params_channels(hw_params) != loop->channels)) {
+        pr_info("loopback sides differ, expected format=%d, rate=%u, "
+                "channels=%u\n",
+                loop->format, loop->rate, loop->channels);
+        err = -EINVAL;
+    } else {
+        loop->format = params_format(hw_params);
+        loop->rate = params_rate(hw_params);
+        loop->channels = params_channels(hw_params);
+        if (playback)
+            loop->playback_set = true;
+        else
+            loop->capture_set = true;
+    }
+    mutex_unlock(&loop->lock);
+
+    return err;
+}
+
+/*
+ * Сторона петли больше не настроена (hw_free).
+ */
+static void ksound_loop_release(struct ksound_loop *loop, bool playback) {
+    mutex_lock(&loop->lock);
+    if (playback)
+        loop->playback_set = false;
+    else
+        loop->capture_set = false;
+    mutex_unlock(&loop->lock);
+}
+
+/*
+ * открыть PCM поток
+ */
+static int snd_ksound_capture_open(struct snd_pcm_substream *substream) {
+    struct ksound_card *card = substream->pcm->private_data;
+    // NOTE: устройство 0 - независимые потоки по номеру substream, устройство
+    // 1 - захват петли, он последний
+    int const index = substream->pcm->device == 0 ? substream->number
+                                                  : card->stream_count - 1;
+    struct ksound_stream *stream = &card->streams[index];
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    int err;
+
+    stream->substream = substream;
+    substream->private_data = stream;
+
+    // NOTE: обязательно заполнить во время open, иначе ошибка открытия потока!
+    runtime->hw = snd_ksound_capture_hw;
+
+    // TODO: snd_pcm_hw_constraint_single(runtime, SNDRV_PCM_HW_PARAM_RATE,
+    // SAMPLE_RATE);
+    // TODO: snd_pcm_hw_constraint_single(runtime,
+    // SNDRV_PCM_HW_PARAM_CHANNELS, 2);
+    // TODO: snd_pcm_hw_constraint_single(runtime,
+    // SNDRV_PCM_HW_PARAM_FORMAT, SNDRV_PCM_FORMAT_S16_LE);
+    // NOTE: целое количество периодов в буфере, иначе период с индексом
+    // hw_period % periods может вылезти за конец буфера
+    snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+    // TODO: snd_pcm_hw_constraint_minmax(runtime,
+    // SNDRV_PCM_HW_PARAM_BUFFER_BYTES, 64, 1*1024*1024);
+
+    // NOTE: формат может быть уже выбран воспроизведением петли
+    if (stream->loop) {
+        err = ksound_loop_constrain(stream->loop, runtime, false);
+        if (err) {
+            stream->substream = NULL;
+            substream->private_data = NULL;
+            return err;
+        }
+    }
+
+    pr_info("snd_ksound_capture_open substream=%d\n", substream->number);
+    return 0;
+}
+
+static int snd_ksound_capture_hw_params(struct snd_pcm_substream *substream,
+                                        struct snd_pcm_hw_params *hw_params) {
+    struct ksound_stream *stream = substream->private_data;
+    size_t const buffer_bytes = params_buffer_bytes(hw_params);
+    size_t const alloc_bytes = ALIGN(buffer_bytes, PAGE_SIZE);
+    int const channels = params_channels(hw_params);
+    int format;
+
+    pr_info("snd_ksound_capture_hw_params buffer_bytes=%lu, alloc_bytes=%lu\n",
+            buffer_bytes, alloc_bytes);
+
+    if (alloc_bytes <= 0) {
+        pr_info("snd_ksound_capture_hw_params bad alloc_bytes=%lu\n",
+                alloc_bytes);
+        return -EINVAL;
+    }
+
+    // NOTE: исправляется выравниванием буфера по границе страницы alloc_bytes
+    // [Сб окт 11 20:22:47 2025] BUG: KASAN: vmalloc-out-of-bounds in
+    // snd_pcm_hw_params+0x10ea/0x15a0 [snd_pcm] [Сб окт 11 20:22:47 2025] Write
+    // of size 20480 at addr ffffc900001b7000 by task pulseaudio/1509 [Сб окт 11
+    // 20:22:47 2025] CPU: 4 PID: 1509 Comm: pulseaudio Tainted: G    B OE
+    // N 6.1.130 #3 [Сб окт 11 20:22:47 2025] Hardware name: innotek GmbH
+    // VirtualBox/VirtualBox, BIOS VirtualBox 12/01/2006
+
+    switch (params_format(hw_params)) {
+        case SNDRV_PCM_FORMAT_S16_LE:
+            format = KSOUND_FORMAT_S16;
+            break;
+        case SNDRV_PCM_FORMAT_S24_LE:
+            format = KSOUND_FORMAT_S24;
+            break;
+        case SNDRV_PCM_FORMAT_S32_LE:
+            format = KSOUND_FORMAT_S32;
+            break;
+        default:
+            format = -1;
+            break;
+    }
+
+    // NOTE: своя функция вывода на каждое сочетание, в рендере без ветвлений
+    stream->emit = ksound_emit_for(format, channels);
+    if (!stream->emit) {
+        pr_info("snd_ksound_capture_hw_params bad format=%d, channels=%d\n",
+                params_format(hw_params), channels);
+        return -EINVAL;
+    }
+
+    pr_info("snd_ksound_capture_hw_params rate=%u, format=%d, channels=%d\n",
+            params_rate(hw_params), format, channels);
+
+    // NOTE: кадры в потоке read() другого размера, старые больше не годятся
+    mutex_lock(&stream->pcm_read_lock);
+    WRITE_ONCE(stream->pcm_frame_bytes, ksound_frame_bytes(format, channels));
+    kfifo_reset_out(&stream->pcm_fifo);
+    mutex_unlock(&stream->pcm_read_lock);
+
+    // NOTE: буфер накопления на период, hw_params может вызываться повторно
+    kfree(stream->accum);
+    stream->accum =
+        kcalloc(params_period_size(hw_params), sizeof(s32), GFP_KERNEL);
+    if (!stream->accum) {
+        pr_info("snd_ksound_capture_hw_params failed to allocate accum\n");
+        return -ENOMEM;
+    }
+
+    // NOTE: захват петли складывает воспроизведение прямо в формате потока
+    if (stream->loop) {
+        struct ksound_loop *const loop = stream->loop;
+        int const err = ksound_loop_configure(loop, hw_params, false);
+
+        if (err) return err;
+
+        kfree(loop->scratch);
+        loop->scratch = kmalloc(params_period_bytes(hw_params), GFP_KERNEL);
+        if (!loop->scratch) {
+            pr_info("snd_ksound_capture_hw_params failed to allocate loop\n");
+            ksound_loop_release(loop, false);
+            return -ENOMEM;
+        }
+        loop->add = ksound_add_for(format);
+    }
+
+    // TODO: snd_pcm_lib_free_vmalloc_buffer(substream) нужно ли???
+
+    // NOTE: похоже если ALSA драйвер, то malloc если устройство то vmalloc
+    // https://www.kernel.org/doc/html/v5.1/sound/kernel-api/writing-an-alsa-driver.html
+    // return snd_pcm_lib_malloc_pages(substream, buffer_bytes);
+
+    return snd_pcm_lib_alloc_vmalloc_buffer(substream, alloc_bytes);
+}
+
+static int snd_ksound_capture_hw_free(struct snd_pcm_substream *substream) {
+    struct ksound_stream *stream = substream->private_data;
+
+    pr_info("snd_ksound_capture_hw_free\n");
+
+    // NOTE: таймер и поток рендера уже остановил
+    // snd_ksound_capture_sync_stop, ALSA вызывает его перед hw_free
+    kfree(stream->accum);
+    stream->accum = NULL;
+
+    if (stream->loop) {
+        kfree(stream->loop->scratch);
+        stream->loop->scratch = NULL;
+        stream->loop->add = NULL;
+        ksound_loop_release(stream->loop, false);
+    }
+
+    // NOTE: если ALSA то free, если устройство, то vmalloc_free
+    // https://www.kernel.org/doc/html/v4.16/sound/kernel-api/writing-an-alsa-driver.html
+    // return snd_pcm_lib_free_pages(substream);
+
+    return snd_pcm_lib_free_vmalloc_buffer(substream);
+}
+
+/*
+ * подготовка PCM потока
+ */
+static int snd_ksound_capture_prepare(struct snd_pcm_substream *substream) {
+    struct snd_pcm_runtime *runtime = substream->runtime;
+
+    // TODO: не совсем понимаю что делать в этой функции?
+    // NOTE: правильно через params_buffer_bytes(hw_params)
+    int buffer_bytes = frames_to_bytes(runtime, runtime->buffer_size);
+
+    pr_info(
+        "snd_ksound_capture_prepare buffer_size=%ld, period_size=%ld, "
+        "format=%d, buffer_bytes=%d\n",
+        runtime->buffer_size, runtime->period_size, runtime->format,
+        buffer_bytes);
+
+    return 0;
+}
+
+/*
+ * смена состояние PCM
+ */
+static int snd_ksound_capture_trigger(struct snd_pcm_substream *substream,
+                                      int cmd) {
+    struct ksound_stream *stream = substream->private_data;
+    struct snd_pcm_runtime *runtime = substream->runtime;
+
+    pr_info("snd_ksound_capture_trigger cmd=%d, dma=%p\n", cmd,
+            runtime->dma_area);
+
+    switch (cmd) {
+        case SNDRV_PCM_TRIGGER_START: {
+            u64 delay_ns = 0;
+
+            stream->hw_period = 0;
+            stream->render_period = 0;
+            stream->late_periods = 0;
+            stream->silent_periods = 0;
+            stream->idle = false;
+            stream->idle_step = max_t(unsigned long, runtime->periods / 2, 1);
+            stream->ahead_min = clamp_t(int, READ_ONCE(render_ahead_min), 1,
+                                        runtime->periods - 1);
+            stream->ahead_max =
+                clamp_t(int, READ_ONCE(render_ahead_max), stream->ahead_min,
+                        runtime->periods - 1);
+            stream->render_ahead =
+                clamp_t(int, READ_ONCE(render_ahead), stream->ahead_min,
+                        stream->ahead_max);
+            stream->slack_min = S64_MAX;
+            stream->slack_window = 0;
+
+            // NOTE: часы потока начинаются заново, метки старых событий
+            // больше ничего не значат. Волны кольца тоже снимаются, иначе
+            // волны с длительностью звучали бы бесконечно. Их трогает только
+            // рендер, поэтому снимает он сам в начале следующего периода
+            WRITE_ONCE(stream->ring_reset, true);
+
+            // NOTE: звук петли накопленный пока захват стоял уже устарел
+            if (stream->loop) kfifo_reset_out(&stream->loop->fifo);
+            WRITE_ONCE(stream->cmd_ring->frame, 0);
+
+            // NOTE: в режиме thread первый тик через период, за это время
+            // поток успевает отрендерить render_ahead периодов
+            if (render_mode == KSOUND_RENDER_THREAD)
+                delay_ns = div_u64(runtime->period_size * NSEC_PER_SEC,
+                                   runtime->rate);
+
+            // NOTE: часы потока идут с первого тика. По ним поток рендера
+            // считает запас уже для периода 0, поэтому они ставятся раньше
+            // running, а wake_up публикует их вместе с остальным состоянием
+            stream->start_time = ktime_add_ns(ktime_get(), delay_ns);
+            atomic_set(&stream->running, 1);
+            if (render_mode == KSOUND_RENDER_THREAD)
+                wake_up(&stream->render_wq);
+
+            // NOTE: запустить таймер
+            hrtimer_start(&stream->timer, ns_to_ktime(delay_ns),
+                          stream->timer_mode);
+
+            return 0;
+        }
+
+        case SNDRV_PCM_TRIGGER_STOP: {
+            unsigned long flags;
+
+            // NOTE: после этого ksound_stream_wake таймер уже не запустит
+            spin_lock_irqsave(&stream->kick_lock, flags);
+            atomic_set(&stream->running, 0);
+            spin_unlock_irqrestore(&stream->kick_lock, flags);
+
+            // NOTE: trigger вызывается под блокировкой потока PCM, которую
+            // берёт snd_pcm_period_elapsed в таймере. Ждать таймер здесь
+            // нельзя, это делает snd_ksound_capture_sync_stop
+            hrtimer_try_to_cancel(&stream->timer);
+
+            if (stream->late_periods)
+                pr_info("render was late %lu periods\n",
+                        stream->late_periods);
+            return 0;
+        }
+
+        case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+            pr_info("capture paused\n");
+            return 0;
+
+        case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+            pr_info("capture resumed\n");
+            return 0;
+
+        default:
+            return -EINVAL;
+    }
+}
+
+/*
+ * Дожидается остановки после TRIGGER_STOP, ALSA вызывает его без блокировки
+ * потока перед prepare и hw_free: таймер уже не тикает, а поток рендера
+ * дописал свой период и после STOP новый не начнёт.
+ */
+static int snd_ksound_capture_sync_stop(struct snd_pcm_substream *substream) {
+    struct ksound_stream *stream = substream->private_data;
+
+    hrtimer_cancel(&stream->timer);
+
+    mutex_lock(&stream->render_lock);
+    mutex_unlock(&stream->render_lock);
+    return 0;
+}
+
+/*
+ * Указатель на место проигрывания в буфере. Возвращает указатель в дискретах.
+ * Положение считается по часам потока в момент вызова, поэтому между тиками
+ * указатель тоже двигается, но не дальше отрендеренного.
+ */
+static snd_pcm_uframes_t snd_ksound_capture_pointer(
+    struct snd_pcm_substream *substream) {
+    struct ksound_stream *stream = substream->private_data;
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    u64 frame;
+    u32 pos;
+
+    if (!atomic_read(&stream->running)) return 0;
+
+    frame = ksound_clock_frames(stream->start_time, runtime->rate, ktime_get());
+
+    // NOTE: в простое в DMA целый буфер тишины, ограничивать нечем
+    if (!smp_load_acquire(&stream->idle))
+        frame = min_t(u64, frame,
+                      (u64)smp_load_acquire(&stream->render_period) *
+                          runtime->period_size);
+
+    // NOTE: похоже что ALSA подсистеме нужен указатель в дискретах, а не байтах
+    div_u64_rem(frame, runtime->buffer_size, &pos);
+    return pos;
+}
+
+// HACK: почему этот метод магическим образом очищает поток?
+// static snd_pcm_uframes_t snd_ksound_capture_pointer(
+//    struct snd_pcm_substream *substream) {
+//    struct ksound_stream *stream = substream->private_data;
+//    struct snd_pcm_runtime *runtime = substream->runtime;
+//    static snd_pcm_uframes_t simulated_position = 0;
+//
+//    if (atomic_read(&stream->running)) {
+//        // Advance the simulated position
+//        simulated_position += runtime->period_size;
+//        // pr_info("%lu, %lu, %p", simulated_position, runtime->period_size,
+//        runtime->dma_area);
+//
+//        // Wrap around at buffer size
+//        if (simulated_position >= runtime->buffer_size) simulated_position =
+//        0;
+//
+//        // Update the card's hardware pointer
+//        stream->hw_ptr = simulated_position;
+//    }
+//
+//    return stream->hw_ptr;
+//}
+
+/*
+ * закрыть PCM поток
+ */
+static int snd_ksound_capture_close(struct snd_pcm_substream *substream) {
+    struct ksound_stream *stream = substream->private_data;
+
+    // NOTE: substream освобождается на этапе hw_free
+    stream->substream = NULL;
+    substream->private_data = NULL;
+
+    pr_info("snd_ksound_capture_close\n");
+    return 0;
+}
+
+/*
+ * Таблица операторов PCM. Проходит цикл open, hw_params, prepare, trigger,
+ * pointer?, trigger, hw_free, close.
+ */
+// NOTE: ioctl обязательно иначе не откроется через alsaloop
+static struct snd_pcm_ops snd_ksound_capture_ops = {
+    .open = snd_ksound_capture_open,
+    .close = snd_ksound_capture_close,
+    .ioctl = snd_pcm_lib_ioctl,
+    .hw_params = snd_ksound_capture_hw_params,
+    .hw_free = snd_ksound_capture_hw_free,
+    .prepare = snd_ksound_capture_prepare,
+    .trigger = snd_ksound_capture_trigger,
+    .sync_stop = snd_ksound_capture_sync_stop,
+    .pointer = snd_ksound_capture_pointer,
+    //.page = snd_pcm_lib_get_vmalloc_page, // Use this for vmalloc buffers
+    //.copy_user
+    //.copy_kernel
+};
+
+/*
+ * Таймер воспроизведения петли. Период который клиент уже записал уходит в
+ * fifo для парного захвата, указатель двигается дальше.
+ */
+static enum hrtimer_restart ksound_loop_timer_callback(struct hrtimer *timer) {
+    struct ksound_loop *const loop =
+        container_of(timer, struct ksound_loop, timer);
+    struct snd_pcm_substream *const substream = loop->substream;
+    struct snd_pcm_runtime *const runtime = substream->runtime;
+    size_t const period_bytes = frames_to_bytes(runtime, runtime->period_size);
+    size_t const offset = (loop->hw_period % runtime->periods) * period_bytes;
+
+    if (!atomic_read(&loop->running)) return HRTIMER_NORESTART;
+
+    // NOTE: захват не запущен или отстал, период теряется целиком
+    if (kfifo_avail(&loop->fifo) < period_bytes)
+        loop->overruns++;
+    else
+        kfifo_in(&loop->fifo, runtime->dma_area + offset, period_bytes);
+
+    loop->hw_period++;
+    loop->hw_ptr = (loop->hw_period % runtime->periods) * period_bytes;
+
+    // NOTE: уведомить ALSA
+    snd_pcm_period_elapsed(substream);
+
+    // NOTE: граница следующего периода по часам петли, как у захвата.
+    // Опоздавший таймер сработает сразу ещё раз и догонит
+    hrtimer_set_expires(
+        timer, ksound_clock_time(loop->start_time, runtime->rate,
+                                 (u64)(loop->hw_period + 1) *
+                                     runtime->period_size));
+    return HRTIMER_RESTART;
+}
+
+/*
+ * открыть воспроизведение петли
+ */
+static int snd_ksound_playback_open(struct snd_pcm_substream *substream) {
+    struct ksound_card *card = substream->pcm->private_data;
+    struct ksound_loop *loop = card->loop;
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    int err;
+
+    // NOTE: возможности те же что у захвата
+    runtime->hw = snd_ksound_capture_hw;
+    snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+
+    err = ksound_loop_constrain(loop, runtime, true);
+    if (err) return err;
+
+    loop->substream = substream;
+    substream->private_data = loop;
+
+    pr_info("snd_ksound_playback_open\n");
+    return 0;
+}
+
+static int snd_ksound_playback_close(struct snd_pcm_substream *substream) {
+    struct ksound_loop *loop = substream->private_data;
+
+    loop->substream = NULL;
+    substream->private_data = NULL;
+
+    if (loop->overruns) pr_info("loopback overruns %lu\n", loop->overruns);
+    pr_info("snd_ksound_playback_close\n");
+    return 0;
+}
+
+static int snd_ksound_playback_hw_params(struct snd_pcm_substream *substream,
+                                         struct snd_pcm_hw_params *hw_params) {
+    struct ksound_loop *loop = substream->private_data;
+    int err;
+
+    pr_info("snd_ksound_playback_hw_params rate=%u, format=%d, channels=%d\n",
+            params_rate(hw_params), params_format(hw_params),
+            params_channels(hw_params));
+
+    err = ksound_loop_configure(loop, hw_params, true);
+    if (err) return err;
+
+    return snd_pcm_lib_alloc_vmalloc_buffer(
+        substream, ALIGN(params_buffer_bytes(hw_params), PAGE_SIZE));
+}
+
+static int snd_ksound_playback_hw_free(struct snd_pcm_substream *substream) {
+    struct ksound_loop *loop = substream->private_data;
+
+    pr_info("snd_ksound_playback_hw_free\n");
+
+    ksound_loop_release(loop, true);
+    return snd_pcm_lib_free_vmalloc_buffer(substream);
+}
+
+static int snd_ksound_playback_prepare(struct snd_pcm_substream *substream) {
+    return 0;
+}
+
+static int snd_ksound_playback_trigger(struct snd_pcm_substream *substream,
+                                       int cmd) {
+    struct ksound_card *card = substream->pcm->private_data;
+    struct ksound_loop *loop = substream->private_data;
+    struct snd_pcm_runtime *runtime = substream->runtime;
+
+    pr_info("snd_ksound_playback_trigger cmd=%d\n", cmd);
+
+    switch (cmd) {
+        case SNDRV_PCM_TRIGGER_START: {
+            loop->hw_ptr = 0;
+            loop->hw_period = 0;
+            loop->start_time = ktime_get();
+            atomic_set(&loop->running, 1);
+
+            // NOTE: простаивающий захват петли должен начать забирать звук
+            ksound_stream_wake(&card->streams[card->stream_count - 1]);
+
+            // NOTE: первый период уходит в fifo через период, клиент успеет
+            // его записать
+            hrtimer_start(&loop->timer,
+                          ns_to_ktime(div_u64(
+                              runtime->period_size * NSEC_PER_SEC,
+                              runtime->rate)),
+                          ksound_timer_mode());
+            return 0;
+        }
+
+        case SNDRV_PCM_TRIGGER_STOP:
+            // NOTE: ждёт таймер snd_ksound_playback_sync_stop, как у захвата
+            atomic_set(&loop->running, 0);
+            hrtimer_try_to_cancel(&loop->timer);
+            return 0;
+
+        case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+        case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+            return 0;
+
+        default:
+            return -EINVAL;
+    }
+}
+
+static int snd_ksound_playback_sync_stop(struct snd_pcm_substream *substream) {
+    struct ksound_loop *loop = substream->private_data;
+
+    hrtimer_cancel(&loop->timer);
+    return 0;
+}
+
+static snd_pcm_uframes_t snd_ksound_playback_pointer(
+    struct snd_pcm_substream *substream) {
+    struct ksound_loop *loop = substream->private_data;
+
+    return bytes_to_frames(substream->runtime, loop->hw_ptr);
+}
+
+static struct snd_pcm_ops snd_ksound_playback_ops = {
+    .open = snd_ksound_playback_open,
+    .close = snd_ksound_playback_close,
+    .ioctl = snd_pcm_lib_ioctl,
+    .hw_params = snd_ksound_playback_hw_params,
+    .hw_free = snd_ksound_playback_hw_free,
+    .prepare = snd_ksound_playback_prepare,
+    .trigger = snd_ksound_playback_trigger,
+    .sync_stop = snd_ksound_playback_sync_stop,
+    .pointer = snd_ksound_playback_pointer,
+};
+
+/*
+ * Реализует операцию open: новый файл смотрит на нулевой поток.
+ */
+static int my_open(struct inode *inode, struct file *file) {
+    struct ksound_file *const f = kzalloc(sizeof(*f), GFP_KERNEL);
+
+    if (!f) return -ENOMEM;
+
+    f->sessions =
+        kcalloc(ksound_stream_count(), sizeof(*f->sessions), GFP_KERNEL);
+    if (!f->sessions) {
+        kfree(f);
+        return -ENOMEM;
+    }
+
+    mutex_init(&f->lock);
+    f->stream = ksound_stream_at(0);
+    file->private_data = f;
+    return 0;
+}
+
+/*
+ * Поток выбранный в файле (см. CMDSETSTREAM). Потоки живут столько же сколько
+ * модуль, поэтому указатель можно использовать и после смены потока.
+ */
+static struct ksound_stream *ksound_file_stream(struct file *file) {
+    struct ksound_file const *const f = file->private_data;
+
+    return READ_ONCE(f->stream);
+}
+
+/*
+ * Резервирует (count > 0) или возвращает (count < 0) ёмкость сессий потока.
+ * Возвращает -ENOSPC если сессии потока заняли бы больше stream_voices.
+ */
+static int ksound_stream_reserve(struct ksound_stream *stream, int count) {
+    int err = 0;
+
+    spin_lock(&stream->sessions_lock);
+    if (count > 0 && stream->reserved_voices + count > stream_voices)
+        err = -ENOSPC;
+    else
+        stream->reserved_voices += count;
+    spin_unlock(&stream->sessions_lock);
+
+    return err;
+}
+
+/*
+ * Новая пустая сессия потока stream ёмкостью session_voices. Возвращает
+ * ERR_PTR при ошибке, -ENOSPC если у потока кончилась ёмкость stream_voices.
+ */
+static struct ksound_session *ksound_session_alloc(
+    struct ksound_stream *stream) {
+    struct ksound_session *session;
+    int err;
+
+    err = ksound_stream_reserve(stream, session_voices);
+    if (err) {
+        pr_info("stream %d is full, stream_voices=%d\n", stream->index,
+                stream_voices);
+        return ERR_PTR(err);
+    }
+
+    session = kzalloc(sizeof(*session), GFP_KERNEL);
+    if (!session) {
+        err = -ENOMEM;
+        goto __unreserve;
+    }
+
+    session->stream = stream;
+    session->pid = task_tgid_nr(current);
+
+    session->pool = ksound_pool_create(session_voices);
+    if (IS_ERR(session->pool)) {
+        err = PTR_ERR(session->pool);
+        goto __free;
+    }
+
+    // NOTE: состояние рендера выделяется один раз на session_voices, в
+    // таймере памяти не выделяем
+    session->voices = kvzalloc(ksound_voices_bytes(session_voices), GFP_KERNEL);
+    if (!session->voices) {
+        pr_info("failed to allocate voices for session_voices=%d\n",
+                session_voices);
+        err = -ENOMEM;
+        goto __destroy;
+    }
+    // NOTE: разметка на всю ёмкость, а волн пока нет
+    ksound_voices_layout(session->voices, session_voices, DEFAULT_RATE);
+    session->voices->count = 0;
+
+    return session;
+
+__destroy:
+    ksound_pool_destroy(session->pool);
+__free:
+    kfree(session);
+__unreserve:
+    ksound_stream_reserve(stream, -session_voices);
+    return ERR_PTR(err);
+}
+
+static void ksound_session_free(struct ksound_session *session) {
+    struct ksound_stream *const stream = session->stream;
+
+    kvfree(session->voices);
+    ksound_pool_destroy(session->pool);
+    kfree(session);
+
+    // NOTE: ёмкость возвращается только когда память уже освобождена
+    ksound_stream_reserve(stream, -session_voices);
+}
+
+/*
+ * Сессия файла в выбранном потоке, create - создать если её ещё нет. Сессия
+ * живёт до закрытия файла. Возвращает NULL если сессии нет, ERR_PTR если её
+ * не удалось создать.
+ */
+static struct ksound_session *ksound_file_session(struct file *file,
+                                                  bool create) {
+    struct ksound_file *const f = file->private_data;
+    struct ksound_stream *const stream = ksound_file_stream(file);
+    struct ksound_session *session;
+
+    mutex_lock(&f->lock);
+    session = f->sessions[stream->index];
+    if (!session && create) {
+        session = ksound_session_alloc(stream);
+        if (!IS_ERR(session)) {
+            f->sessions[stream->index] = session;
+
+            spin_lock(&stream->sessions_lock);
+            list_add_tail_rcu(&session->node, &stream->sessions);
+            spin_unlock(&stream->sessions_lock);
+        } else {
+            pr_info("my_ioctl failed to create session, stream=%d\n",
+                    stream->index);
+        }
+    }
+    mutex_unlock(&f->lock);
+
+    return session;
+}
+
+/*
+ * Снимает сессии файла с потоков и освобождает их. Волны файла перестают
+ * звучать со следующего периода.
+ */
+static void ksound_file_sessions_free(struct ksound_file *f) {
+    int const count = ksound_stream_count();
+    bool removed = false;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        struct ksound_session *const session = f->sessions[i];
+
+        if (!session) continue;
+
+        spin_lock(&session->stream->sessions_lock);
+        list_del_rcu(&session->node);
+        spin_unlock(&session->stream->sessions_lock);
+        removed = true;
+    }
+
+    if (!removed) return;
+
+    // NOTE: рендер мог взять сессию из списка до удаления, а помощник, окно
+    // которого рендер отобрал, может всё ещё читать её волны
+    synchronize_rcu();
+    ksound_workers_quiesce(workers);
+
+    for (i = 0; i < count; i++)
+        if (f->sessions[i]) ksound_session_free(f->sessions[i]);
+}
+
+/*
+ * Добавляет count волн в сессию, replace - вместо всех звучащих в ней. Рендер
+ * увидит весь пакет на границе одного периода. Дескрипторы волн пишутся в
+ * handles если он не NULL. Возвращает 0 или отрицательный код ошибки.
+ */
+static int ksound_waves_add(struct ksound_session *session, u32 const *waves,
+                            int count, bool replace, u32 *handles) {
+    int const shape = ksound_shape_from_name(waveform);
+
+    if (ksound_pool_add(session->pool, waves, count, shape, replace,
+                        handles)) {
+        pr_info("my_ioctl too many waves, session_voices=%d\n",
+                session_voices);
+        return -ENOSPC;
+    }
+
+    pr_debug("my_ioctl add count=%d, replace=%d\n", count, replace);
+
+    // NOTE: если рендер простаивает, не ждать грубого тика
+    if (count) ksound_stream_wake(session->stream);
+    return 0;
+}
+
+/*
+ * Обновляет волны сессии с той же частотой что у волн пакета. Фаза
+ * продолжается (поле фазы игнорируется), а форма волны остаётся прежней.
+ */
+static int ksound_waves_update(struct ksound_session *session,
+                               u32 const *waves, int count) {
+    int const updated = ksound_pool_update_freq(session->pool, waves, count);
+
+    if (updated < 0) {
+        pr_info("my_ioctl failed to allocate update map\n");
+        return -ENOMEM;
+    }
+
+    if (updated) ksound_stream_wake(session->stream);
+    return 0;
+}
+
+/*
+ * Копирует массив волн пакета из пространства пользователя. Возвращает 0 или
+ * отрицательный код ошибки, при успехе *waves нужно освободить через kvfree.
+ */
+static int ksound_batch_from_user(unsigned long arg, u32 **waves, int *count) {
+    struct ksound_wave_batch batch;
+
+    if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)) != 0) {
+        pr_info("my_ioctl failed to copy from user\n");
+        return -EFAULT;
+    }
+
+    if (batch.flags != 0) {
+        pr_info("my_ioctl bad batch flags=0x%x\n", batch.flags);
+        return -EINVAL;
+    }
+
+    // NOTE: больше session_voices в наборе всё равно не поместится
+    if (batch.count > session_voices) {
+        pr_info("my_ioctl batch too large count=%u, session_voices=%d\n",
+                batch.count, session_voices);
+        return -ENOSPC;
+    }
+
+    *waves = kvmalloc_array(max_t(u32, batch.count, 1), sizeof(u32),
+                            GFP_KERNEL);
+    if (!*waves) {
+        pr_info("my_ioctl failed to allocate batch count=%u\n", batch.count);
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(*waves, u64_to_user_ptr(batch.waves),
+                       batch.count * sizeof(u32)) != 0) {
+        pr_info("my_ioctl failed to copy batch from user\n");
+        kvfree(*waves);
+        return -EFAULT;
+    }
+
+    *count = batch.count;
+    return 0;
+}
+
+/*
+ * Регистрирует файл как читателя потока при первом read() или poll(). Файлы
+ * которые только отправляют команды (us_oscillator) читателями не считаются и
+ * рендер не копирует для них периоды. Возвращает поток файла.
+ */
+static struct ksound_stream *ksound_pcm_attach(struct file *file) {
+    struct ksound_file *const f = file->private_data;
+    struct ksound_stream *stream;
+
+    if (READ_ONCE(f->reader)) return ksound_file_stream(file);
+
+    mutex_lock(&mutex);
+    stream = f->stream;
+    if (!f->reader) {
+        // NOTE: первый читатель не должен получить старые периоды
+        mutex_lock(&stream->pcm_read_lock);
+        if (atomic_inc_return(&stream->pcm_readers) == 1)
+            kfifo_reset_out(&stream->pcm_fifo);
+        mutex_unlock(&stream->pcm_read_lock);
+        WRITE_ONCE(f->reader, true);
+    }
+    mutex_unlock(&mutex);
+
+    // NOTE: читателю нужны периоды и тишины тоже
+    ksound_stream_wake(stream);
+    return stream;
+}
+
+/*
+ * Снимает файл с учёта читателей его потока. mutex должен быть захвачен.
+ */
+static void ksound_pcm_detach(struct ksound_file *f) {
+    if (!f->reader) return;
+
+    atomic_dec(&f->stream->pcm_readers);
+    WRITE_ONCE(f->reader, false);
+}
+
+/*
+ * Переключает файл на другой поток. Читателем нового потока файл станет при
+ * следующем read() или poll(), уже сделанный mmap остаётся на старом кольце.
+ */
+static void ksound_file_select(struct file *file,
+                               struct ksound_stream *stream) {
+    struct ksound_file *const f = file->private_data;
+
+    mutex_lock(&mutex);
+    ksound_pcm_detach(f);
+    WRITE_ONCE(f->stream, stream);
+    mutex_unlock(&mutex);
+}
+
+/*
+ * Выполняет команду ioctl для потока выбранного в file. Команды CMDADDWAVE и
+ * CMDREMOVEWAVE по-старому возвращают положительный код ошибки, остальные -
+ * отрицательный, ошибки копирования из/в пространство пользователя - -EFAULT.
+ */
+static long ksound_ioctl(struct file *file, unsigned int cmd,
+                         unsigned long arg) {
+    int const magic = _IOC_TYPE(cmd), nr = _IOC_NR(cmd);
+    struct ksound_stream *const stream = ksound_file_stream(file);
+    struct ksound_session *session;
+
+    if (magic != MYDEVMAGIC) {
+        pr_info("bad device magic %d, expected %d\n", magic, MYDEVMAGIC);
+        return -ENOTTY;
+    }
+
+    if (nr >= KSOUND_IOCTL_COUNT) {
+        pr_info("no such command with index number %d\n", nr);
+        return -ENOTTY;
+    }
+
+    pr_debug("my_ioctl cmd=0x%d, nr=%d, stream=%d\n", cmd, nr, stream->index);
+
+    if (cmd == CMDADDWAVE) {
+        u32 wave;
+
+        if (copy_from_user(&wave, (void *)arg, sizeof(wave)) != 0) {
+            pr_info("my_ioctl failed to copy from user\n");
+            return EAGAIN;
+        }
+
+        pr_debug("my_ioctl add wave=0x%x, amp=%d, phase=%d, freq=%d\n", wave,
+                 GETWAVEAMP(wave), GETWAVEPHASE(wave), GETWAVEFREQ(wave));
+
+        session = ksound_file_session(file, true);
+        if (IS_ERR(session)) return -PTR_ERR(session);
+
+        // NOTE: старая команда возвращает коды ошибок положительными
+        return -ksound_waves_add(session, &wave, 1, false, NULL);
+    } else if (cmd == CMDREMOVEWAVE) {
+        u32 freq;
+        int removed = 0;
+
+        if (copy_from_user(&freq, (void *)arg, sizeof(freq)) != 0) {
+            pr_info("my_ioctl failed to copy from user\n");
+            return EAGAIN;
+        }
+
+        // NOTE: только свои волны, чужие сессии не трогаем
+        session = ksound_file_session(file, false);
+        if (session) removed = ksound_pool_remove_freq(session->pool, freq);
+        pr_debug("my_ioctl remove freq=%d, removed=%d\n", freq, removed);
+    } else if (cmd == CMDCLEARWAVES) {
+        pr_debug("my_ioctl clear waves\n");
+
+        session = ksound_file_session(file, false);
+        if (session) ksound_pool_clear(session->pool);
+    } else if (cmd == CMDADDVOICE) {
+        struct ksound_voice_req req;
+        int err;
+
+        if (copy_from_user(&req, (void *)arg, sizeof(req)) != 0) {
+            pr_info("my_ioctl failed to copy from user\n");
+            return -EFAULT;
+        }
+
+        session = ksound_file_session(file, true);
+        if (IS_ERR(session)) return PTR_ERR(session);
+
+        err = ksound_waves_add(session, &req.wave, 1, false, &req.handle);
+        if (err) return err;
+
+        pr_debug("my_ioctl add voice wave=0x%x, handle=0x%x\n", req.wave,
+                 req.handle);
+
+        // NOTE: волна уже звучит, дескриптор потерян только для вызывающего
+        if (copy_to_user((void *)arg, &req, sizeof(req)) != 0) {
+            pr_info("my_ioctl failed to copy to user\n");
+            return -EFAULT;
+        }
+    } else if (cmd == CMDREMOVEVOICE) {
+        u32 handle;
+
+        if (copy_from_user(&handle, (void *)arg, sizeof(handle)) != 0) {
+            pr_info("my_ioctl failed to copy from user\n");
+            return -EFAULT;
+        }
+
+        // NOTE: дескрипторы действуют только в своей сессии
+        session = ksound_file_session(file, false);
+        if (!session || ksound_pool_remove(session->pool, handle)) {
+            pr_debug("my_ioctl no voice with handle=0x%x\n", handle);
+            return -EINVAL;
+        }
+    } else if (cmd == CMDUPDATEVOICE) {
+        struct ksound_voice_req req;
+
+        if (copy_from_user(&req, (void *)arg, sizeof(req)) != 0) {
+            pr_info("my_ioctl failed to copy from user\n");
+            return -EFAULT;
+        }
+
+        session = ksound_file_session(file, false);
+        if (!session ||
+            ksound_pool_update(session->pool, req.handle, req.wave)) {
+            pr_debug("my_ioctl no voice with handle=0x%x\n", req.handle);
+            return -EINVAL;
+        }
+    } else if (cmd == CMDADDBANK || cmd == CMDUPDATEBANK) {
+        struct ksound_bank_req req;
+        int err;
+
+        if (copy_from_user(&req, (void *)arg, sizeof(req)) != 0) {
+            pr_info("my_ioctl failed to copy from user\n");
+            return -EFAULT;
+        }
+
+        if (!memchr_inv(req.partials, 0, sizeof(req.partials))) {
+            pr_info("my_ioctl bank without partials\n");
+            return -EINVAL;
+        }
+
+        if (cmd == CMDUPDATEBANK) {
+            session = ksound_file_session(file, false);
+            if (!session || ksound_pool_update_bank(session->pool, req.handle,
+                                                    req.wave, req.partials)) {
+                pr_debug("my_ioctl no voice with handle=0x%x\n", req.handle);
+                return -EINVAL;
+            }
+            return 0;
+        }
+
+        session = ksound_file_session(file, true);
+        if (IS_ERR(session)) return PTR_ERR(session);
+
+        err = ksound_pool_add_bank(session->pool, req.wave, req.partials,
+                                   &req.handle);
+        if (err) {
+            pr_info("my_ioctl too many waves, session_voices=%d\n",
+                session_voices);
+            return -ENOSPC;
+        }
+
+        pr_debug("my_ioctl add bank wave=0x%x, handle=0x%x\n", req.wave,
+                 req.handle);
+        ksound_stream_wake(session->stream);
+
+        if (copy_to_user((void *)arg, &req, sizeof(req)) != 0) {
+            pr_info("my_ioctl failed to copy to user\n");
+            return -EFAULT;
+        }
+    } else if (cmd == CMDSETRINGEVENTFD) {
+        struct eventfd_ctx *ctx = NULL;
+        struct eventfd_ctx *old_ctx;
+        s32 fd;
+
+        if (copy_from_user(&fd, (void *)arg, sizeof(fd)) != 0) {
+            pr_info("my_ioctl failed to copy from user\n");
+            return -EFAULT;
+        }
+
+        if (fd >= 0) {
+            ctx = eventfd_ctx_fdget(fd);
+            if (IS_ERR(ctx)) {
+                pr_info("my_ioctl bad eventfd %d\n", fd);
+                return -EINVAL;
+            }
+        }
+
+        mutex_lock(&mutex);
+        old_ctx = rcu_dereference_protected(stream->cmd_ring_eventfd,
+                                            lockdep_is_held(&mutex));
+        rcu_assign_pointer(stream->cmd_ring_eventfd, ctx);
+        mutex_unlock(&mutex);
+
+        // NOTE: рендер мог успеть взять старый eventfd
+        if (old_ctx) {
+            synchronize_rcu();
+            eventfd_ctx_put(old_ctx);
+        }
+    } else if (cmd == CMDADDWAVES || cmd == CMDSETWAVES ||
+               cmd == CMDUPDATEWAVES) {
+        u32 *waves;
+        int count, err;
+
+        err = ksound_batch_from_user(arg, &waves, &count);
+        if (err) return err;
+
+        // NOTE: пустой пакет и обновление сессию не создают
+        session = ksound_file_session(file, cmd != CMDUPDATEWAVES && count);
+
+        // NOTE: весь пакет под одной блокировкой пула, рендер увидит его
+        // целиком на границе одного периода
+        if (IS_ERR(session))
+            err = PTR_ERR(session);
+        else if (!session)
+            err = 0;
+        else if (cmd == CMDUPDATEWAVES)
+            err = ksound_waves_update(session, waves, count);
+        else
+            err = ksound_waves_add(session, waves, count, cmd == CMDSETWAVES,
+                                   NULL);
+
+        kvfree(waves);
+        return err;
+    } else if (cmd == CMDSETSTREAM) {
+        u32 index;
+
+        if (copy_from_user(&index, (void *)arg, sizeof(index)) != 0) {
+            pr_info("my_ioctl failed to copy from user\n");
+            return -EFAULT;
+        }
+
+        if (index >= ksound_stream_count()) {
+            pr_info("my_ioctl bad stream %u, streams=%d\n", index,
+                    ksound_stream_count());
+            return -EINVAL;
+        }
+
+        ksound_file_select(file, ksound_stream_at(index));
+    } else if (cmd == CMDGETSTREAMS) {
+        u32 const count = ksound_stream_count();
+
+        if (copy_to_user((void *)arg, &count, sizeof(count)) != 0) {
+            pr_info("my_ioctl failed to copy to user\n");
+            return -EFAULT;
+        }
+    } else {
+        // NOTE: номер команды верный, но размер или направление другие
+        pr_info("unknown command cmd=0x%x\n", cmd);
+        return -ENOTTY;
+    }
+
+    return 0;
+}
+
+/*
+ * Реализует операцию ioctl. Время команды меряется только когда включена
+ * точка трассировки ksound_ioctl.
+ */
+static long my_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    u64 start;
+    long ret;
+
+    if (!trace_ksound_ioctl_enabled()) return ksound_ioctl(file, cmd, arg);
+
+    start = ktime_get_ns();
+    ret = ksound_ioctl(file, cmd, arg);
+    trace_ksound_ioctl(ksound_file_stream(file)->index, _IOC_NR(cmd),
+                       ktime_get_ns() - start, ret);
+    return ret;
+}
+
+/*
+ * Реализует операцию read: кадры в формате потока захвата (см. hw_params). Без
+ * O_NONBLOCK ждёт следующего периода, с O_NONBLOCK возвращает -EAGAIN.
+ */
+static ssize_t my_read(struct file *file, char __user *buf, size_t count,
+                       loff_t *offset) {
+    struct ksound_stream *const stream = ksound_pcm_attach(file);
+    unsigned int copied = 0;
+    int err;
+
+    // NOTE: только целые кадры, иначе каналы поменяются местами
+    count = rounddown(count, READ_ONCE(stream->pcm_frame_bytes));
+    if (count == 0) return -EINVAL;
+
+    if (mutex_lock_interruptible(&stream->pcm_read_lock)) return -ERESTARTSYS;
+
+    while (kfifo_is_empty(&stream->pcm_fifo)) {
+        mutex_unlock(&stream->pcm_read_lock);
+
+        if (file->f_flags & O_NONBLOCK) return -EAGAIN;
+
+        if (wait_event_interruptible(stream->pcm_wq,
+                                     !kfifo_is_empty(&stream->pcm_fifo)))
+            return -ERESTARTSYS;
+
+        if (mutex_lock_interruptible(&stream->pcm_read_lock))
+            return -ERESTARTSYS;
+    }
+
+    err = kfifo_to_user(&stream->pcm_fifo, buf, count, &copied);
+    mutex_unlock(&stream->pcm_read_lock);
+
+    return err ? err : copied;
+}
+
+/*
+ * Реализует операцию write.
+ */
+static ssize_t my_write(struct file *file, char __user const *buf, size_t count,
+                        loff_t *offset) {
+    pr_info("unimplemented write operation\n");
+    return 0;
+}
+
+/*
+ * Реализует операцию mmap: отображает кольцо команд потока файла (см.
+ * ksound_ring).
+ */
+static int my_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct ksound_stream *const stream = ksound_file_stream(file);
+
+    if (vma->vm_pgoff != 0) {
+        pr_info("mmap offset must be 0, got %lu pages\n", vma->vm_pgoff);
+        return -EINVAL;
+    }
+
+    // NOTE: remap_vmalloc_range сам проверяет что окно не больше кольца
+    return remap_vmalloc_range(vma, stream->cmd_ring, 0);
+}
+
+/*
+ * Реализует операцию poll: EPOLLOUT когда в кольце команд есть место.
+ */
+static __poll_t my_poll(struct file *file, poll_table *wait) {
+    struct ksound_stream *stream = ksound_file_stream(file);
+    struct ksound_ring *const ring = stream->cmd_ring;
+    __poll_t mask = 0;
+
+    poll_wait(file, &stream->cmd_ring_wq, wait);
+
+    if (READ_ONCE(ring->head) - smp_load_acquire(&ring->tail) <
+        KSOUND_RING_SIZE)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    // NOTE: рендер кладёт в поток целые периоды, поэтому готовность читать
+    // появляется раз за период
+    if (poll_requested_events(wait) & (EPOLLIN | EPOLLRDNORM)) {
+        stream = ksound_pcm_attach(file);
+        poll_wait(file, &stream->pcm_wq, wait);
+
+        if (!kfifo_is_empty(&stream->pcm_fifo)) mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    return mask;
+}
+
+static int my_release(struct inode *inode, struct file *file) {
+    struct ksound_file *const f = file->private_data;
+    struct ksound_stream *const stream = f->stream;
+
+    mutex_lock(&mutex);
+    ksound_pcm_detach(f);
+    mutex_unlock(&mutex);
+
+    // NOTE: волны клиента не переживают его, даже если он упал
+    ksound_file_sessions_free(f);
+    kfree(f->sessions);
+
+    if (stream->pcm_overruns)
+        pr_info("read stream %d overruns %lu\n", stream->index,
+                stream->pcm_overruns);
+
+    file->private_data = NULL;
+    kfree(f);
+    return 0;
+}
+
+static const struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = my_open,
+    .release = my_release,
+    .read = my_read,
+    .write = my_write,
+    .unlocked_ioctl = my_ioctl,
+    .mmap = my_mmap,
+    .poll = my_poll,
+};
+
+// NOTE: глобальные переменные для хранения дескрипторов устройства, карты и пр.
+// Эти значения зашиваются в поля private_data карты и pcm потока и функциям
+// следует брать эти данные оттуда поэтому эти переменные максимально внизу.
+static dev_t dev_num;
+static struct cdev my_cdev;
+static struct class *my_class;
+static struct device *my_device;
+
+static struct platform_device *pdev;
+static struct snd_pcm *pcm;
+static struct snd_pcm *loop_pcm;
+static struct ksound_card *k_card;
+
+/*
+ * Будит простаивающий рендер потока сразу, не дожидаясь грубого тика.
+ * Вызывается при публикации набора волн и появлении читателя.
+ */
+static void ksound_stream_wake(struct ksound_stream *stream) {
+    unsigned long flags;
+
+    if (!READ_ONCE(stream->idle)) return;
+
+    spin_lock_irqsave(&stream->kick_lock, flags);
+    if (atomic_read(&stream->running) && READ_ONCE(stream->idle))
+        hrtimer_start(&stream->timer, 0, stream->timer_mode);
+    spin_unlock_irqrestore(&stream->kick_lock, flags);
+}
+
+/*
+ * Поток захвата по номеру, номер должен быть меньше ksound_stream_count.
+ */
+static struct ksound_stream *ksound_stream_at(int index) {
+    return &k_card->streams[index];
+}
+
+/*
+ * Количество потоков захвата: substreams и захват петли если она есть.
+ */
+static int ksound_stream_count(void) { return k_card->stream_count; }
+
+// TODO: можно ли так инициализировать драйвер платформы?
+// static struct platform_driver my_card_driver = {
+//    .driver = {
+//        .name = "mycard",
+//    },
+//    .probe  = my_card_probe,
+//    .remove = my_card_remove,
+//};
+// module_platform_driver(my_card_driver);
+
+/*
+ * Счётчики и гистограммы потока, /sys/kernel/debug/ksound/streamN/stats.
+ */
+static int ksound_stats_show(struct seq_file *m, void *data) {
+    struct ksound_stream *const stream = m->private;
+
+    seq_printf(m, "running %d\n", atomic_read(&stream->running));
+    seq_printf(m, "idle %d\n", READ_ONCE(stream->idle));
+    seq_printf(m, "hw_period %lu\n", READ_ONCE(stream->hw_period));
+    seq_printf(m, "render_period %lu\n", READ_ONCE(stream->render_period));
+    seq_printf(m, "rendered_periods %llu\n", stream->rendered_periods);
+    seq_printf(m, "ticks %llu\n", stream->ticks);
+    seq_printf(m, "late_periods %lu\n", stream->late_periods);
+    seq_printf(m, "render_ahead %d (%d..%d)\n",
+               READ_ONCE(stream->render_ahead), stream->ahead_min,
+               stream->ahead_max);
+    seq_printf(m, "xruns %lu\n", stream->xruns);
+    seq_printf(m, "near_xruns %lu\n", stream->near_xruns);
+    seq_printf(m, "ring_dropped %lu\n", stream->ring_dropped);
+    seq_printf(m, "pcm_overruns %lu\n", stream->pcm_overruns);
+
+    ksound_hist_show(m, "render", &stream->render_hist);
+    ksound_hist_show(m, "timer_late", &stream->jitter_hist);
+    ksound_hist_show(m, "set_apply", &stream->apply_hist);
+    ksound_hist_show(m, "slack", &stream->slack_hist);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ksound_stats);
+
+/*
+ * Волны ioctl потока по сессиям, /sys/kernel/debug/ksound/streamN/voices.
+ * Волны кольца принадлежат рендеру, от них показывается только количество.
+ */
+static int ksound_voices_show(struct seq_file *m, void *data) {
+    struct ksound_stream *const stream = m->private;
+
+    struct ksound_session *session;
+
+    seq_printf(m, "ring voices %d, events %d\n",
+               READ_ONCE(stream->ring_voices->count),
+               READ_ONCE(stream->events.count));
+    seq_printf(m, "reserved voices %d of %d\n",
+               READ_ONCE(stream->reserved_voices), stream_voices);
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(session, &stream->sessions, node) {
+        seq_printf(m, "session pid %d\n", session->pid);
+        ksound_pool_show(session->pool, m);
+    }
+    rcu_read_unlock();
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ksound_voices);
+
+static struct dentry *ksound_debugfs;
+
+/*
+ * Каталог ksound в debugfs и подкаталог на каждый поток. Ошибки debugfs не
+ * мешают работе модуля, их не проверяем.
+ */
+static void ksound_debugfs_init(void) {
+    int i;
+
+    ksound_debugfs = debugfs_create_dir(DRIVER_NAME, NULL);
+
+    for (i = 0; i < k_card->stream_count; i++) {
+        struct ksound_stream *const stream = &k_card->streams[i];
+        char name[16];
+
+        snprintf(name, sizeof(name), "stream%d", i);
+        stream->debugfs = debugfs_create_dir(name, ksound_debugfs);
+        debugfs_create_file("stats", 0444, stream->debugfs, stream,
+                            &ksound_stats_fops);
+        debugfs_create_file("voices", 0444, stream->debugfs, stream,
+                            &ksound_voices_fops);
+    }
+}
+
+/*
+ * Выделяет всё что нужно потоку с номером index до появления
+ * /dev/ksound_device. Возвращает отрицательный код ошибки, частично
+ * созданный поток освобождает ksound_stream_free.
+ */
+static int ksound_stream_init(struct ksound_stream *stream, int index) {
+    int err;
+
+    stream->index = index;
+    atomic_set(&stream->running, 0);
+    stream->pcm_frame_bytes = 4;  // S16_LE, 2 канала до первого hw_params
+    init_waitqueue_head(&stream->render_wq);
+    init_waitqueue_head(&stream->cmd_ring_wq);
+    init_waitqueue_head(&stream->pcm_wq);
+    mutex_init(&stream->render_lock);
+    mutex_init(&stream->pcm_read_lock);
+    spin_lock_init(&stream->kick_lock);
+
+    // NOTE: таймер инициализируется один раз, START и ksound_stream_wake его
+    // только запускают, а ksound_exit отменяет не проверяя запускался ли он
+    stream->timer_mode = ksound_timer_mode();
+    hrtimer_init(&stream->timer, CLOCK_MONOTONIC, stream->timer_mode);
+    stream->timer.function = ksound_timer_callback;
+
+    INIT_LIST_HEAD(&stream->sessions);
+    spin_lock_init(&stream->sessions_lock);
+    atomic_set(&stream->pcm_readers, 0);
+
+    // NOTE: vmalloc_user обнуляет память и разрешает remap_vmalloc_range
+    stream->cmd_ring = vmalloc_user(PAGE_ALIGN(sizeof(*stream->cmd_ring)));
+    if (!stream->cmd_ring) {
+        pr_info("failed to allocate command ring\n");
+        return -ENOMEM;
+    }
+
+    err = kfifo_alloc(&stream->pcm_fifo, pcm_buffer_bytes, GFP_KERNEL);
+    if (err) {
+        pr_info("failed to allocate read stream buffer %d\n",
+                pcm_buffer_bytes);
+        return err;
+    }
+
+    // NOTE: волны кольца тоже выделяются один раз на max_voices, в таймере
+    // памяти не выделяем
+    stream->ring_voices = kvzalloc(ksound_voices_bytes(max_voices), GFP_KERNEL);
+    if (!stream->ring_voices) {
+        pr_info("failed to allocate ring voices for max_voices=%d\n",
+                max_voices);
+        return -ENOMEM;
+    }
+    ksound_voices_layout(stream->ring_voices, max_voices, DEFAULT_RATE);
+    stream->ring_voices->count = 0;
+    stream->ring_next_id = 1;
+
+    stream->events.ev = kvmalloc_array(max_events, sizeof(struct ksound_event),
+                                       GFP_KERNEL);
+    if (!stream->events.ev) {
+        pr_info("failed to allocate events for max_events=%d\n", max_events);
+        return -ENOMEM;
+    }
+    stream->events.capacity = max_events;
+
+    if (render_mode == KSOUND_RENDER_THREAD) {
+        stream->render_task = kthread_create(ksound_render_thread, stream,
+                                             "ksound_render/%d", index);
+        if (IS_ERR(stream->render_task)) {
+            pr_info("failed to create render thread\n");
+            err = PTR_ERR(stream->render_task);
+            stream->render_task = NULL;
+            return err;
+        }
+
+        if (render_cpu >= 0 && render_cpu < nr_cpu_ids &&
+            cpu_online(render_cpu))
+            kthread_bind(stream->render_task, render_cpu);
+
+        // NOTE: рендер должен вытеснять обычные задачи, иначе под нагрузкой
+        // поток не успевает к таймеру
+        sched_set_fifo(stream->render_task);
+        wake_up_process(stream->render_task);
+    }
+
+    return 0;
+}
+
+/*
+ * Освобождает поток. Таймер остановлен, а ioctl и read() больше не придут.
+ */
+static void ksound_stream_free(struct ksound_stream *stream) {
+    if (stream->render_task) kthread_stop(stream->render_task);
+
+    if (stream->ring_dropped)
+        pr_info("stream %d command ring dropped %lu voices\n", stream->index,
+                stream->ring_dropped);
+
+    kvfree(stream->events.ev);
+    kvfree(stream->ring_voices);
+
+    if (rcu_access_pointer(stream->cmd_ring_eventfd))
+        eventfd_ctx_put(rcu_dereference_protected(stream->cmd_ring_eventfd, 1));
+    vfree(stream->cmd_ring);
+    kfifo_free(&stream->pcm_fifo);
+}
+
+/*
+ * Петля воспроизведения, fifo на самый большой буфер.
+ */
+static struct ksound_loop *ksound_loop_alloc(void) {
+    struct ksound_loop *const loop = kzalloc(sizeof(*loop), GFP_KERNEL);
+
+    if (!loop) return NULL;
+
+    atomic_set(&loop->running, 0);
+    mutex_init(&loop->lock);
+    hrtimer_init(&loop->timer, CLOCK_MONOTONIC, ksound_timer_mode());
+    loop->timer.function = ksound_loop_timer_callback;
+
+    if (kfifo_alloc(&loop->fifo, snd_ksound_capture_hw.buffer_bytes_max,
+                    GFP_KERNEL)) {
+        kfree(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+static void ksound_loop_free(struct ksound_loop *loop) {
+    if (!loop) return;
+
+    kfifo_free(&loop->fifo);
+    kfree(loop->scratch);
+    kfree(loop);
+}
+
+/*
+ * Создаёт помощников параллельного рендера на процессорах из render_workers.
+ * Пустой список - параллельного рендера нет. Возвращает отрицательный код
+ * ошибки.
+ */
+static int ksound_workers_init(void) {
+    cpumask_var_t cpus;
+    int err = 0;
+
+    if (!render_workers || !*render_workers) return 0;
+
+    // NOTE: в hardirq рендер не должен ждать чужие процессоры даже
+    // ограниченное время
+    if (render_mode == KSOUND_RENDER_HARDIRQ) {
+        pr_info("render workers need render_mode softirq or thread\n");
+        return 0;
+    }
+
+    if (!zalloc_cpumask_var(&cpus, GFP_KERNEL)) return -ENOMEM;
+
+    err = cpulist_parse(render_workers, cpus);
+    if (err) {
+        pr_info("bad render_workers cpu list %s\n", render_workers);
+        goto __exit;
+    }
+
+    cpumask_and(cpus, cpus, cpu_online_mask);
+    if (cpumask_empty(cpus)) {
+        pr_info("no online cpus in render_workers %s\n", render_workers);
+        goto __exit;
+    }
+
+    // NOTE: самый длинный период - S16 моно
+    workers = ksound_workers_create(
+        cpus,
+        snd_ksound_capture_hw.period_bytes_max /
+            ksound_frame_bytes(KSOUND_FORMAT_S16, 1),
+        max_voices);
+    if (IS_ERR(workers)) {
+        err = PTR_ERR(workers);
+        workers = NULL;
+        goto __exit;
+    }
+
+    pr_info("render workers on cpus %*pbl, from %d voices\n",
+            cpumask_pr_args(cpus), parallel_voices);
+
+__exit:
+    free_cpumask_var(cpus);
+    return err;
+}
+
+/*
+ * Инициализирует модуль. Создаёт новый драйвер платформы который выступает в
+ * качестве родителя для ALSA карты.
+ */
+static int __init ksound_init(void) {
+    int err, i;
+
+    // NOTE: таблицы нужны раньше чем появится /dev/ksound_device
+    ksound_tables_init(&wavetables);
+
+    // NOTE: если параметр simd не задан при загрузке, выбрать самое широкое
+    // из автоматических
+    if (!render_kernel) render_kernel = ksound_render_kernel_best();
+    pr_info("render kernel %s\n", render_kernel->name);
+
+    // NOTE: хотя бы один самый большой период
+    pcm_buffer_bytes =
+        max_t(int, pcm_buffer_bytes, snd_ksound_capture_hw.period_bytes_max);
+    max_voices = clamp_t(int, max_voices, 1, KSOUND_POOL_MAX_CAPACITY);
+    session_voices = clamp_t(int, session_voices, 1, max_voices);
+    // NOTE: хотя бы одна сессия в каждом потоке
+    stream_voices = max_t(int, stream_voices, session_voices);
+    // NOTE: очередь не меньше кольца, чтобы полный круг команд поместился
+    max_events = max_t(int, max_events, KSOUND_RING_SIZE);
+    substreams = clamp_t(int, substreams, 1, KSOUND_MAX_SUBSTREAMS);
+
+    err = ksound_pool_cache_create();
+    if (err) return err;
+
+    err = ksound_workers_init();
+    if (err) {
+        ksound_pool_cache_destroy();
+        return err;
+    }
+
+    // NOTE: карта с потоками создаётся раньше чем появится
+    // /dev/ksound_device, команды могут прийти сразу
+    k_card = kzalloc(struct_size(k_card, streams, substreams + loopback),
+                     GFP_KERNEL);
+    if (!k_card) {
+        pr_info("failed to allocate card struct\n");
+        ksound_workers_destroy(workers);
+        workers = NULL;
+        ksound_pool_cache_destroy();
+        return -ENOMEM;
+    }
+
+    k_card->stream_count = substreams + loopback;
+    for (i = 0; i < k_card->stream_count; i++) {
+        err = ksound_stream_init(&k_card->streams[i], i);
+        if (err) goto __error1;
+    }
+
+    // NOTE: захват петли - последний поток
+    if (loopback) {
+        k_card->loop = ksound_loop_alloc();
+        if (!k_card->loop) {
+            pr_info("failed to allocate loopback\n");
+            err = -ENOMEM;
+            goto __error1;
+        }
+        k_card->streams[k_card->stream_count - 1].loop = k_card->loop;
+    }
+
+    err = alloc_chrdev_region(&dev_num, 0, 1, DEVICE_NAME);
+    if (err < 0) {
+        pr_info("failed to allocate char dev region\n");
+        err = -1;
+        goto __error1;
+    }
+
+    cdev_init(&my_cdev, &fops);
+    my_cdev.owner = THIS_MODULE;
+
+    err = cdev_add(&my_cdev, dev_num, 1);
+    if (err < 0) {
+        pr_info("failed to create characted dev\n");
+        err = -1;
+        goto __error2;
+    }
+
+    my_class = class_create(THIS_MODULE, CLASS_NAME);
+    if (IS_ERR(my_class)) {
+        pr_info("failed to create class\n");
+        err = -1;
+        goto __error3;
+    }
+
+    // NOTE: добавляет файл /dev/ksound_device
+    my_device = device_create(my_class, NULL, dev_num, NULL, DEVICE_NAME);
+    if (IS_ERR(my_device)) {
+        pr_info("failed to create device\n");
+        err = -1;
+        goto __error4;
+    }
+
+    // NOTE: создать драйвер платформы
+    pdev = platform_device_register_simple(DRIVER_NAME, -1, NULL, 0);
+    if (IS_ERR(pdev)) {
+        pr_info("failed to create platform device\n");
+        err = -1;
+        goto __error5;
+    }
+
+    pr_info("render mode %s, substreams %d, loopback %d\n",
+            render_mode_names[render_mode], substreams, loopback);
+
+    // NOTE: создать ALSA карту, в качестве родителя драйвер платформы (aplay
+    // -l) для чего приватные данные (0)?
+    err = snd_card_new(&pdev->dev, -1, DRIVER_NAME, THIS_MODULE, 0,
+                       &k_card->card);
+    if (err < 0) {
+        pr_info("failed to create sound card\n");
+        err = -1;
+        goto __error6;
+    }
+
+    strcpy(k_card->card->driver, DRIVER_NAME);
+    strcpy(k_card->card->shortname, CARD_NAME);
+    sprintf(k_card->card->longname, "%s at virtual", CARD_NAME);
+
+    // NOTE: создать pcm устройство, playback_count=0, capture_count=substreams.
+    // Номер substream совпадает с индексом в k_card->streams
+    err = snd_pcm_new(k_card->card, DRIVER_NAME, 0, 0, substreams, &pcm);
+    if (err < 0) {
+        pr_info("failed to create pcm stream\n");
+        err = -1;
+        goto __error7;
+    }
+
+    strcpy(pcm->name, CARD_NAME);
+    pcm->private_data = k_card;
+    pcm->info_flags = 0;
+
+    // NOTE: SNDRV_PCM_STREAM_PLAYBACK для устройства воспроизведения
+    snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &snd_ksound_capture_ops);
+
+    // NOTE: петля - устройство 1, по одному substream воспроизведения и
+    // захвата. Освобождается вместе с картой
+    if (k_card->loop) {
+        err = snd_pcm_new(k_card->card, DRIVER_NAME, 1, 1, 1, &loop_pcm);
+        if (err < 0) {
+            pr_info("failed to create loopback pcm\n");
+            err = -1;
+            goto __error8;
+        }
+
+        strcpy(loop_pcm->name, CARD_NAME " Loopback");
+        loop_pcm->private_data = k_card;
+        loop_pcm->info_flags = 0;
+
+        snd_pcm_set_ops(loop_pcm, SNDRV_PCM_STREAM_PLAYBACK,
+                        &snd_ksound_playback_ops);
+        snd_pcm_set_ops(loop_pcm, SNDRV_PCM_STREAM_CAPTURE,
+                        &snd_ksound_capture_ops);
+    }
+
+    // TODO: snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_VMALLOC,
+    // NULL, 64 * 1024, 64 * 1024);
+    // TODO: snd_pcm_set_managed_buffer_all(pcm, SNDRV_DMA_TYPE_VMALLOC, NULL,
+    // 64 * 1024, 64 * 1024);
+
+    // NOTE: зарегистрировать карту
+    err = snd_card_register(k_card->card);
+    if (err < 0) {
+        pr_info("failed to register sound card\n");
+        err = -1;
+        goto __error8;
+    }
+
+    ksound_debugfs_init();
+
+    pr_info("kernel ALSA sound module loaded successfully\n");
+    return 0;
+
+__error8:
+    // TODO: освобождается через snd_card_free?
+__error7:
+    BUG_ON(k_card == NULL || k_card->card == NULL);
+    snd_card_free(k_card->card);
+__error6:
+    platform_device_unregister(pdev);
+__error5:
+    device_destroy(my_class, dev_num);
+__error4:
+    class_destroy(my_class);
+__error3:
+    cdev_del(&my_cdev);
+__error2:
+    unregister_chrdev_region(dev_num, 1);
+__error1:
+    BUG_ON(k_card == NULL);
+    for (i = 0; i < k_card->stream_count; i++)
+        ksound_stream_free(&k_card->streams[i]);
+    ksound_loop_free(k_card->loop);
+    kfree(k_card);
+    k_card = NULL;
+    ksound_workers_destroy(workers);
+    workers = NULL;
+    ksound_pool_cache_destroy();
+    return err;
+}
+
+/*
+ * Уничтожает модуль, освобождает выделенные ресурсы.
+ */
+static void __exit ksound_exit(void) {
+    int i;
+
+    // FIXME: не попадаю сюда при попытке выгрузить драйвер потому что по всей
+    // видимости его удерживает ALSA получаю ошибку rmmod: ERROR: Module
+    // ex_oscillator is in use
+    // TODO: fops device counter
+    BUG_ON(k_card == NULL);
+    BUG_ON(k_card->card == NULL);
+    BUG_ON(pdev == NULL);
+
+    // NOTE: до освобождения потоков, файлы debugfs читают их напрямую
+    debugfs_remove_recursive(ksound_debugfs);
+
+    for (i = 0; i < k_card->stream_count; i++) {
+        struct ksound_stream *const stream = &k_card->streams[i];
+
+        atomic_set(&stream->running, 0);
+        hrtimer_cancel(&stream->timer);
+    }
+
+    if (k_card->loop) {
+        atomic_set(&k_card->loop->running, 0);
+        hrtimer_cancel(&k_card->loop->timer);
+    }
+
+    snd_card_disconnect(k_card->card);
+    snd_card_free(k_card->card);
+
+    platform_device_unregister(pdev);
+
+    device_destroy(my_class, dev_num);
+    class_destroy(my_class);
+    cdev_del(&my_cdev);
+    unregister_chrdev_region(dev_num, 1);
+
+    // NOTE: таймеры остановлены и ioctl больше не придёт, читателей нет.
+    // Помощники не должны досчитывать окна освобождаемых наборов
+    ksound_workers_quiesce(workers);
+    for (i = 0; i < k_card->stream_count; i++)
+        ksound_stream_free(&k_card->streams[i]);
+    ksound_loop_free(k_card->loop);
+    kfree(k_card);
+
+    // NOTE: рендер остановлен во всех потоках, помощники больше не нужны
+    ksound_workers_destroy(workers);
+    ksound_pool_cache_destroy();
+
+    pr_info("kernel ALSA sound module unloaded\n");
+}
+
+module_init(ksound_init);
+module_exit(ksound_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Ivars Rozhleys");
+MODULE_DESCRIPTION("Kernel ALSA Sound Driver");
@@ -0,0 +1,483 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include "ksound_pool.h"
+
+#include <linux/err.h>
+#include <linux/hash.h>  // hash_32
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/log2.h>  // order_base_2
+#include <linux/mm.h>  // kvmalloc_array, kvfree, ...
+#include <linux/slab.h>  // kmem_cache_create, kmem_cache_alloc, ...
+#include <linux/spinlock.h>
+
+#define KSOUND_HANDLE_INDEX_MASK (KSOUND_POOL_MAX_CAPACITY - 1)
+#define KSOUND_HANDLE_GEN_MASK ((1u << (32 - KSOUND_HANDLE_INDEX_BITS)) - 1)
+
+/*
+ * Слот волны. Пока волна звучит, слот в live пула, иначе в списке free.
+ * Поля волны меняются только под lock пула, рендер читает их под ним же.
+ */
+struct ksound_voice_slot {
+    u32 handle;  // индекс слота и поколение, меняется при каждой выдаче
+    u32 wave;    // упакованная волна (MAKEWAVE)
+    int shape;
+    bool bank;  // банк гармоник partials, а не волна формы shape
+    u8 partials[KSOUND_PARTIALS];
+    bool live;
+    bool dirty;    // в списке dirty, рендер ещё не видел изменение
+    int live_pos;  // место в live пока волна звучит
+    struct list_head free_node;
+    struct list_head dirty_node;
+};
+
+struct ksound_pool {
+    int capacity;
+    struct ksound_voice_slot **slots;  // по индексу слота
+    spinlock_t lock;  // писатели против рендера, рендер бывает в hardirq
+
+    // NOTE: под lock
+    struct ksound_voice_slot **live;  // звучащие волны подряд
+    int live_count;
+    struct list_head free;   // очередь, а не стек: слот выдаётся снова как
+                             // можно позже, дескрипторы дольше различимы
+    struct list_head dirty;  // изменённые слоты по порядку изменения
+    int pending;             // длина dirty, читается и без lock
+    ktime_t dirty_since;     // время первого изменения в dirty
+    u32 syncs;               // сколько раз рендер забирал изменения
+
+    // NOTE: только рендер, место волны в его состоянии по индексу слота
+    int *pos;
+};
+
+static struct kmem_cache *ksound_voice_cache;
+
+int ksound_pool_cache_create(void) {
+    ksound_voice_cache = KMEM_CACHE(ksound_voice_slot, 0);
+    return ksound_voice_cache ? 0 : -ENOMEM;
+}
+
+void ksound_pool_cache_destroy(void) {
+    kmem_cache_destroy(ksound_voice_cache);
+    ksound_voice_cache = NULL;
+}
+
+static u32 ksound_handle_index(u32 handle) {
+    return handle & KSOUND_HANDLE_INDEX_MASK;
+}
+
+/*
+ * Следующее поколение дескриптора слота, поколение 0 пропускается, поэтому
+ * выданный дескриптор никогда не 0.
+ */
+static u32 ksound_handle_next(u32 handle) {
+    u32 gen = ((handle >> KSOUND_HANDLE_INDEX_BITS) + 1) &
+              KSOUND_HANDLE_GEN_MASK;
+
+    if (gen == 0) gen = 1;
+    return (gen << KSOUND_HANDLE_INDEX_BITS) | ksound_handle_index(handle);
+}
+
+struct ksound_pool *ksound_pool_create(int capacity) {
+    struct ksound_pool *pool;
+    int i;
+
+    if (capacity < 1 || capacity > KSOUND_POOL_MAX_CAPACITY)
+        return ERR_PTR(-EINVAL);
+
+    pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+    if (!pool) return ERR_PTR(-ENOMEM);
+
+    spin_lock_init(&pool->lock);
+    INIT_LIST_HEAD(&pool->free);
+    INIT_LIST_HEAD(&pool->dirty);
+
+    pool->slots = kvcalloc(capacity, sizeof(*pool->slots), GFP_KERNEL);
+    pool->live = kvcalloc(capacity, sizeof(*pool->live), GFP_KERNEL);
+    pool->pos = kvmalloc_array(capacity, sizeof(*pool->pos), GFP_KERNEL);
+    if (!pool->slots || !pool->live || !pool->pos) goto __error;
+
+    // NOTE: capacity растёт вместе с выделенными слотами, destroy освободит
+    // только их
+    for (i = 0; i < capacity; i++) {
+        struct ksound_voice_slot *const slot =
+            kmem_cache_zalloc(ksound_voice_cache, GFP_KERNEL);
+
+        if (!slot) goto __error;
+
+        slot->handle = i;
+        INIT_LIST_HEAD(&slot->dirty_node);
+        list_add_tail(&slot->free_node, &pool->free);
+        pool->slots[i] = slot;
+        pool->pos[i] = -1;
+        pool->capacity++;
+    }
+
+    return pool;
+
+__error:
+    pr_info("failed to allocate voice pool of %d voices\n", capacity);
+    ksound_pool_destroy(pool);
+    return ERR_PTR(-ENOMEM);
+}
+
+void ksound_pool_destroy(struct ksound_pool *pool) {
+    int i;
+
+    if (!pool) return;
+
+    for (i = 0; i < pool->capacity; i++)
+        kmem_cache_free(ksound_voice_cache, pool->slots[i]);
+
+    kvfree(pool->slots);
+    kvfree(pool->live);
+    kvfree(pool->pos);
+    kfree(pool);
+}
+
+/*
+ * Ставит слот в очередь к рендеру. lock должен быть захвачен.
+ */
+static void ksound_pool_mark(struct ksound_pool *pool,
+                             struct ksound_voice_slot *slot) {
+    if (slot->dirty) return;
+
+    if (pool->pending == 0) pool->dirty_since = ktime_get();
+    slot->dirty = true;
+    list_add_tail(&slot->dirty_node, &pool->dirty);
+    WRITE_ONCE(pool->pending, pool->pending + 1);
+}
+
+/*
+ * Берёт свободный слот под волну. lock должен быть захвачен, свободный слот
+ * должен быть.
+ */
+static struct ksound_voice_slot *ksound_pool_get(struct ksound_pool *pool,
+                                                 u32 wave, int shape) {
+    struct ksound_voice_slot *const slot =
+        list_first_entry(&pool->free, struct ksound_voice_slot, free_node);
+
+    list_del(&slot->free_node);
+    slot->handle = ksound_handle_next(slot->handle);
+    slot->wave = wave;
+    slot->shape = shape;
+    slot->bank = false;
+    slot->live = true;
+    slot->live_pos = pool->live_count;
+    pool->live[pool->live_count++] = slot;
+
+    ksound_pool_mark(pool, slot);
+    return slot;
+}
+
+/*
+ * Возвращает звучащий слот в свободные, на его место в live встаёт последний.
+ * lock должен быть захвачен.
+ */
+static void ksound_pool_put(struct ksound_pool *pool,
+                            struct ksound_voice_slot *slot) {
+    struct ksound_voice_slot *const last = pool->live[--pool->live_count];
+
+    pool->live[slot->live_pos] = last;
+    last->live_pos = slot->live_pos;
+    slot->live = false;
+    list_add_tail(&slot->free_node, &pool->free);
+
+    ksound_pool_mark(pool, slot);
+}
+
+/*
+ * Звучащий слот по дескриптору или NULL. lock должен быть захвачен.
+ */
+static struct ksound_voice_slot *ksound_pool_find(struct ksound_pool *pool,
+                                                  u32 handle) {
+    u32 const index = ksound_handle_index(handle);
+    struct ksound_voice_slot *slot;
+
+    if (handle == 0 || index >= pool->capacity) return NULL;
+
+    slot = pool->slots[index];
+    return slot->live && slot->handle == handle ? slot : NULL;
+}
+
+static void ksound_pool_clear_locked(struct ksound_pool *pool) {
+    while (pool->live_count)
+        ksound_pool_put(pool, pool->live[pool->live_count - 1]);
+}
+
+int ksound_pool_add(struct ksound_pool *pool, u32 const *waves, int count,
+                    int shape, bool replace, u32 *handles) {
+    unsigned long flags;
+    int i;
+
+    spin_lock_irqsave(&pool->lock, flags);
+
+    if ((replace ? 0 : pool->live_count) + count > pool->capacity) {
+        spin_unlock_irqrestore(&pool->lock, flags);
+        return -ENOSPC;
+    }
+
+    if (replace) ksound_pool_clear_locked(pool);
+
+    for (i = 0; i < count; i++) {
+        struct ksound_voice_slot *const slot =
+            ksound_pool_get(pool, waves[i], shape);
+
+        if (handles) handles[i] = slot->handle;
+    }
+
+    spin_unlock_irqrestore(&pool->lock, flags);
+    return 0;
+}
+
+int ksound_pool_add_bank(struct ksound_pool *pool, u32 wave,
+                         u8 const *partials, u32 *handle) {
+    struct ksound_voice_slot *slot;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pool->lock, flags);
+
+    if (pool->live_count == pool->capacity) {
+        spin_unlock_irqrestore(&pool->lock, flags);
+        return -ENOSPC;
+    }
+
+    slot = ksound_pool_get(pool, wave, KSOUND_SHAPE_SINE);
+    slot->bank = true;
+    memcpy(slot->partials, partials, KSOUND_PARTIALS);
+    *handle = slot->handle;
+
+    spin_unlock_irqrestore(&pool->lock, flags);
+    return 0;
+}
+
+int ksound_pool_remove(struct ksound_pool *pool, u32 handle) {
+    struct ksound_voice_slot *slot;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pool->lock, flags);
+    slot = ksound_pool_find(pool, handle);
+    if (slot) ksound_pool_put(pool, slot);
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    return slot ? 0 : -ENOENT;
+}
+
+int ksound_pool_update(struct ksound_pool *pool, u32 handle, u32 wave) {
+    struct ksound_voice_slot *slot;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pool->lock, flags);
+    slot = ksound_pool_find(pool, handle);
+    if (slot) {
+        slot->wave = wave;
+        ksound_pool_mark(pool, slot);
+    }
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    return slot ? 0 : -ENOENT;
+}
+
+int ksound_pool_update_bank(struct ksound_pool *pool, u32 handle, u32 wave,
+                            u8 const *partials) {
+    struct ksound_voice_slot *slot;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pool->lock, flags);
+    slot = ksound_pool_find(pool, handle);
+    if (slot) {
+        slot->wave = wave;
+        slot->bank = true;
+        memcpy(slot->partials, partials, KSOUND_PARTIALS);
+        ksound_pool_mark(pool, slot);
+    }
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    return slot ? 0 : -ENOENT;
+}
+
+int ksound_pool_remove_freq(struct ksound_pool *pool, u32 freq) {
+    unsigned long flags;
+    int i, n = 0;
+
+    spin_lock_irqsave(&pool->lock, flags);
+
+    // NOTE: один проход по звучащим. На место удалённой встаёт последняя, её
+    // тоже нужно проверить
+    for (i = 0; i < pool->live_count;) {
+        struct ksound_voice_slot *const slot = pool->live[i];
+
+        if (GETWAVEFREQ(slot->wave) == freq) {
+            ksound_pool_put(pool, slot);
+            n++;
+        } else {
+            i++;
+        }
+    }
+
+    spin_unlock_irqrestore(&pool->lock, flags);
+    return n;
+}
+
+/*
+ * Карта частота -> волна пакета для ksound_pool_update_freq: открытая
+ * адресация на 2^bits элементов, не меньше вдвое больше волн пакета. В
+ * элементе бит занятости и частота в старших 32 битах, волна в младших.
+ */
+#define KSOUND_FREQ_USED (1ull << 48)
+
+static u64 *ksound_freq_map_slot(u64 *map, int bits, u32 freq) {
+    u32 const mask = (1u << bits) - 1;
+    u32 i = hash_32(freq, bits);
+
+    while ((map[i] & KSOUND_FREQ_USED) && (u16)(map[i] >> 32) != freq)
+        i = (i + 1) & mask;
+
+    return &map[i];
+}
+
+int ksound_pool_update_freq(struct ksound_pool *pool, u32 const *waves,
+                            int count) {
+    unsigned long flags;
+    int bits, i, n = 0;
+    u64 *map;
+
+    if (count <= 0) return 0;
+    bits = order_base_2(2 * count);
+
+    // NOTE: карта строится до блокировки, под ней только один проход по
+    // звучащим. При повторах частоты последняя волна пакета затирает прежние
+    map = kvcalloc(1 << bits, sizeof(*map), GFP_KERNEL);
+    if (!map) return -ENOMEM;
+    for (i = 0; i < count; i++)
+        *ksound_freq_map_slot(map, bits, GETWAVEFREQ(waves[i])) =
+            KSOUND_FREQ_USED | (u64)GETWAVEFREQ(waves[i]) << 32 | waves[i];
+
+    spin_lock_irqsave(&pool->lock, flags);
+
+    for (i = 0; i < pool->live_count; i++) {
+        struct ksound_voice_slot *const slot = pool->live[i];
+        u64 const entry =
+            *ksound_freq_map_slot(map, bits, GETWAVEFREQ(slot->wave));
+
+        if (!(entry & KSOUND_FREQ_USED)) continue;
+
+        slot->wave = (u32)entry;
+        ksound_pool_mark(pool, slot);
+        n++;
+    }
+
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    kvfree(map);
+    return n;
+}
+
+void ksound_pool_clear(struct ksound_pool *pool) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&pool->lock, flags);
+    ksound_pool_clear_locked(pool);
+    spin_unlock_irqrestore(&pool->lock, flags);
+}
+
+bool ksound_pool_pending(struct ksound_pool *pool) {
+    return READ_ONCE(pool->pending) != 0;
+}
+
+int ksound_pool_sync(struct ksound_pool *pool, struct ksound_voices *v,
+                     struct ksound_wavetables const *t, int rate,
+                     u64 *wait_ns) {
+    struct ksound_voice_slot *slot, *next;
+    unsigned long flags;
+    int n = 0;
+
+    if (!ksound_pool_pending(pool)) return 0;
+
+    // NOTE: новые волны считаются сразу для частоты потока
+    ksound_voices_retune(v, rate);
+
+    spin_lock_irqsave(&pool->lock, flags);
+
+    *wait_ns = ktime_to_ns(ktime_sub(ktime_get(), pool->dirty_since));
+
+    list_for_each_entry_safe(slot, next, &pool->dirty, dirty_node) {
+        u32 const index = ksound_handle_index(slot->handle);
+        int p = pool->pos[index];
+
+        if (slot->live) {
+            u32 phase;
+
+            // NOTE: новая волна в конец набора рендера
+            if (p < 0) {
+                p = v->count++;
+                pool->pos[index] = p;
+                v->id[p] = 0;
+            }
+
+            // NOTE: та же волна обновлена, фаза продолжается. Иначе слот
+            // успели освободить и выдать снова, это уже другая волна
+            phase = v->phase[p];
+            if (slot->bank)
+                ksound_voices_set_bank(v, p, t, slot->wave, slot->partials);
+            else
+                ksound_voices_set(v, p, t, slot->wave, slot->shape);
+            if (v->id[p] == slot->handle) v->phase[p] = phase;
+            v->id[p] = slot->handle;
+        } else if (p >= 0) {
+            int const last = --v->count;
+
+            // NOTE: на место удалённой встаёт последняя волна рендера
+            if (p != last) {
+                ksound_voices_copy(v, p, v, last);
+                pool->pos[ksound_handle_index(v->id[p])] = p;
+            }
+            pool->pos[index] = -1;
+        }
+
+        list_del_init(&slot->dirty_node);
+        slot->dirty = false;
+        n++;
+    }
+
+    WRITE_ONCE(pool->pending, 0);
+    pool->syncs++;
+
+    spin_unlock_irqrestore(&pool->lock, flags);
+    return n;
+}
+
+void ksound_pool_show(struct ksound_pool *pool, struct seq_file *m) {
+    unsigned long flags;
+    int i;
+
+    spin_lock_irqsave(&pool->lock, flags);
+    seq_printf(m, "pool voices %d/%d, pending %d, syncs %u\n",
+               pool->live_count, pool->capacity, pool->pending, pool->syncs);
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    seq_puts(m, "handle freq amp phase shape partials\n");
+
+    // NOTE: блокировка на каждую строку, рендер не ждёт печать всей таблицы
+    for (i = 0;; i++) {
+        u32 handle, wave;
+        int shape, k, partials = 0;
+
+        spin_lock_irqsave(&pool->lock, flags);
+        if (i >= pool->live_count) {
+            spin_unlock_irqrestore(&pool->lock, flags);
+            break;
+        }
+        handle = pool->live[i]->handle;
+        wave = pool->live[i]->wave;
+        shape = pool->live[i]->shape;
+
+        // NOTE: у банка - номер старшей звучащей гармоники, у волны 0
+        for (k = 0; pool->live[i]->bank && k < KSOUND_PARTIALS; k++)
+            if (pool->live[i]->partials[k]) partials = k + 1;
+        spin_unlock_irqrestore(&pool->lock, flags);
+
+        seq_printf(m, "0x%08x %u %u %u %d %d\n", handle, GETWAVEFREQ(wave),
+                   GETWAVEAMP(wave), GETWAVEPHASE(wave), shape, partials);
+    }
+}
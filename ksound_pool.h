@@ -0,0 +1,125 @@
+#ifndef KSOUND_POOL_H
+#define KSOUND_POOL_H
+
+/*
+ * Пул волн ioctl одного потока. Слоты волн выделяются из kmem_cache один раз
+ * на всю ёмкость и дальше только переходят между списком свободных и набором
+ * звучащих, поэтому добавление, удаление и обновление волны по дескриптору
+ * стоят O(1) и ничего не выделяют. Дескриптор - индекс слота и поколение
+ * слота, устаревший дескриптор удалённой волны не найдёт новую волну в том же
+ * слоте.
+ *
+ * Изменённые слоты попадают в список грязных. Рендер в начале периода
+ * переносит их в своё состояние (ksound_pool_sync) за время пропорциональное
+ * количеству изменений, а не размеру набора. Писатели и рендер делят только
+ * короткую спин-блокировку пула. Только для модуля ядра.
+ */
+
+#include <linux/seq_file.h>
+#include <linux/types.h>
+
+#include "ksound_render.h"  // ksound_voices, ksound_wavetables, ...
+
+// NOTE: младшие биты дескриптора - индекс слота, старшие - поколение.
+// Дескриптор 0 не выдаётся никогда
+#define KSOUND_HANDLE_INDEX_BITS 20
+#define KSOUND_POOL_MAX_CAPACITY (1 << KSOUND_HANDLE_INDEX_BITS)
+
+struct ksound_pool;
+
+/*
+ * kmem_cache слотов, общий для всех пулов модуля. Возвращает отрицательный
+ * код ошибки.
+ */
+int ksound_pool_cache_create(void);
+void ksound_pool_cache_destroy(void);
+
+/*
+ * Пул на capacity волн (не больше KSOUND_POOL_MAX_CAPACITY), все слоты
+ * выделяются сразу. Возвращает ERR_PTR при ошибке.
+ */
+struct ksound_pool *ksound_pool_create(int capacity);
+
+/*
+ * Освобождает пул и его слоты. NULL допустим.
+ */
+void ksound_pool_destroy(struct ksound_pool *pool);
+
+/*
+ * Добавляет count волн формы shape, replace - вместо всех звучащих. Рендер
+ * увидит их все на границе одного периода. Дескрипторы пишутся в handles если
+ * он не NULL. Возвращает -ENOSPC если волны не помещаются, тогда пул не
+ * меняется.
+ */
+int ksound_pool_add(struct ksound_pool *pool, u32 const *waves, int count,
+                    int shape, bool replace, u32 *handles);
+
+/*
+ * Добавляет банк гармоник (ksound_render_bank) с основным тоном wave и
+ * KSOUND_PARTIALS амплитудами partials, дескриптор пишется в handle.
+ * Возвращает -ENOSPC если места нет.
+ */
+int ksound_pool_add_bank(struct ksound_pool *pool, u32 wave,
+                         u8 const *partials, u32 *handle);
+
+/*
+ * Удаляет волну по дескриптору. Возвращает -ENOENT если такой волны нет.
+ */
+int ksound_pool_remove(struct ksound_pool *pool, u32 handle);
+
+/*
+ * Меняет описание волны по дескриптору, фаза и форма (или гармоники банка)
+ * остаются прежними. Возвращает -ENOENT если такой волны нет.
+ */
+int ksound_pool_update(struct ksound_pool *pool, u32 handle, u32 wave);
+
+/*
+ * Меняет основной тон и гармоники банка по дескриптору, фаза остаётся
+ * прежней. Обычная волна становится банком. Возвращает -ENOENT если такой
+ * волны нет.
+ */
+int ksound_pool_update_bank(struct ksound_pool *pool, u32 handle, u32 wave,
+                            u8 const *partials);
+
+/*
+ * Удаляет все волны с частотой freq за один проход по звучащим. Возвращает
+ * количество удалённых.
+ */
+int ksound_pool_remove_freq(struct ksound_pool *pool, u32 freq);
+
+/*
+ * Обновляет волны с той же частотой что у волн пакета. Карта частот пакета
+ * строится до блокировки, под ней один проход по звучащим. При повторах
+ * частоты в пакете побеждает последняя волна. Возвращает количество
+ * обновлений или -ENOMEM.
+ */
+int ksound_pool_update_freq(struct ksound_pool *pool, u32 const *waves,
+                            int count);
+
+/*
+ * Удаляет все волны.
+ */
+void ksound_pool_clear(struct ksound_pool *pool);
+
+/*
+ * Есть изменения, которые рендер ещё не перенёс.
+ */
+bool ksound_pool_pending(struct ksound_pool *pool);
+
+/*
+ * Для рендера: переносит изменения пула в его состояние v ёмкостью не меньше
+ * ёмкости пула. Фазы уже звучащих волн сохраняются. Приращения v
+ * пересчитываются для rate. В *wait_ns пишет сколько ждало самое старое
+ * изменение. Возвращает количество перенесённых изменений, 0 - пул не
+ * менялся.
+ */
+int ksound_pool_sync(struct ksound_pool *pool, struct ksound_voices *v,
+                     struct ksound_wavetables const *t, int rate,
+                     u64 *wait_ns);
+
+/*
+ * Печатает звучащие волны пула для debugfs.
+ */
+void ksound_pool_show(struct ksound_pool *pool, struct seq_file *m);
+
+#endif  // KSOUND_POOL_H
@@ -0,0 +1,920 @@
+#ifndef KSOUND_RENDER_H
+#define KSOUND_RENDER_H
+
+/*
+ * Ядро синтеза звуковых волн. Заголовок собирается и в модуле ядра, и в
+ * программе пользовательского пространства (см. цель bench в Makefile),
+ * поэтому здесь только арифметика над буферами: никаких блокировок, ALSA и
+ * выделения памяти.
+ */
+
+#ifdef __KERNEL__
+#include <linux/math64.h>  // div_u64, ...
+#include <linux/string.h>  // memset, ...
+#include <linux/types.h>   // s16, s32, u32, size_t, ...
+
+// NOTE: под User-Mode Linux (тесты KUnit) нет ни FPU API ядра, ни проверки
+// возможностей процессора, там только скалярное ядро, как в lib/raid6
+#if defined(__x86_64__) && !IS_ENABLED(CONFIG_UML)
+#define KSOUND_SIMD_X86_64
+#elif defined(__aarch64__) && !IS_ENABLED(CONFIG_UML)
+#define KSOUND_SIMD_ARM64
+#endif
+
+#if defined(KSOUND_SIMD_X86_64)
+#include <asm/fpu/api.h>  // kernel_fpu_begin, ...
+#include <asm/simd.h>     // may_use_simd
+#elif defined(KSOUND_SIMD_ARM64)
+#include <asm/neon.h>  // kernel_neon_begin, ...
+#include <asm/simd.h>  // may_use_simd
+#endif
+
+#define ksound_div_u64(n, d) div_u64((n), (d))
+
+// NOTE: в ядре SIMD регистры можно трогать только между begin и end
+#if defined(KSOUND_SIMD_X86_64)
+#define ksound_simd_begin() kernel_fpu_begin()
+#define ksound_simd_end() kernel_fpu_end()
+#elif defined(KSOUND_SIMD_ARM64)
+#define ksound_simd_begin() kernel_neon_begin()
+#define ksound_simd_end() kernel_neon_end()
+#else
+#define ksound_simd_begin() \
+    do {                    \
+    } while (0)
+#define ksound_simd_end() \
+    do {                  \
+    } while (0)
+#define may_use_simd() 0
+#endif
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#define KSOUND_SIMD_X86_64
+#elif defined(__aarch64__)
+#define KSOUND_SIMD_ARM64
+#endif
+
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define ksound_div_u64(n, d) ((u64)(n) / (u32)(d))
+
+#define ksound_simd_begin() \
+    do {                    \
+    } while (0)
+#define ksound_simd_end() \
+    do {                  \
+    } while (0)
+#define may_use_simd() 1
+#endif
+
+#include "ksound_ioctl.h"  // KSOUND_PARTIALS
+
+// NOTE: амплитуда 7 бит (128 знач., 127 - полная шкала), фаза 9 бит (512 знач.,
+// валидные 0..360), частота 16 бит (64к знач., валидные 0..48000)
+#define MAKEWAVE(amp, phase, freq) \
+    (((amp)&0x7f) | (((phase)&0x1ff) << 7) | (((freq)&0xffff) << 16))
+
+#define GETWAVEAMP(w) ((w)&0x7f)
+#define GETWAVEPHASE(w) (((w) >> 7) & 0x1ff)
+#define GETWAVEFREQ(w) (((w) >> 16) & 0xffff)
+
+#define SETWAVEAMP(wave, amp) (((wave)&0xFFFFFF80) | ((amp)&0x7f))
+#define SETWAVEPHASE(wave, phase) (((wave)&0xFFFF007F) | (((phase)&0x1ff) << 7))
+#define SETWAVEFREQ(wave, freq) (((wave)&0x0000FFFF) | (((freq)&0xffff) << 16))
+
+/*
+ * Волновые таблицы прямого цифрового синтеза (DDS). Фаза волны хранится в
+ * 32-битном аккумуляторе: полный круг соответствует 2^32, переполнение u32 само
+ * заворачивает фазу. Старшие KSOUND_TABLE_BITS бит фазы выбирают отсчёт
+ * таблицы, следующие 15 бит - долю для линейной интерполяции.
+ */
+#define KSOUND_TABLE_BITS 11
+#define KSOUND_TABLE_SIZE (1 << KSOUND_TABLE_BITS)
+#define KSOUND_FRAC_BITS 15
+
+// NOTE: полоса b содержит гармоники 1..2^b, последняя полоса 512 гармоник что
+// помещается в таблицу 2048 отсчётов (теорема Котельникова)
+#define KSOUND_TABLE_BANDS 10
+
+// NOTE: 1.0 в формате Q30
+#define KSOUND_Q30_ONE (1 << 30)
+
+enum ksound_shape {
+    KSOUND_SHAPE_SINE = 0,
+    KSOUND_SHAPE_SAW,
+    KSOUND_SHAPE_SQUARE,
+    KSOUND_SHAPE_TRIANGLE,
+    KSOUND_SHAPE_COUNT,
+};
+
+// NOTE: мягкое ограничение выхода. До KSOUND_CLIP_KNEE смесь проходит как
+// есть, следующие KSOUND_CLIP_SIZE значений по четверти синуса плавно
+// доходят до полной шкалы, дальше насыщение. Ширина колена 5215 выбрана так,
+// чтобы наклон на входе в колено был 1: 5215 * pi/2 = 8192
+#define KSOUND_CLIP_BITS 13
+#define KSOUND_CLIP_SIZE (1 << KSOUND_CLIP_BITS)
+#define KSOUND_CLIP_KNEE (32767 - 5215)
+
+/*
+ * Набор таблиц. Синус один на все полосы, у пилы, меандра и треугольника по
+ * таблице с ограниченным спектром на каждую октаву. Отсчёт [KSOUND_TABLE_SIZE]
+ * повторяет [0] чтобы интерполяция не проверяла границу.
+ */
+struct ksound_wavetables {
+    s16 sine[KSOUND_TABLE_SIZE + 1];
+    s16 bands[KSOUND_SHAPE_COUNT - 1][KSOUND_TABLE_BANDS]
+             [KSOUND_TABLE_SIZE + 1];
+    s32 sin_q30[KSOUND_TABLE_SIZE];  // синус Q30 для построения гармоник
+    s32 sums[KSOUND_TABLE_SIZE];     // промежуточные суммы ряда Фурье
+    s16 clip[KSOUND_CLIP_SIZE];      // колено мягкого ограничения выхода
+};
+
+// NOTE: усиление волны в формате Q15, 1.0 = 32768
+#define KSOUND_GAIN_BITS 15
+#define KSOUND_GAIN_ONE (1 << KSOUND_GAIN_BITS)
+
+/*
+ * Набор волн генератора в виде структуры массивов: рендер идёт по одному
+ * массиву за раз и не распаковывает u32 на каждом кадре. Массивы лежат одним
+ * блоком сразу за структурой (см. ksound_voices_bytes), память выделяет
+ * вызывающий код.
+ */
+struct ksound_voices {
+    int count;
+    int rate;  // частота дискретизации для которой посчитаны incr
+    u32 *id;     // дескриптор пула (ksound_pool.h) или id волны кольца
+    u32 *wave;   // упакованные описания как пришли из ioctl (MAKEWAVE)
+    u32 *phase;  // аккумуляторы фазы, 2^32 - полный круг
+    u32 *incr;   // приращения фазы за один кадр
+    s32 *gain;   // усиление Q15
+    s16 const **table;
+    u8 *shape;      // KSOUND_SHAPE_*, по ней таблица выбирается заново
+    u8 *harmonics;  // гармоник банка, 0 - обычная волна таблицы table
+    u8 *partials;   // по KSOUND_PARTIALS амплитуд гармоник банка на волну
+    s32 const *sin_q30;  // ksound_wavetables.sin_q30 для банков
+    struct ksound_wavetables const *tables;  // откуда взяты table
+};
+
+/*
+ * Синус фазы (2^32 - полный круг) в формате Q30. Считается рядом Тейлора до
+ * x^11 по схеме Горнера в целых числах, ошибка меньше 1e-7. Нужен только для
+ * построения таблиц, поэтому скорость не важна.
+ */
+static inline s32 ksound_sin_q30(u32 phase) {
+    // NOTE: 2^32/6, 2^32/20, ... обратные делители ряда в формате Q32
+    static u32 const rcp[] = {715827883u, 214748365u, 102261126u, 59652324u,
+                              39045157u};
+    u32 const quadrant = phase >> 30;
+    s64 p = phase & (KSOUND_Q30_ONE - 1), x, x2, r;
+    int i;
+
+    if (quadrant & 1) p = KSOUND_Q30_ONE - p;
+
+    // NOTE: доля четверти круга в радианы, pi/2 в Q30 = 1686629713
+    x = (p * 1686629713LL) >> 30;
+    x2 = (x * x) >> 30;
+
+    // NOTE: sin x = x(1 - x^2/6(1 - x^2/20(1 - x^2/42(1 - x^2/72(1 -
+    // x^2/110)))))
+    r = KSOUND_Q30_ONE;
+    for (i = 4; i >= 0; i--)
+        r = KSOUND_Q30_ONE - ((((x2 * r) >> 30) * rcp[i]) >> 32);
+
+    r = (x * r) >> 30;
+    return (s32)(quadrant & 2 ? -r : r);
+}
+
+/*
+ * Переводит таблицу из промежуточного буфера (Q30 или меньше) в s16 с
+ * нормировкой по пику.
+ */
+static inline void ksound_table_store(s16 *table, s32 const *src) {
+    u64 scale;
+    s32 peak = 1;
+    int n;
+
+    for (n = 0; n < KSOUND_TABLE_SIZE; n++) {
+        s32 const a = src[n] < 0 ? -src[n] : src[n];
+        if (a > peak) peak = a;
+    }
+
+    // NOTE: один 64-битный делитель на таблицу, дальше только умножение
+    scale = ksound_div_u64(32767ULL << 32, (u32)peak);
+
+    for (n = 0; n < KSOUND_TABLE_SIZE; n++)
+        table[n] = (s16)(((s64)src[n] * (s64)scale + (1LL << 31)) >> 32);
+
+    table[KSOUND_TABLE_SIZE] = table[0];
+}
+
+/*
+ * Строит все таблицы. Пила, меандр и треугольник складываются из гармоник
+ * синуса (ряд Фурье), индекс (k * n) mod N даёт точный синус k-й гармоники без
+ * дополнительной арифметики. Вызывается один раз при загрузке модуля.
+ */
+static inline void ksound_tables_init(struct ksound_wavetables *t) {
+    s32 *const sin_q30 = t->sin_q30;
+    s32 *const sums = t->sums;
+    int shape, band, n, k;
+
+    for (n = 0; n < KSOUND_TABLE_SIZE; n++)
+        sin_q30[n] = ksound_sin_q30((u32)n << (32 - KSOUND_TABLE_BITS));
+
+    ksound_table_store(t->sine, sin_q30);
+
+    // NOTE: четверть круга - 2^30, колено занимает её целиком
+    for (n = 0; n < KSOUND_CLIP_SIZE; n++) {
+        s64 const s = ksound_sin_q30((u32)n << (30 - KSOUND_CLIP_BITS));
+        s64 const rise = (s * (32767 - KSOUND_CLIP_KNEE) + (1LL << 29)) >> 30;
+
+        t->clip[n] = (s16)(KSOUND_CLIP_KNEE + rise);
+    }
+
+    for (shape = KSOUND_SHAPE_SAW; shape < KSOUND_SHAPE_COUNT; shape++) {
+        for (band = 0; band < KSOUND_TABLE_BANDS; band++) {
+            int const harmonics = 1 << band;
+
+            for (n = 0; n < KSOUND_TABLE_SIZE; n++) {
+                s64 acc = 0;
+
+                for (k = 1; k <= harmonics; k++) {
+                    s32 const s =
+                        sin_q30[((u32)k * n) & (KSOUND_TABLE_SIZE - 1)];
+
+                    // NOTE: пила 1/k, меандр 1/k по нечётным, треугольник
+                    // +-1/k^2 по нечётным со сменой знака
+                    if (shape == KSOUND_SHAPE_SAW) {
+                        acc += s / k;
+                    } else if (k & 1) {
+                        if (shape == KSOUND_SHAPE_SQUARE)
+                            acc += s / k;
+                        else if ((k >> 1) & 1)
+                            acc -= s / (k * k);
+                        else
+                            acc += s / (k * k);
+                    }
+                }
+
+                // NOTE: сумма ряда не больше 2, хранится в Q28
+                sums[n] = (s32)(acc >> 2);
+            }
+
+            ksound_table_store(t->bands[shape - 1][band], sums);
+        }
+    }
+}
+
+/*
+ * Выбирает таблицу для формы волны и частоты: самую богатую полосу, гармоники
+ * которой ещё не выходят за половину частоты дискретизации.
+ */
+static inline s16 const *ksound_table_for(struct ksound_wavetables const *t,
+                                          int shape, int freq, int rate) {
+    int band = 0, harmonics;
+
+    if (shape <= KSOUND_SHAPE_SINE || shape >= KSOUND_SHAPE_COUNT)
+        return t->sine;
+
+    harmonics = freq > 0 ? rate / (2 * freq) : 1 << (KSOUND_TABLE_BANDS - 1);
+
+    while (band < KSOUND_TABLE_BANDS - 1 && (2 << band) <= harmonics) band++;
+
+    return t->bands[shape - 1][band];
+}
+
+/*
+ * Приращение фазы за кадр: freq * 2^32 / rate. Точность частоты rate/2^32 Гц,
+ * то есть 480 и 500 Гц больше не совпадают.
+ */
+static inline u32 ksound_phase_incr(int freq, int rate) {
+    return (u32)ksound_div_u64((u64)freq << 32, rate);
+}
+
+/*
+ * Размер блока памяти под набор из count волн вместе с массивами.
+ */
+static inline size_t ksound_voices_bytes(int count) {
+    return sizeof(struct ksound_voices) +
+           count * (4 * sizeof(u32) + sizeof(s32) + sizeof(s16 const *) +
+                    2 + KSOUND_PARTIALS);
+}
+
+/*
+ * Размечает блок памяти размера ksound_voices_bytes(count). Указатели идут
+ * первыми чтобы не думать о выравнивании.
+ */
+static inline struct ksound_voices *ksound_voices_layout(void *mem, int count,
+                                                         int rate) {
+    struct ksound_voices *const v = mem;
+
+    v->count = count;
+    v->rate = rate;
+    v->table = (s16 const **)(v + 1);
+    v->id = (u32 *)(v->table + count);
+    v->wave = v->id + count;
+    v->phase = v->wave + count;
+    v->incr = v->phase + count;
+    v->gain = (s32 *)(v->incr + count);
+    v->shape = (u8 *)(v->gain + count);
+    v->harmonics = v->shape + count;
+    v->partials = v->harmonics + count;
+    v->sin_q30 = NULL;
+    v->tables = NULL;
+    return v;
+}
+
+/*
+ * Окно на волны [start, start + count) набора src без копирования: массивы
+ * общие, поэтому рендер окна двигает фазы прямо в src. Окна без пересечений
+ * можно рендерить одновременно. Приращения src должны быть уже пересчитаны
+ * (ksound_voices_retune), окно наследует его rate.
+ */
+static inline void ksound_voices_slice(struct ksound_voices *dst,
+                                       struct ksound_voices const *src,
+                                       int start, int count) {
+    dst->count = count;
+    dst->rate = src->rate;
+    dst->id = src->id + start;
+    dst->wave = src->wave + start;
+    dst->phase = src->phase + start;
+    dst->incr = src->incr + start;
+    dst->gain = src->gain + start;
+    dst->table = src->table + start;
+    dst->shape = src->shape + start;
+    dst->harmonics = src->harmonics + start;
+    dst->partials = src->partials + start * KSOUND_PARTIALS;
+    dst->sin_q30 = src->sin_q30;
+    dst->tables = src->tables;
+}
+
+/*
+ * Переносит волну из одного набора в другой вместе с текущей фазой.
+ */
+static inline void ksound_voices_copy(struct ksound_voices *dst, int d,
+                                      struct ksound_voices const *src, int s) {
+    dst->id[d] = src->id[s];
+    dst->wave[d] = src->wave[s];
+    dst->phase[d] = src->phase[s];
+    dst->incr[d] = src->incr[s];
+    dst->gain[d] = src->gain[s];
+    dst->table[d] = src->table[s];
+    dst->shape[d] = src->shape[s];
+    dst->harmonics[d] = src->harmonics[s];
+    memcpy(dst->partials + d * KSOUND_PARTIALS,
+           src->partials + s * KSOUND_PARTIALS, KSOUND_PARTIALS);
+}
+
+/*
+ * Заполняет волну по упакованному описанию. Начальная фаза в градусах
+ * переводится в аккумулятор, приращение считается один раз здесь.
+ */
+static inline void ksound_voices_set(struct ksound_voices *v, int i,
+                                     struct ksound_wavetables const *t,
+                                     u32 wave, int shape) {
+    v->wave[i] = wave;
+    v->phase[i] =
+        (u32)ksound_div_u64((u64)(GETWAVEPHASE(wave) % 360) << 32, 360);
+    v->incr[i] = ksound_phase_incr(GETWAVEFREQ(wave), v->rate);
+    // NOTE: амплитуда 0..127, 127 - полная шкала таблицы
+    v->gain[i] = (GETWAVEAMP(wave) * KSOUND_GAIN_ONE + 63) / 127;
+    v->table[i] = ksound_table_for(t, shape, GETWAVEFREQ(wave), v->rate);
+    v->shape[i] = shape;
+    v->harmonics[i] = 0;
+    v->tables = t;
+}
+
+/*
+ * Заполняет волну банком гармоник (ksound_render_bank): wave - основной тон и
+ * уровень всего банка, partials - KSOUND_PARTIALS относительных амплитуд
+ * гармоник 1, 2, ... (0..127). Банк из одних нулей молчит, но место занимает.
+ */
+static inline void ksound_voices_set_bank(struct ksound_voices *v, int i,
+                                          struct ksound_wavetables const *t,
+                                          u32 wave, u8 const *partials) {
+    u8 *const amps = v->partials + i * KSOUND_PARTIALS;
+    int k, n = 0;
+
+    ksound_voices_set(v, i, t, wave, KSOUND_SHAPE_SINE);
+
+    for (k = 0; k < KSOUND_PARTIALS; k++) {
+        amps[k] = partials[k] & 0x7f;
+        if (amps[k]) n = k + 1;
+    }
+
+    // NOTE: 0 означает обычную волну, банк из одних нулей рендер пропустит
+    // по нулевой сумме амплитуд
+    v->harmonics[i] = n;
+    v->sin_q30 = t->sin_q30;
+}
+
+/*
+ * Отсчёт таблицы для фазы с линейной интерполяцией.
+ */
+static inline s32 ksound_dds_sample(s16 const *table, u32 phase) {
+    u32 const idx = phase >> (32 - KSOUND_TABLE_BITS);
+    s32 const frac = (phase >> (32 - KSOUND_TABLE_BITS - KSOUND_FRAC_BITS)) &
+                     ((1 << KSOUND_FRAC_BITS) - 1);
+    s32 const a = table[idx], b = table[idx + 1];
+
+    return a + (((b - a) * frac) >> KSOUND_FRAC_BITS);
+}
+
+/*
+ * Пересчитывает приращения и таблицы если частота дискретизации потока
+ * отличается от той, для которой они посчитаны. Случается один раз после
+ * hw_params. Полоса таблицы тоже зависит от частоты: пила выбранная для
+ * 48 кГц на 8 кГц дала бы наложение спектра.
+ */
+static inline void ksound_voices_retune(struct ksound_voices *v, int rate) {
+    int j;
+
+    if (v->rate == rate) return;
+
+    for (j = 0; j < v->count; j++) {
+        int const freq = GETWAVEFREQ(v->wave[j]);
+
+        v->incr[j] = ksound_phase_incr(freq, rate);
+        if (v->tables)
+            v->table[j] = ksound_table_for(v->tables, v->shape[j], freq, rate);
+    }
+    v->rate = rate;
+}
+
+/*
+ * Удаляет все волны с частотой freq. Порядок оставшихся волн сохраняется.
+ * Возвращает количество удалённых волн.
+ */
+static inline int ksound_voices_remove_freq(struct ksound_voices *v, u32 freq) {
+    int const old_count = v->count;
+    int i, j;
+
+    for (i = 0, j = 0; i < old_count; i++) {
+        if (GETWAVEFREQ(v->wave[i]) == freq) continue;
+        if (i != j) ksound_voices_copy(v, j, v, i);
+        j++;
+    }
+
+    v->count = j;
+    return old_count - j;
+}
+
+/*
+ * Удаляет волну с идентификатором id. Порядок оставшихся волн сохраняется.
+ * Возвращает 1 если волна была.
+ */
+static inline int ksound_voices_remove_id(struct ksound_voices *v, u32 id) {
+    int i;
+
+    for (i = 0; i < v->count; i++) {
+        if (v->id[i] == id) {
+            for (; i + 1 < v->count; i++) ksound_voices_copy(v, i, v, i + 1);
+            v->count--;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Меняет описание волн с той же частотой что у wave. Фаза и форма волны
+ * остаются прежними, поэтому звук не щёлкает. Возвращает количество волн.
+ */
+static inline int ksound_voices_update_freq(struct ksound_voices *v,
+                                            struct ksound_wavetables const *t,
+                                            u32 wave) {
+    int i, n = 0;
+
+    for (i = 0; i < v->count; i++) {
+        if (GETWAVEFREQ(v->wave[i]) == GETWAVEFREQ(wave)) {
+            u32 const phase = v->phase[i];
+            s16 const *const table = v->table[i];
+            u8 const shape = v->shape[i];
+
+            ksound_voices_set(v, i, t, wave, KSOUND_SHAPE_SINE);
+            v->phase[i] = phase;
+            v->table[i] = table;
+            v->shape[i] = shape;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Синус фазы в формате Q30 по таблице sin_q30 с линейной интерполяцией по
+ * всем 21 младшим битам фазы. Ошибка около 1e-6, на порядок точнее таблиц s16:
+ * рекуррентность банка умножает ошибку на номер гармоники.
+ */
+static inline s32 ksound_sin_q30_sample(s32 const *sin_q30, u32 phase) {
+    u32 const idx = phase >> (32 - KSOUND_TABLE_BITS);
+    s64 const frac = phase & ((1u << (32 - KSOUND_TABLE_BITS)) - 1);
+    s32 const a = sin_q30[idx];
+    s32 const b = sin_q30[(idx + 1) & (KSOUND_TABLE_SIZE - 1)];
+
+    return a + (s32)(((b - a) * frac) >> (32 - KSOUND_TABLE_BITS));
+}
+
+// NOTE: кадров банка гармоник за один проход по гармоникам, шаг гармоники
+// в ksound_render_bank расписан на 4 кадра вручную
+#define KSOUND_BANK_LANES 4
+
+/*
+ * Следующая гармоника рекуррентностью Чебышёва, cos2 = 2cos(x) в Q30.
+ */
+static inline s64 ksound_bank_next(s64 cos2, s64 *cur, s64 *prev) {
+    s64 const next = ((cos2 * *cur) >> 30) - *prev;
+
+    *prev = *cur;
+    *cur = next;
+    return next;
+}
+
+/*
+ * Добавляет банк гармоник j в буфер накопления. Все гармоники считаются от
+ * одной фазы основного тона рекуррентностью Чебышёва
+ * sin((k + 1)x) = 2cos(x)sin(kx) - sin((k - 1)x), то есть на кадр два
+ * отсчёта таблицы, а на гармонику два умножения. Гармоники от rate / 2 и выше
+ * не звучат (теорема Котельникова). Амплитуды нормируются на их сумму, поэтому
+ * пик банка не больше уровня волны wave. Общая для всех ядер рендера, поэтому
+ * вывод до бита одинаковый.
+ */
+static inline void ksound_render_bank(s32 *accum, size_t frame_count,
+                                      struct ksound_voices *v, int j) {
+    u8 const *const amps = v->partials + j * KSOUND_PARTIALS;
+    s32 const *const sin_q30 = v->sin_q30;
+    u32 const freq = GETWAVEFREQ(v->wave[j]);
+    u32 const incr = v->incr[j];
+    u32 phase = v->phase[j];
+    s64 gains[KSOUND_PARTIALS];
+    int n = v->harmonics[j], k;
+    u32 sum = 0;
+    size_t i;
+
+    for (k = 0; k < n; k++) sum += amps[k];
+
+    if ((u32)v->rate / 2 <= freq * n) n = freq ? (v->rate / 2 - 1) / freq : 0;
+
+    if (sum == 0 || n == 0) {
+        v->phase[j] = phase + (u32)frame_count * incr;
+        return;
+    }
+
+    // NOTE: усиление гармоник Q30, в сумме не больше усиления волны
+    for (k = 0; k < n; k++)
+        gains[k] = ksound_div_u64((u64)v->gain[j] * amps[k]
+                                      << (30 - KSOUND_GAIN_BITS),
+                                  sum);
+
+    // NOTE: цепочка гармоник одного кадра последовательная, поэтому
+    // KSOUND_BANK_LANES кадров идут вместе: их цепочки независимы и умножения
+    // перекрываются
+    for (i = 0; i < frame_count; i += KSOUND_BANK_LANES) {
+        s64 cos2[KSOUND_BANK_LANES], prev[KSOUND_BANK_LANES];
+        s64 cur[KSOUND_BANK_LANES], acc[KSOUND_BANK_LANES];
+        int const lanes = frame_count - i < KSOUND_BANK_LANES
+                              ? (int)(frame_count - i)
+                              : KSOUND_BANK_LANES;
+        int l;
+
+        for (l = 0; l < KSOUND_BANK_LANES; l++) {
+            u32 const p = phase + l * incr;
+
+            cos2[l] = 2 * (s64)ksound_sin_q30_sample(sin_q30, p + (1u << 30));
+            cur[l] = ksound_sin_q30_sample(sin_q30, p);
+            prev[l] = 0;
+            acc[l] = gains[0] * cur[l];
+        }
+
+        // NOTE: |sin| и сумма усилений не больше 2^30, acc не больше 2^60
+        for (k = 1; k < n; k++) {
+            s64 const g = gains[k];
+
+            acc[0] += g * ksound_bank_next(cos2[0], &cur[0], &prev[0]);
+            acc[1] += g * ksound_bank_next(cos2[1], &cur[1], &prev[1]);
+            acc[2] += g * ksound_bank_next(cos2[2], &cur[2], &prev[2]);
+            acc[3] += g * ksound_bank_next(cos2[3], &cur[3], &prev[3]);
+        }
+
+        // NOTE: Q60 в размах s16 как у отсчёта таблицы
+        for (l = 0; l < lanes; l++)
+            accum[i + l] += (s32)(((acc[l] >> 30) * 32767) >> 30);
+
+        phase += lanes * incr;
+    }
+
+    v->phase[j] = phase;
+}
+
+/*
+ * Добавляет все волны в буфер накопления s32. Внешний цикл по волнам,
+ * внутренний по кадрам: фаза, приращение и таблица волны живут в регистрах,
+ * буфер накопления последовательно проходится целиком и остаётся в кэше.
+ * Буфер не очищается, так можно смешать несколько наборов.
+ */
+static inline void ksound_render_voices(s32 *accum, size_t frame_count,
+                                        struct ksound_voices *v) {
+    size_t i;
+    int j;
+
+    for (j = 0; j < v->count; j++) {
+        s16 const *const table = v->table[j];
+        u32 const incr = v->incr[j];
+        s32 const gain = v->gain[j];
+        u32 phase = v->phase[j];
+
+        if (v->harmonics[j]) {
+            ksound_render_bank(accum, frame_count, v, j);
+            continue;
+        }
+
+        for (i = 0; i < frame_count; i++) {
+            s32 const sample = ksound_dds_sample(table, phase);
+
+            accum[i] += (sample * gain) >> KSOUND_GAIN_BITS;
+
+            // NOTE: u32 переполняется сам, проверка на полный круг не нужна
+            phase += incr;
+        }
+
+        // NOTE: нужно сохранить новую фазу, иначе волна не развивается
+        v->phase[j] = phase;
+    }
+}
+
+/*
+ * Ядро рендера: добавляет все волны набора в буфер накопления. Скалярное
+ * ksound_render_voices всегда доступно, векторные варианты в ksound_simd.c.
+ */
+typedef void (*ksound_render_fn)(s32 *accum, size_t frame_count,
+                                 struct ksound_voices *v);
+
+struct ksound_render_kernel {
+    char const *name;
+    ksound_render_fn render;  // NULL - скалярное ksound_render_voices
+    int (*supported)(void);   // доступно ли на текущем процессоре
+    int automatic;  // выбирается ksound_render_kernel_best, иначе только simd
+};
+
+/*
+ * Вызывает ядро рендера. Векторное ядро работает только внутри
+ * ksound_simd_begin/end, а если SIMD сейчас трогать нельзя (например прервали
+ * код ядра который сам держит FPU) - скалярное ядро.
+ */
+static inline void ksound_render_run(struct ksound_render_kernel const *kernel,
+                                     s32 *accum, size_t frame_count,
+                                     struct ksound_voices *v) {
+    if (!kernel || !kernel->render || !may_use_simd()) {
+        ksound_render_voices(accum, frame_count, v);
+        return;
+    }
+
+    ksound_simd_begin();
+    kernel->render(accum, frame_count, v);
+    ksound_simd_end();
+}
+
+/*
+ * Добавляет частичную сумму другого буфера накопления.
+ */
+static inline void ksound_accum_add(s32 *accum, s32 const *partial,
+                                    size_t frame_count) {
+    size_t i;
+
+    for (i = 0; i < frame_count; i++) accum[i] += partial[i];
+}
+
+/*
+ * Форматы отсчёта области DMA. Смесь в буфере накопления имеет размах s16,
+ * более широкие форматы получают её в старших битах.
+ */
+enum ksound_format {
+    KSOUND_FORMAT_S16,  // S16_LE
+    KSOUND_FORMAT_S24,  // S24_LE, 24 бита в младших байтах 32-битного слова
+    KSOUND_FORMAT_S32,  // S32_LE
+    KSOUND_FORMAT_COUNT,
+};
+
+#define KSOUND_MAX_CHANNELS 8
+
+// NOTE: общее усиление смеси в формате Q16, 1.0 = 65536
+#define KSOUND_MASTER_BITS 16
+#define KSOUND_MASTER_ONE (1 << KSOUND_MASTER_BITS)
+
+// NOTE: обратное к запасу громкости headroom (сколько волн полной амплитуды
+// помещается до ограничения), headroom от 1 до KSOUND_MASTER_ONE. Считается
+// один раз при смене запаса, на выводе остаётся только умножение
+#define KSOUND_MASTER_GAIN(headroom) \
+    ((KSOUND_MASTER_ONE + (headroom) / 2) / (headroom))
+
+/*
+ * Выходной каскад смеси: общее усиление и таблица мягкого ограничения
+ * (ksound_wavetables.clip).
+ */
+struct ksound_master {
+    s32 gain;  // Q16, не больше KSOUND_MASTER_ONE
+    s16 const *clip;
+};
+
+/*
+ * Мягкое ограничение отсчёта с размахом s16. Почти все отсчёты ниже колена и
+ * проходят без таблицы.
+ */
+static inline s32 ksound_soft_clip(s16 const *clip, s32 x) {
+    s32 const a = x < 0 ? -x : x;
+    s32 y;
+
+    if (a <= KSOUND_CLIP_KNEE) return x;
+
+    y = a - KSOUND_CLIP_KNEE < KSOUND_CLIP_SIZE ? clip[a - KSOUND_CLIP_KNEE]
+                                                 : 32767;
+    return x < 0 ? -y : y;
+}
+
+/*
+ * Переводит буфер накопления в чередующиеся кадры области DMA через выходной
+ * каскад master, во всех каналах один и тот же звук.
+ */
+typedef void (*ksound_emit_fn)(void *samples, s32 const *accum,
+                               size_t frame_count,
+                               struct ksound_master const *master);
+
+// NOTE: отдельная функция на каждое сочетание формата и числа каналов. Число
+// каналов - константа, поэтому внутренний цикл раскрывается компилятором и
+// в нём нет ни ветвлений, ни умножения на число каналов
+#define KSOUND_DEFINE_EMIT(name, type, shift, channels)                      \
+    static inline void ksound_emit_##name##_##channels(                      \
+        void *samples, s32 const *accum, size_t frame_count,                 \
+        struct ksound_master const *master) {                                \
+        type *out = samples;                                                 \
+        s32 const gain = master->gain;                                       \
+        s16 const *const clip = master->clip;                                \
+        size_t i;                                                            \
+        int c;                                                               \
+                                                                             \
+        for (i = 0; i < frame_count; i++, out += (channels)) {               \
+            s32 const mixed =                                                \
+                (s32)(((s64)accum[i] * gain) >> KSOUND_MASTER_BITS);         \
+            type const sample =                                              \
+                (type)((u32)ksound_soft_clip(clip, mixed) << (shift));       \
+                                                                             \
+            for (c = 0; c < (channels); c++) out[c] = sample;                \
+        }                                                                    \
+    }
+
+#define KSOUND_DEFINE_EMIT_FORMAT(name, type, shift) \
+    KSOUND_DEFINE_EMIT(name, type, shift, 1)         \
+    KSOUND_DEFINE_EMIT(name, type, shift, 2)         \
+    KSOUND_DEFINE_EMIT(name, type, shift, 3)         \
+    KSOUND_DEFINE_EMIT(name, type, shift, 4)         \
+    KSOUND_DEFINE_EMIT(name, type, shift, 5)         \
+    KSOUND_DEFINE_EMIT(name, type, shift, 6)         \
+    KSOUND_DEFINE_EMIT(name, type, shift, 7)         \
+    KSOUND_DEFINE_EMIT(name, type, shift, 8)
+
+KSOUND_DEFINE_EMIT_FORMAT(s16, s16, 0)
+KSOUND_DEFINE_EMIT_FORMAT(s24, s32, 8)
+KSOUND_DEFINE_EMIT_FORMAT(s32, s32, 16)
+
+#define KSOUND_EMIT_ROW(name)                                              \
+    {                                                                      \
+        NULL, ksound_emit_##name##_1, ksound_emit_##name##_2,              \
+            ksound_emit_##name##_3, ksound_emit_##name##_4,                \
+            ksound_emit_##name##_5, ksound_emit_##name##_6,                \
+            ksound_emit_##name##_7, ksound_emit_##name##_8,                \
+    }
+
+/*
+ * Функция вывода для формата и числа каналов, NULL если такого сочетания нет.
+ * Выбирается один раз в hw_params.
+ */
+static inline ksound_emit_fn ksound_emit_for(int format, int channels) {
+    static ksound_emit_fn const emit[KSOUND_FORMAT_COUNT]
+                                    [KSOUND_MAX_CHANNELS + 1] = {
+        [KSOUND_FORMAT_S16] = KSOUND_EMIT_ROW(s16),
+        [KSOUND_FORMAT_S24] = KSOUND_EMIT_ROW(s24),
+        [KSOUND_FORMAT_S32] = KSOUND_EMIT_ROW(s32),
+    };
+
+    if (format < 0 || format >= KSOUND_FORMAT_COUNT) return NULL;
+    if (channels < 1 || channels > KSOUND_MAX_CHANNELS) return NULL;
+    return emit[format][channels];
+}
+
+/*
+ * Размер кадра в байтах.
+ */
+static inline size_t ksound_frame_bytes(int format, int channels) {
+    return (format == KSOUND_FORMAT_S16 ? sizeof(s16) : sizeof(s32)) *
+           channels;
+}
+
+/*
+ * Добавляет отсчёты src к уже выведенным отсчётам dst того же формата с
+ * насыщением. Так звук петли воспроизведения ложится поверх волн.
+ */
+typedef void (*ksound_add_fn)(void *dst, void const *src, size_t sample_count);
+
+static inline void ksound_add_s16(void *dst, void const *src,
+                                  size_t sample_count) {
+    s16 *const d = dst;
+    s16 const *const s = src;
+    size_t i;
+
+    for (i = 0; i < sample_count; i++) {
+        s32 const sum = (s32)d[i] + s[i];
+
+        d[i] = sum > 32767 ? 32767 : sum < -32768 ? -32768 : sum;
+    }
+}
+
+static inline void ksound_add_s24(void *dst, void const *src,
+                                  size_t sample_count) {
+    s32 *const d = dst;
+    s32 const *const s = src;
+    size_t i;
+
+    // NOTE: старший байт S24_LE не значащий, знак берётся из 23 бита
+    for (i = 0; i < sample_count; i++) {
+        s32 const sum = ((s32)((u32)d[i] << 8) >> 8) +
+                        ((s32)((u32)s[i] << 8) >> 8);
+
+        d[i] = sum > 0x7fffff ? 0x7fffff : sum < -0x800000 ? -0x800000 : sum;
+    }
+}
+
+static inline void ksound_add_s32(void *dst, void const *src,
+                                  size_t sample_count) {
+    s32 *const d = dst;
+    s32 const *const s = src;
+    size_t i;
+
+    for (i = 0; i < sample_count; i++) {
+        s64 const sum = (s64)d[i] + s[i];
+
+        d[i] = sum > 0x7fffffffLL    ? 0x7fffffff
+               : sum < -0x80000000LL ? (s32)-0x80000000LL
+                                     : (s32)sum;
+    }
+}
+
+/*
+ * Сложение с насыщением для формата, NULL если формата нет.
+ */
+static inline ksound_add_fn ksound_add_for(int format) {
+    switch (format) {
+        case KSOUND_FORMAT_S16:
+            return ksound_add_s16;
+        case KSOUND_FORMAT_S24:
+            return ksound_add_s24;
+        case KSOUND_FORMAT_S32:
+            return ksound_add_s32;
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * Добавляет волны набора в буфер накопления, буфер должен быть очищен
+ * заранее. Возвращает количество волн.
+ */
+static inline int ksound_mix_waves(s32 *accum, size_t sample_count, int rate,
+                                   struct ksound_voices *waves,
+                                   struct ksound_render_kernel const *kernel) {
+    int const wave_count = waves ? waves->count : 0;
+
+    if (wave_count > 0) {
+        ksound_voices_retune(waves, rate);
+        ksound_render_run(kernel, accum, sample_count, waves);
+    }
+
+    return wave_count;
+}
+
+/*
+ * Генерирует и смешивает несколько волн в кадры S16_LE L+R. accum - буфер
+ * накопления не меньше sample_count элементов, kernel - ядро рендера (NULL -
+ * скалярное), master - выходной каскад.
+ */
+static inline void make_sine_waves(s16 *samples, s32 *accum,
+                                   size_t sample_count, int rate,
+                                   struct ksound_voices *waves,
+                                   struct ksound_render_kernel const *kernel,
+                                   struct ksound_master const *master) {
+    memset(accum, 0, sample_count * sizeof(*accum));
+    ksound_mix_waves(accum, sample_count, rate, waves, kernel);
+    ksound_emit_s16_2(samples, accum, sample_count, master);
+}
+
+#endif  // KSOUND_RENDER_H
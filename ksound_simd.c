@@ -0,0 +1,260 @@
+// NOTE: первым, ksound_render.h задаёт KSOUND_SIMD_X86_64 и KSOUND_SIMD_ARM64
+#include "ksound_simd.h"
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/string.h>  // sysfs_streq, memset, ...
+#if defined(KSOUND_SIMD_X86_64)
+#include <asm/cpufeature.h>  // boot_cpu_has, ...
+#include <asm/fpu/api.h>     // cpu_has_xfeatures, ...
+#elif defined(KSOUND_SIMD_ARM64)
+#include <asm/cpufeature.h>  // cpu_have_named_feature, ...
+#endif
+#else
+#include <string.h>
+#endif
+
+// NOTE: весь этот файл собирается с SIMD регистрами (см. Kbuild), поэтому
+// функции отсюда вызываются только между ksound_simd_begin и ksound_simd_end,
+// скалярный запасной путь живёт в ksound_render.h у вызывающего
+#ifdef __KERNEL__
+#define ksound_streq(a, b) sysfs_streq((a), (b))
+#else
+#define ksound_streq(a, b) (strcmp((a), (b)) == 0)
+#endif
+
+#define KSOUND_IDX_SHIFT (32 - KSOUND_TABLE_BITS)
+#define KSOUND_FRAC_SHIFT (32 - KSOUND_TABLE_BITS - KSOUND_FRAC_BITS)
+#define KSOUND_FRAC_MASK ((1 << KSOUND_FRAC_BITS) - 1)
+
+static int ksound_scalar_supported(void) { return 1; }
+
+#if defined(KSOUND_SIMD_X86_64) || defined(KSOUND_SIMD_ARM64)
+
+// NOTE: v4s32 - значения в регистрах, v4s32_mem - невыровненный доступ к
+// буферу накопления
+typedef s32 v4s32 __attribute__((vector_size(16)));
+typedef u32 v4u32 __attribute__((vector_size(16)));
+typedef s32 v4s32_mem __attribute__((vector_size(16), aligned(4), may_alias));
+// NOTE: пара соседних отсчётов таблицы, адрес выровнен только на 2
+typedef s32 s32_mem __attribute__((aligned(2), may_alias));
+
+/*
+ * Четыре отсчёта таблицы для четырёх фаз. Векторных выборок по индексу в SSE2 и
+ * NEON нет, поэтому как и в ksound_v8_sample 32-битное слово по адресу
+ * table + idx читается одной загрузкой на полосу: в нём сразу table[idx] и
+ * table[idx + 1]. Разбор слов и интерполяция векторные.
+ */
+static inline v4s32 ksound_v4_sample(s16 const *table, v4u32 phase) {
+    v4s32 const idx = (v4s32)(phase >> KSOUND_IDX_SHIFT);
+    v4s32 const frac = (v4s32)((phase >> KSOUND_FRAC_SHIFT) & KSOUND_FRAC_MASK);
+    v4s32 const w = {*(s32_mem const *)(table + idx[0]),
+                     *(s32_mem const *)(table + idx[1]),
+                     *(s32_mem const *)(table + idx[2]),
+                     *(s32_mem const *)(table + idx[3])};
+    v4s32 const a = (v4s32)((v4u32)w << 16) >> 16;
+    v4s32 const b = w >> 16;
+
+    return a + (((b - a) * frac) >> KSOUND_FRAC_BITS);
+}
+
+/*
+ * Одна волна по 8 кадров за итерацию, хвост периода скалярно.
+ */
+static void ksound_v4_voice(s32 *accum, size_t frame_count, s16 const *table,
+                            u32 phase, u32 incr, s32 gain) {
+    v4u32 const lane = {0, 1, 2, 3};
+    v4u32 ph0 = phase + lane * incr;
+    v4u32 ph1 = ph0 + 4 * incr;
+    u32 const step = 8 * incr;
+    size_t i;
+
+    for (i = 0; i + 8 <= frame_count; i += 8) {
+        v4s32_mem *const acc = (v4s32_mem *)(accum + i);
+
+        acc[0] += (ksound_v4_sample(table, ph0) * gain) >> KSOUND_GAIN_BITS;
+        acc[1] += (ksound_v4_sample(table, ph1) * gain) >> KSOUND_GAIN_BITS;
+
+        ph0 += step;
+        ph1 += step;
+    }
+
+    for (phase = ph0[0]; i < frame_count; i++) {
+        accum[i] +=
+            (ksound_dds_sample(table, phase) * gain) >> KSOUND_GAIN_BITS;
+        phase += incr;
+    }
+}
+
+/*
+ * 4-х полосное ядро: SSE2 на x86_64 и NEON на arm64, код один и тот же. Как и
+ * скалярное ядро добавляет к буферу накопления, не очищая его.
+ */
+static void ksound_render_v4(s32 *accum, size_t frame_count,
+                             struct ksound_voices *v) {
+    int j;
+
+    for (j = 0; j < v->count; j++) {
+        // NOTE: банк гармоник считается общим скалярным кодом
+        if (v->harmonics[j]) {
+            ksound_render_bank(accum, frame_count, v, j);
+            continue;
+        }
+
+        ksound_v4_voice(accum, frame_count, v->table[j], v->phase[j],
+                        v->incr[j], v->gain[j]);
+
+        // NOTE: нужно сохранить новую фазу, иначе волна не развивается
+        v->phase[j] += (u32)frame_count * v->incr[j];
+    }
+}
+
+#endif
+
+#if defined(KSOUND_SIMD_X86_64)
+
+#ifdef __clang__
+#define ksound_gather_d256 __builtin_ia32_gatherd_d256
+#else
+#define ksound_gather_d256 __builtin_ia32_gathersiv8si
+#endif
+
+typedef s32 v8s32 __attribute__((vector_size(32)));
+typedef u32 v8u32 __attribute__((vector_size(32)));
+typedef s32 v8s32_mem __attribute__((vector_size(32), aligned(4), may_alias));
+
+/*
+ * Восемь отсчётов одной выборкой vpgatherdd: 32-битное слово по адресу
+ * table + idx содержит сразу table[idx] в младшей половине и table[idx + 1] в
+ * старшей. Последний отсчёт таблицы повторяет первый, за границу не читаем.
+ */
+static inline __attribute__((target("avx2"))) v8s32
+ksound_v8_sample(s16 const *table, v8u32 phase) {
+    v8s32 const idx = (v8s32)(phase >> KSOUND_IDX_SHIFT);
+    v8s32 const frac = (v8s32)((phase >> KSOUND_FRAC_SHIFT) & KSOUND_FRAC_MASK);
+    v8s32 const zero = {0, 0, 0, 0, 0, 0, 0, 0};
+    v8s32 const mask = {-1, -1, -1, -1, -1, -1, -1, -1};
+    v8s32 const w =
+        ksound_gather_d256(zero, (int const *)table, idx, mask, 2);
+    v8s32 const a = (v8s32)((v8u32)w << 16) >> 16;
+    v8s32 const b = w >> 16;
+
+    return a + (((b - a) * frac) >> KSOUND_FRAC_BITS);
+}
+
+/*
+ * Одна волна по 16 кадров за итерацию, хвост периода скалярно.
+ */
+static __attribute__((target("avx2"))) void ksound_v8_voice(
+    s32 *accum, size_t frame_count, s16 const *table, u32 phase, u32 incr,
+    s32 gain) {
+    v8u32 const lane = {0, 1, 2, 3, 4, 5, 6, 7};
+    v8u32 ph0 = phase + lane * incr;
+    v8u32 ph1 = ph0 + 8 * incr;
+    u32 const step = 16 * incr;
+    size_t i;
+
+    for (i = 0; i + 16 <= frame_count; i += 16) {
+        v8s32_mem *const acc = (v8s32_mem *)(accum + i);
+
+        acc[0] += (ksound_v8_sample(table, ph0) * gain) >> KSOUND_GAIN_BITS;
+        acc[1] += (ksound_v8_sample(table, ph1) * gain) >> KSOUND_GAIN_BITS;
+
+        ph0 += step;
+        ph1 += step;
+    }
+
+    for (phase = ph0[0]; i < frame_count; i++) {
+        accum[i] +=
+            (ksound_dds_sample(table, phase) * gain) >> KSOUND_GAIN_BITS;
+        phase += incr;
+    }
+}
+
+static void ksound_render_avx2(s32 *accum, size_t frame_count,
+                               struct ksound_voices *v) {
+    int j;
+
+    for (j = 0; j < v->count; j++) {
+        if (v->harmonics[j]) {
+            ksound_render_bank(accum, frame_count, v, j);
+            continue;
+        }
+
+        ksound_v8_voice(accum, frame_count, v->table[j], v->phase[j],
+                        v->incr[j], v->gain[j]);
+        v->phase[j] += (u32)frame_count * v->incr[j];
+    }
+}
+
+#ifdef __KERNEL__
+static int ksound_sse2_supported(void) {
+    return boot_cpu_has(X86_FEATURE_XMM2);
+}
+
+static int ksound_avx2_supported(void) {
+    // NOTE: процессор умеет AVX2 и ядро сохраняет YMM при переключении
+    return boot_cpu_has(X86_FEATURE_AVX2) &&
+           cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL);
+}
+#else
+static int ksound_sse2_supported(void) {
+    return __builtin_cpu_supports("sse2");
+}
+
+static int ksound_avx2_supported(void) {
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#endif
+
+#if defined(KSOUND_SIMD_ARM64)
+#ifdef __KERNEL__
+static int ksound_neon_supported(void) {
+    return cpu_have_named_feature(ASIMD);
+}
+#else
+static int ksound_neon_supported(void) { return 1; }
+#endif
+#endif
+
+struct ksound_render_kernel const ksound_render_kernels[] = {
+    // NOTE: NULL - скалярный ksound_render_voices у вызывающего
+    {"scalar", NULL, ksound_scalar_supported, 1},
+    // NOTE: 4-х полосное ядро быстрее скалярного только от десятков волн и
+    // периодов от 64 кадров, на 8 кадрах и одной волне медленнее, поэтому
+    // выбирается только параметром simd
+#if defined(KSOUND_SIMD_X86_64)
+    {"sse2", ksound_render_v4, ksound_sse2_supported, 0},
+    {"avx2", ksound_render_avx2, ksound_avx2_supported, 1},
+#elif defined(KSOUND_SIMD_ARM64)
+    {"neon", ksound_render_v4, ksound_neon_supported, 0},
+#endif
+};
+
+int const ksound_render_kernel_count =
+    sizeof(ksound_render_kernels) / sizeof(ksound_render_kernels[0]);
+
+struct ksound_render_kernel const *ksound_render_kernel_find(char const *name) {
+    int i;
+
+    for (i = 0; i < ksound_render_kernel_count; i++) {
+        struct ksound_render_kernel const *const k = &ksound_render_kernels[i];
+
+        if (ksound_streq(name, k->name)) return k->supported() ? k : NULL;
+    }
+
+    return NULL;
+}
+
+struct ksound_render_kernel const *ksound_render_kernel_best(void) {
+    int i;
+
+    for (i = ksound_render_kernel_count - 1; i > 0; i--)
+        if (ksound_render_kernels[i].automatic &&
+            ksound_render_kernels[i].supported())
+            return &ksound_render_kernels[i];
+
+    return &ksound_render_kernels[0];
+}
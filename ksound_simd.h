@@ -0,0 +1,27 @@
+#ifndef KSOUND_SIMD_H
+#define KSOUND_SIMD_H
+
+/*
+ * Векторные ядра рендера. Собираются отдельным объектом (см. Kbuild) потому
+ * что остальной модуль собирается без SIMD регистров. Так же как и
+ * ksound_render.h собираются в пользовательском пространстве для make bench.
+ */
+
+#include "ksound_render.h"
+
+// NOTE: первым идёт скалярное ядро, дальше по возрастанию ширины вектора
+extern struct ksound_render_kernel const ksound_render_kernels[];
+extern int const ksound_render_kernel_count;
+
+/*
+ * Ядро по имени или NULL если такого нет или процессор его не поддерживает.
+ */
+struct ksound_render_kernel const *ksound_render_kernel_find(char const *name);
+
+/*
+ * Самое широкое ядро доступное на текущем процессоре из тех что выбираются
+ * автоматически, иначе скалярное.
+ */
+struct ksound_render_kernel const *ksound_render_kernel_best(void);
+
+#endif  // KSOUND_SIMD_H
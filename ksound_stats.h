@@ -0,0 +1,52 @@
+#ifndef KSOUND_STATS_H
+#define KSOUND_STATS_H
+
+/*
+ * Счётчики и гистограммы для debugfs (/sys/kernel/debug/ksound). У каждой
+ * гистограммы один писатель, debugfs читает без блокировок, поэтому значения
+ * между полями могут немного расходиться. Только для модуля ядра.
+ */
+
+#include <linux/bitops.h>  // fls64, ...
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/types.h>
+
+// NOTE: корзина i - значения от 2^i до 2^(i+1) нс, последняя всё что больше
+#define KSOUND_HIST_BUCKETS 32
+
+/*
+ * Гистограмма по степеням двойки, в нс.
+ */
+struct ksound_hist {
+    u64 count;
+    u64 sum;
+    u64 max;
+    u64 bucket[KSOUND_HIST_BUCKETS];
+};
+
+static inline void ksound_hist_add(struct ksound_hist *h, u64 value) {
+    int const i = value ? fls64(value) - 1 : 0;
+
+    h->bucket[min(i, KSOUND_HIST_BUCKETS - 1)]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+}
+
+/*
+ * Печатает гистограмму name: итог одной строкой и непустые корзины.
+ */
+static inline void ksound_hist_show(struct seq_file *m, char const *name,
+                                    struct ksound_hist const *h) {
+    int i;
+
+    seq_printf(m, "%s count %llu avg_ns %llu max_ns %llu\n", name, h->count,
+               h->count ? div64_u64(h->sum, h->count) : 0, h->max);
+
+    for (i = 0; i < KSOUND_HIST_BUCKETS; i++)
+        if (h->bucket[i])
+            seq_printf(m, "  %12llu ns %llu\n", 1ULL << i, h->bucket[i]);
+}
+
+#endif  // KSOUND_STATS_H
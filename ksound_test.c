@@ -0,0 +1,684 @@
+/*
+ * Тесты KUnit для синтеза и пула волн. Звуковая карта, ALSA и таймеры здесь
+ * не нужны, поэтому набор запускается под User-Mode Linux без звукового
+ * оборудования (см. .kunitconfig и README):
+ *
+ *   $ ./tools/testing/kunit/kunit.py run --kunitconfig=drivers/misc/ksound
+ *
+ * Команды ioctl волн только разбирают аргументы и зовут пул
+ * (ksound_pool.h), поэтому их семантика проверяется на пуле и состоянии
+ * рендера, которое из него получается.
+ *
+ * Только API KUnit ядра 6.1, на котором собирается модуль: пул теста
+ * освобождает .exit набора, медленные замеры вынесены в набор ksound_perf.
+ */
+#include <kunit/test.h>
+#include <linux/err.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>  // kvzalloc, kvfree, ...
+#include <linux/module.h>
+
+#include "ksound_pool.h"
+#include "ksound_render.h"
+#include "ksound_simd.h"
+
+// NOTE: таблицы ~150 КБ, строятся один раз на весь набор
+static struct ksound_wavetables *tables;
+
+#define KSOUND_TEST_RATE 48000
+
+// NOTE: бюджет рендера для замеров: frame_ns на кадр и ещё
+// voice_ns на каждую волну. Запас в несколько раз от скалярного ядра, на
+// медленной машине пределы можно поднять параметрами
+static int frame_ns = 50;
+module_param(frame_ns, int, 0444);
+MODULE_PARM_DESC(frame_ns, "render budget per frame, ns");
+
+static int voice_ns = 10;
+module_param(voice_ns, int, 0444);
+MODULE_PARM_DESC(voice_ns, "render budget per voice and frame, ns");
+
+/*
+ * Состояние рендера на capacity волн, освобождается вместе с тестом.
+ */
+static struct ksound_voices *ksound_test_voices(struct kunit *test,
+                                                int capacity) {
+    void *const mem =
+        kunit_kzalloc(test, ksound_voices_bytes(capacity), GFP_KERNEL);
+    struct ksound_voices *v;
+
+    KUNIT_ASSERT_NOT_NULL(test, mem);
+    v = ksound_voices_layout(mem, capacity, KSOUND_TEST_RATE);
+    v->count = 0;
+    return v;
+}
+
+/*
+ * Пул на capacity волн, один на тест. Освобождает его ksound_test_exit.
+ */
+static struct ksound_pool *ksound_test_pool(struct kunit *test, int capacity) {
+    struct ksound_pool *const pool = ksound_pool_create(capacity);
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pool);
+    KUNIT_ASSERT_NULL(test, test->priv);
+    test->priv = pool;
+    return pool;
+}
+
+/*
+ * Переносит изменения пула в v, как рендер в начале периода.
+ */
+static int ksound_test_sync(struct ksound_pool *pool, struct ksound_voices *v) {
+    u64 wait_ns;
+
+    return ksound_pool_sync(pool, v, tables, KSOUND_TEST_RATE, &wait_ns);
+}
+
+/*
+ * Место волны с дескриптором handle в состоянии рендера или -1.
+ */
+static int ksound_test_find(struct ksound_voices const *v, u32 handle) {
+    int i;
+
+    for (i = 0; i < v->count; i++)
+        if (v->id[i] == handle) return i;
+
+    return -1;
+}
+
+static void ksound_test_wave_macros(struct kunit *test) {
+    u32 wave = MAKEWAVE(87, 319, 41980);
+
+    KUNIT_EXPECT_EQ(test, GETWAVEAMP(wave), 87);
+    KUNIT_EXPECT_EQ(test, GETWAVEPHASE(wave), 319);
+    KUNIT_EXPECT_EQ(test, GETWAVEFREQ(wave), 41980);
+
+    wave = SETWAVEAMP(wave, 49);
+    wave = SETWAVEPHASE(wave, 187);
+    wave = SETWAVEFREQ(wave, 21953);
+
+    KUNIT_EXPECT_EQ(test, GETWAVEAMP(wave), 49);
+    KUNIT_EXPECT_EQ(test, GETWAVEPHASE(wave), 187);
+    KUNIT_EXPECT_EQ(test, GETWAVEFREQ(wave), 21953);
+
+    // NOTE: поля не залезают друг на друга на границах
+    wave = MAKEWAVE(0x7f, 0x1ff, 0xffff);
+    KUNIT_EXPECT_EQ(test, wave, 0xffffffffu);
+    KUNIT_EXPECT_EQ(test, SETWAVEPHASE(wave, 0), 0xffff007fu);
+    KUNIT_EXPECT_EQ(test, SETWAVEAMP(MAKEWAVE(0, 0, 0), 0x80), 0u);
+    KUNIT_EXPECT_EQ(test, GETWAVEFREQ(MAKEWAVE(1, 1, 0x10000)), 0);
+}
+
+static void ksound_test_voice_gain(struct kunit *test) {
+    struct ksound_voices *const v = ksound_test_voices(test, 3);
+
+    ksound_voices_set(v, 0, tables, MAKEWAVE(127, 0, 440), KSOUND_SHAPE_SINE);
+    ksound_voices_set(v, 1, tables, MAKEWAVE(0, 0, 440), KSOUND_SHAPE_SINE);
+    ksound_voices_set(v, 2, tables, MAKEWAVE(64, 90, 440), KSOUND_SHAPE_SINE);
+
+    KUNIT_EXPECT_EQ(test, v->gain[0], KSOUND_GAIN_ONE);
+    KUNIT_EXPECT_EQ(test, v->gain[1], 0);
+    KUNIT_EXPECT_EQ(test, v->gain[2], (64 * KSOUND_GAIN_ONE + 63) / 127);
+    KUNIT_EXPECT_EQ(test, v->phase[2], 1u << 30);
+}
+
+/*
+ * После смены частоты дискретизации полоса таблицы выбирается заново вместе
+ * с приращением, форма волны переживает перенос и обновление по частоте.
+ */
+static void ksound_test_retune(struct kunit *test) {
+    struct ksound_voices *const v = ksound_test_voices(test, 2);
+    int const rates[] = {8000, 22050, 192000, KSOUND_TEST_RATE};
+    int i;
+
+    ksound_voices_set(v, 0, tables, MAKEWAVE(127, 0, 3000), KSOUND_SHAPE_SAW);
+    ksound_voices_set(v, 1, tables, MAKEWAVE(127, 0, 3000),
+                      KSOUND_SHAPE_SQUARE);
+    v->count = 2;
+
+    for (i = 0; i < ARRAY_SIZE(rates); i++) {
+        ksound_voices_retune(v, rates[i]);
+        KUNIT_EXPECT_EQ(test, v->incr[0], ksound_phase_incr(3000, rates[i]));
+        KUNIT_EXPECT_PTR_EQ(
+            test, v->table[0],
+            ksound_table_for(tables, KSOUND_SHAPE_SAW, 3000, rates[i]));
+        KUNIT_EXPECT_PTR_EQ(
+            test, v->table[1],
+            ksound_table_for(tables, KSOUND_SHAPE_SQUARE, 3000, rates[i]));
+    }
+
+    // NOTE: на 8 кГц у 3 кГц пилы остаётся только основной тон
+    ksound_voices_retune(v, 8000);
+    KUNIT_EXPECT_PTR_EQ(test, v->table[0],
+                        tables->bands[KSOUND_SHAPE_SAW - 1][0]);
+
+    ksound_voices_copy(v, 0, v, 1);
+    ksound_voices_update_freq(v, tables, MAKEWAVE(50, 0, 3000));
+    ksound_voices_retune(v, KSOUND_TEST_RATE);
+    KUNIT_EXPECT_PTR_EQ(test, v->table[0],
+                        ksound_table_for(tables, KSOUND_SHAPE_SQUARE, 3000,
+                                         KSOUND_TEST_RATE));
+}
+
+static void ksound_test_pool_add_remove(struct kunit *test) {
+    struct ksound_pool *const pool = ksound_test_pool(test, 4);
+    struct ksound_voices *const v = ksound_test_voices(test, 4);
+    u32 const waves[2] = {MAKEWAVE(100, 0, 440), MAKEWAVE(100, 0, 880)};
+    u32 handles[2], again;
+
+    KUNIT_ASSERT_EQ(test, ksound_pool_add(pool, waves, 2, KSOUND_SHAPE_SINE,
+                                          false, handles),
+                    0);
+    KUNIT_EXPECT_NE(test, handles[0], 0u);
+    KUNIT_EXPECT_NE(test, handles[0], handles[1]);
+    KUNIT_EXPECT_TRUE(test, ksound_pool_pending(pool));
+
+    KUNIT_EXPECT_EQ(test, ksound_test_sync(pool, v), 2);
+    KUNIT_EXPECT_FALSE(test, ksound_pool_pending(pool));
+    KUNIT_ASSERT_EQ(test, v->count, 2);
+    KUNIT_EXPECT_GE(test, ksound_test_find(v, handles[0]), 0);
+    KUNIT_EXPECT_GE(test, ksound_test_find(v, handles[1]), 0);
+
+    // NOTE: без изменений рендер ничего не делает
+    KUNIT_EXPECT_EQ(test, ksound_test_sync(pool, v), 0);
+
+    KUNIT_EXPECT_EQ(test, ksound_pool_remove(pool, handles[0]), 0);
+    KUNIT_EXPECT_EQ(test, ksound_pool_remove(pool, handles[0]), -ENOENT);
+    KUNIT_EXPECT_EQ(test, ksound_pool_remove(pool, 0), -ENOENT);
+    ksound_test_sync(pool, v);
+    KUNIT_ASSERT_EQ(test, v->count, 1);
+    KUNIT_EXPECT_EQ(test, v->id[0], handles[1]);
+    KUNIT_EXPECT_EQ(test, v->wave[0], waves[1]);
+
+    // NOTE: слот удалённой волны занят новой, старый дескриптор её не видит
+    KUNIT_ASSERT_EQ(test, ksound_pool_add(pool, waves, 1, KSOUND_SHAPE_SINE,
+                                          false, &again),
+                    0);
+    KUNIT_EXPECT_NE(test, again, handles[0]);
+    KUNIT_EXPECT_EQ(test, ksound_pool_update(pool, handles[0], waves[1]),
+                    -ENOENT);
+    KUNIT_EXPECT_EQ(test, ksound_pool_remove(pool, handles[0]), -ENOENT);
+    ksound_test_sync(pool, v);
+    KUNIT_EXPECT_EQ(test, v->count, 2);
+}
+
+static void ksound_test_pool_full(struct kunit *test) {
+    struct ksound_pool *const pool = ksound_test_pool(test, 2);
+    struct ksound_voices *const v = ksound_test_voices(test, 2);
+    u32 const waves[3] = {MAKEWAVE(1, 0, 100), MAKEWAVE(1, 0, 200),
+                          MAKEWAVE(1, 0, 300)};
+
+    // NOTE: пакет не помещается целиком, пул не меняется
+    KUNIT_EXPECT_EQ(test, ksound_pool_add(pool, waves, 3, KSOUND_SHAPE_SINE,
+                                          false, NULL),
+                    -ENOSPC);
+    KUNIT_EXPECT_FALSE(test, ksound_pool_pending(pool));
+
+    KUNIT_EXPECT_EQ(test, ksound_pool_add(pool, waves, 2, KSOUND_SHAPE_SINE,
+                                          false, NULL),
+                    0);
+    KUNIT_EXPECT_EQ(test, ksound_pool_add(pool, waves + 2, 1,
+                                          KSOUND_SHAPE_SINE, false, NULL),
+                    -ENOSPC);
+
+    // NOTE: замена всего набора освобождает место до добавления
+    KUNIT_EXPECT_EQ(test, ksound_pool_add(pool, waves + 1, 2,
+                                          KSOUND_SHAPE_SINE, true, NULL),
+                    0);
+    ksound_test_sync(pool, v);
+    KUNIT_ASSERT_EQ(test, v->count, 2);
+    KUNIT_EXPECT_EQ(test, GETWAVEFREQ(v->wave[0]) + GETWAVEFREQ(v->wave[1]),
+                    500);
+}
+
+static void ksound_test_pool_freq(struct kunit *test) {
+    struct ksound_pool *const pool = ksound_test_pool(test, 8);
+    struct ksound_voices *const v = ksound_test_voices(test, 8);
+    u32 const waves[4] = {MAKEWAVE(10, 0, 440), MAKEWAVE(20, 0, 440),
+                          MAKEWAVE(30, 0, 660), MAKEWAVE(40, 0, 880)};
+    u32 const update = MAKEWAVE(99, 180, 660);
+    // NOTE: пакет не по порядку, с повтором частоты и частотой без волн
+    u32 const batch[4] = {MAKEWAVE(5, 0, 880), update, MAKEWAVE(77, 0, 880),
+                          MAKEWAVE(1, 0, 123)};
+    u32 handles[4];
+    int i;
+
+    KUNIT_ASSERT_EQ(test, ksound_pool_add(pool, waves, 4, KSOUND_SHAPE_SAW,
+                                          false, handles),
+                    0);
+    ksound_test_sync(pool, v);
+
+    // NOTE: фаза звучащей волны переживает обновление
+    i = ksound_test_find(v, handles[2]);
+    KUNIT_ASSERT_GE(test, i, 0);
+    v->phase[i] = 0x12345678;
+
+    KUNIT_EXPECT_EQ(test, ksound_pool_update_freq(pool, batch, 4), 2);
+    KUNIT_EXPECT_EQ(test, ksound_pool_remove_freq(pool, 440), 2);
+    KUNIT_EXPECT_EQ(test, ksound_pool_remove_freq(pool, 440), 0);
+    ksound_test_sync(pool, v);
+
+    KUNIT_ASSERT_EQ(test, v->count, 2);
+    KUNIT_EXPECT_LT(test, ksound_test_find(v, handles[0]), 0);
+    KUNIT_EXPECT_LT(test, ksound_test_find(v, handles[1]), 0);
+
+    i = ksound_test_find(v, handles[2]);
+    KUNIT_ASSERT_GE(test, i, 0);
+    KUNIT_EXPECT_EQ(test, v->wave[i], update);
+    KUNIT_EXPECT_EQ(test, v->phase[i], 0x12345678u);
+    KUNIT_EXPECT_EQ(test, v->gain[i], (99 * KSOUND_GAIN_ONE + 63) / 127);
+
+    // NOTE: при повторе частоты побеждает последняя волна пакета
+    i = ksound_test_find(v, handles[3]);
+    KUNIT_ASSERT_GE(test, i, 0);
+    KUNIT_EXPECT_EQ(test, v->wave[i], MAKEWAVE(77, 0, 880));
+
+    ksound_pool_clear(pool);
+    ksound_test_sync(pool, v);
+    KUNIT_EXPECT_EQ(test, v->count, 0);
+    KUNIT_EXPECT_EQ(test, ksound_pool_remove(pool, handles[3]), -ENOENT);
+}
+
+static void ksound_test_soft_clip(struct kunit *test) {
+    s32 x, prev = -32767;
+
+    // NOTE: ниже колена отсчёт не меняется
+    KUNIT_EXPECT_EQ(test, ksound_soft_clip(tables->clip, 0), 0);
+    KUNIT_EXPECT_EQ(test, ksound_soft_clip(tables->clip, KSOUND_CLIP_KNEE),
+                    KSOUND_CLIP_KNEE);
+    KUNIT_EXPECT_EQ(test, ksound_soft_clip(tables->clip, -KSOUND_CLIP_KNEE),
+                    -KSOUND_CLIP_KNEE);
+    KUNIT_EXPECT_EQ(test, ksound_soft_clip(tables->clip, 1 << 20), 32767);
+    KUNIT_EXPECT_EQ(test, ksound_soft_clip(tables->clip, -(1 << 20)), -32767);
+
+    // NOTE: кривая монотонная и без скачков, наклон не больше 1
+    for (x = -70000; x <= 70000; x++) {
+        s32 const y = ksound_soft_clip(tables->clip, x);
+
+        if (y < prev || y - prev > 1) {
+            KUNIT_FAIL(test, "soft clip jumps at %d: %d -> %d", x, prev, y);
+            return;
+        }
+        prev = y;
+    }
+}
+
+// NOTE: кадров в периоде рендера тестов
+#define KSOUND_TEST_FRAMES 256
+
+/*
+ * Рендерит KSOUND_TEST_FRAMES кадров набора v ядром kernel в новый буфер
+ * накопления.
+ */
+static s32 *ksound_test_render(struct kunit *test,
+                               struct ksound_render_kernel const *kernel,
+                               struct ksound_voices *v) {
+    s32 *const accum =
+        kunit_kcalloc(test, KSOUND_TEST_FRAMES, sizeof(s32), GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, accum);
+    ksound_render_run(kernel, accum, KSOUND_TEST_FRAMES, v);
+    return accum;
+}
+
+/*
+ * Наибольшая разница отсчётов a и b * num / den.
+ */
+static s32 ksound_test_max_diff(s32 const *a, s32 const *b, int num, int den) {
+    s32 diff = 0;
+    int i;
+
+    for (i = 0; i < KSOUND_TEST_FRAMES; i++) {
+        s32 const d = abs(a[i] - b[i] * num / den);
+
+        if (d > diff) diff = d;
+    }
+
+    return diff;
+}
+
+/*
+ * Банк гармоник звучит как сумма отдельных синусов с точностью до пары
+ * единиц младшего разряда, не пропускает гармоники выше rate / 2 и одинаков
+ * во всех ядрах рендера.
+ */
+static void ksound_test_bank(struct kunit *test) {
+    static u8 const fundamental[KSOUND_PARTIALS] = {127};
+    static u8 const second[KSOUND_PARTIALS] = {0, 127};
+    static u8 const aliased[KSOUND_PARTIALS] = {64, 64};
+    static u8 const organ[KSOUND_PARTIALS] = {127, 90, 0, 64, 0, 0, 0, 40,
+                                              0,   0,  0, 0,  0, 0, 0, 20};
+    struct ksound_voices *const v = ksound_test_voices(test, 4);
+    s32 *bank, *sine, *reference;
+    int k;
+
+    v->count = 1;
+
+    ksound_voices_set_bank(v, 0, tables, MAKEWAVE(127, 0, 440), fundamental);
+    KUNIT_EXPECT_EQ(test, v->harmonics[0], 1);
+    bank = ksound_test_render(test, NULL, v);
+    ksound_voices_set(v, 0, tables, MAKEWAVE(127, 0, 440), KSOUND_SHAPE_SINE);
+    KUNIT_EXPECT_EQ(test, v->harmonics[0], 0);
+    sine = ksound_test_render(test, NULL, v);
+    KUNIT_EXPECT_LE(test, ksound_test_max_diff(bank, sine, 1, 1), 2);
+
+    ksound_voices_set_bank(v, 0, tables, MAKEWAVE(127, 0, 440), second);
+    KUNIT_EXPECT_EQ(test, v->harmonics[0], 2);
+    bank = ksound_test_render(test, NULL, v);
+    ksound_voices_set(v, 0, tables, MAKEWAVE(127, 0, 880), KSOUND_SHAPE_SINE);
+    sine = ksound_test_render(test, NULL, v);
+    KUNIT_EXPECT_LE(test, ksound_test_max_diff(bank, sine, 1, 1), 2);
+
+    // NOTE: вторая гармоника 30 кГц не звучит, а нормировка по сумме всех
+    // амплитуд оставляет основному тону половину уровня
+    ksound_voices_set_bank(v, 0, tables, MAKEWAVE(127, 0, 15000), aliased);
+    bank = ksound_test_render(test, NULL, v);
+    ksound_voices_set_bank(v, 0, tables, MAKEWAVE(127, 0, 15000),
+                           fundamental);
+    reference = ksound_test_render(test, NULL, v);
+    KUNIT_EXPECT_LE(test, ksound_test_max_diff(bank, reference, 1, 2), 2);
+
+    // NOTE: банки вперемешку с обычными волнами
+    ksound_voices_set_bank(v, 0, tables, MAKEWAVE(100, 30, 110), organ);
+    ksound_voices_set(v, 1, tables, MAKEWAVE(60, 0, 1000), KSOUND_SHAPE_SAW);
+    ksound_voices_set_bank(v, 2, tables, MAKEWAVE(80, 90, 523), organ);
+    ksound_voices_set(v, 3, tables, MAKEWAVE(50, 0, 3000), KSOUND_SHAPE_SINE);
+    v->count = 4;
+
+    for (k = 0; k < ksound_render_kernel_count; k++) {
+        struct ksound_render_kernel const *const kernel =
+            &ksound_render_kernels[k];
+        u32 phases[4];
+
+        if (!kernel->supported()) continue;
+
+        memcpy(phases, v->phase, sizeof(phases));
+        bank = ksound_test_render(test, kernel, v);
+        memcpy(v->phase, phases, sizeof(phases));
+        reference = ksound_test_render(test, NULL, v);
+
+        KUNIT_EXPECT_MEMEQ_MSG(test, bank, reference,
+                               KSOUND_TEST_FRAMES * sizeof(s32), "kernel %s",
+                               kernel->name);
+    }
+}
+
+static void ksound_test_pool_bank(struct kunit *test) {
+    static u8 const organ[KSOUND_PARTIALS] = {127, 0, 64};
+    static u8 const flute[KSOUND_PARTIALS] = {127, 30};
+    struct ksound_pool *const pool = ksound_test_pool(test, 2);
+    struct ksound_voices *const v = ksound_test_voices(test, 2);
+    u32 handle;
+    int p;
+
+    KUNIT_ASSERT_EQ(test, ksound_pool_add_bank(pool, MAKEWAVE(100, 0, 220),
+                                               organ, &handle),
+                    0);
+    KUNIT_EXPECT_EQ(test, ksound_test_sync(pool, v), 1);
+    p = ksound_test_find(v, handle);
+    KUNIT_ASSERT_GE(test, p, 0);
+    KUNIT_EXPECT_EQ(test, v->harmonics[p], 3);
+    KUNIT_EXPECT_MEMEQ(test, v->partials + p * KSOUND_PARTIALS, organ,
+                       KSOUND_PARTIALS);
+
+    // NOTE: обновление волны меняет тон, но не гармоники
+    KUNIT_EXPECT_EQ(test, ksound_pool_update(pool, handle,
+                                             MAKEWAVE(50, 0, 330)),
+                    0);
+    ksound_test_sync(pool, v);
+    KUNIT_EXPECT_EQ(test, v->harmonics[p], 3);
+    KUNIT_EXPECT_EQ(test, GETWAVEFREQ(v->wave[p]), 330);
+
+    KUNIT_EXPECT_EQ(test, ksound_pool_update_bank(pool, handle,
+                                                  MAKEWAVE(50, 0, 330),
+                                                  flute),
+                    0);
+    ksound_test_sync(pool, v);
+    KUNIT_EXPECT_EQ(test, v->harmonics[p], 2);
+
+    KUNIT_EXPECT_EQ(test, ksound_pool_remove(pool, handle), 0);
+    ksound_test_sync(pool, v);
+    KUNIT_EXPECT_EQ(test, v->count, 0);
+    KUNIT_EXPECT_EQ(test, ksound_pool_update_bank(pool, handle,
+                                                  MAKEWAVE(50, 0, 330),
+                                                  flute),
+                    -ENOENT);
+}
+
+// NOTE: эталон снят со скалярного ядра: четыре формы волны, запас 2 (смесь
+// заходит в ограничение), два периода по 256 кадров S16_LE L+R. Любое
+// изменение арифметики синтеза должно обновлять эталон осознанно
+#define KSOUND_TEST_GOLDEN_HASH 0xbad7acb9u
+
+static u32 const golden_waves[4] = {
+    MAKEWAVE(127, 0, 440),
+    MAKEWAVE(64, 90, 1000),
+    MAKEWAVE(100, 180, 3000),
+    MAKEWAVE(90, 45, 250),
+};
+
+static s16 const golden_left[16] = {
+    9383,  -2311, 1506,  241,   3136,  1963,  4919,  2753,
+    16201, 29859, 27657, 30108, 29214, 31332, 29949, 32464,
+};
+
+/*
+ * FNV-1a, эталон короче самих буферов.
+ */
+static u32 ksound_test_hash(u32 hash, void const *data, size_t bytes) {
+    u8 const *p = data;
+
+    while (bytes--) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Рендерит эталонный набор ядром kernel и возвращает хеш двух периодов,
+ * левый канал первых кадров пишется в left.
+ */
+static u32 ksound_test_render_golden(struct kunit *test,
+                                     struct ksound_render_kernel const *kernel,
+                                     s16 *left) {
+    struct ksound_voices *const v = ksound_test_voices(test, 4);
+    struct ksound_master const master = {
+        .gain = KSOUND_MASTER_GAIN(2),
+        .clip = tables->clip,
+    };
+    s16 *const samples =
+        kunit_kcalloc(test, KSOUND_TEST_FRAMES * 2, sizeof(s16), GFP_KERNEL);
+    s32 *const accum =
+        kunit_kcalloc(test, KSOUND_TEST_FRAMES, sizeof(s32), GFP_KERNEL);
+    u32 hash = 2166136261u;
+    int i, period;
+
+    KUNIT_ASSERT_NOT_NULL(test, samples);
+    KUNIT_ASSERT_NOT_NULL(test, accum);
+
+    // NOTE: форма волны по номеру: синус, пила, меандр, треугольник
+    for (i = 0; i < 4; i++)
+        ksound_voices_set(v, i, tables, golden_waves[i], i);
+    v->count = 4;
+
+    for (period = 0; period < 2; period++) {
+        make_sine_waves(samples, accum, KSOUND_TEST_FRAMES, KSOUND_TEST_RATE,
+                        v, kernel, &master);
+        hash = ksound_test_hash(hash, samples,
+                                KSOUND_TEST_FRAMES * 2 * sizeof(s16));
+
+        if (period == 0)
+            for (i = 0; i < ARRAY_SIZE(golden_left); i++)
+                left[i] = samples[2 * i];
+    }
+
+    return hash;
+}
+
+static void ksound_test_golden(struct kunit *test) {
+    s16 left[ARRAY_SIZE(golden_left)];
+    u32 const hash = ksound_test_render_golden(test, NULL, left);
+
+    KUNIT_EXPECT_MEMEQ(test, left, golden_left, sizeof(golden_left));
+    KUNIT_EXPECT_EQ(test, hash, KSOUND_TEST_GOLDEN_HASH);
+}
+
+/*
+ * Каждое векторное ядро, доступное на этом процессоре, совпадает со
+ * скалярным до бита.
+ */
+static void ksound_test_kernels(struct kunit *test) {
+    int k;
+
+    for (k = 0; k < ksound_render_kernel_count; k++) {
+        struct ksound_render_kernel const *const kernel =
+            &ksound_render_kernels[k];
+        s16 left[ARRAY_SIZE(golden_left)];
+
+        if (!kernel->supported()) {
+            kunit_info(test, "kernel %s is not supported\n", kernel->name);
+            continue;
+        }
+
+        KUNIT_EXPECT_EQ_MSG(test, ksound_test_render_golden(test, kernel, left),
+                            KSOUND_TEST_GOLDEN_HASH, "kernel %s",
+                            kernel->name);
+    }
+}
+
+// NOTE: замеры на типичном периоде, 4096 волн скалярным ядром под UML слишком
+// близко к реальному времени чтобы быть стабильным тестом
+static int const perf_voices[] = {1, 64, 512};
+
+static void ksound_test_perf_desc(int const *voices, char *desc) {
+    snprintf(desc, KUNIT_PARAM_DESC_SIZE, "%d voices", *voices);
+}
+
+KUNIT_ARRAY_PARAM(ksound_test_perf, perf_voices, ksound_test_perf_desc);
+
+#define KSOUND_TEST_PERF_FRAMES 1024
+#define KSOUND_TEST_PERF_RUNS 16
+
+/*
+ * Рендер периода лучшим ядром (как в модуле) укладывается в бюджет. Берётся
+ * лучший из нескольких прогонов, чтобы вытеснение не роняло тест.
+ */
+static void ksound_test_perf(struct kunit *test) {
+    int const voices = *(int const *)test->param_value;
+    struct ksound_voices *const v = ksound_test_voices(test, voices);
+    struct ksound_render_kernel const *const kernel =
+        ksound_render_kernel_best();
+    struct ksound_master const master = {
+        .gain = KSOUND_MASTER_GAIN(voices),
+        .clip = tables->clip,
+    };
+    s16 *const samples = kunit_kcalloc(test, KSOUND_TEST_PERF_FRAMES * 2,
+                                       sizeof(s16), GFP_KERNEL);
+    s32 *const accum = kunit_kcalloc(test, KSOUND_TEST_PERF_FRAMES,
+                                     sizeof(s32), GFP_KERNEL);
+    u64 const budget =
+        (u64)KSOUND_TEST_PERF_FRAMES * (frame_ns + (u64)voice_ns * voices);
+    u64 best = U64_MAX;
+    int i;
+
+    KUNIT_ASSERT_NOT_NULL(test, samples);
+    KUNIT_ASSERT_NOT_NULL(test, accum);
+
+    for (i = 0; i < voices; i++)
+        ksound_voices_set(v, i, tables,
+                          MAKEWAVE(100, (i * 7) % 360, 110 + (i * 37) % 8000),
+                          i % KSOUND_SHAPE_COUNT);
+    v->count = voices;
+
+    for (i = 0; i < KSOUND_TEST_PERF_RUNS; i++) {
+        u64 const start = ktime_get_ns();
+
+        make_sine_waves(samples, accum, KSOUND_TEST_PERF_FRAMES,
+                        KSOUND_TEST_RATE, v, kernel, &master);
+        best = min(best, ktime_get_ns() - start);
+        cond_resched();
+    }
+
+    kunit_info(test, "%s %d voices: %llu ns per %d frames, budget %llu\n",
+               kernel ? kernel->name : "scalar", voices, best,
+               KSOUND_TEST_PERF_FRAMES, budget);
+    KUNIT_EXPECT_LE(test, best, budget);
+}
+
+static int ksound_test_suite_init(struct kunit_suite *suite) {
+    int err;
+
+    tables = kvzalloc(sizeof(*tables), GFP_KERNEL);
+    if (!tables) return -ENOMEM;
+
+    ksound_tables_init(tables);
+
+    err = ksound_pool_cache_create();
+    if (err) {
+        kvfree(tables);
+        tables = NULL;
+    }
+
+    return err;
+}
+
+static void ksound_test_suite_exit(struct kunit_suite *suite) {
+    ksound_pool_cache_destroy();
+    kvfree(tables);
+    tables = NULL;
+}
+
+static int ksound_test_init(struct kunit *test) {
+    test->priv = NULL;
+    return 0;
+}
+
+// NOTE: тест мог упасть на любой проверке, пул освобождается здесь
+static void ksound_test_exit(struct kunit *test) {
+    ksound_pool_destroy(test->priv);
+}
+
+static struct kunit_case ksound_test_cases[] = {
+    KUNIT_CASE(ksound_test_wave_macros),
+    KUNIT_CASE(ksound_test_voice_gain),
+    KUNIT_CASE(ksound_test_retune),
+    KUNIT_CASE(ksound_test_pool_add_remove),
+    KUNIT_CASE(ksound_test_pool_full),
+    KUNIT_CASE(ksound_test_pool_freq),
+    KUNIT_CASE(ksound_test_soft_clip),
+    KUNIT_CASE(ksound_test_golden),
+    KUNIT_CASE(ksound_test_kernels),
+    KUNIT_CASE(ksound_test_bank),
+    KUNIT_CASE(ksound_test_pool_bank),
+    {},
+};
+
+static struct kunit_suite ksound_test_suite = {
+    .name = "ksound",
+    .suite_init = ksound_test_suite_init,
+    .suite_exit = ksound_test_suite_exit,
+    .init = ksound_test_init,
+    .exit = ksound_test_exit,
+    .test_cases = ksound_test_cases,
+};
+
+// NOTE: замеры медленные, поэтому отдельным набором: фильтр 'ksound' их
+// пропускает
+static struct kunit_case ksound_perf_cases[] = {
+    KUNIT_CASE_PARAM(ksound_test_perf, ksound_test_perf_gen_params),
+    {},
+};
+
+static struct kunit_suite ksound_perf_suite = {
+    .name = "ksound_perf",
+    .suite_init = ksound_test_suite_init,
+    .suite_exit = ksound_test_suite_exit,
+    .test_cases = ksound_perf_cases,
+};
+
+kunit_test_suites(&ksound_test_suite, &ksound_perf_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("KUnit tests for the ksound synthesis and voice pool");
@@ -0,0 +1,5 @@
+/*
+ * Копия ksound_simd.c для модуля тестов ksound_kunit. Kbuild не собирает один
+ * объект в два модуля, поэтому у тестов свои объекты (см. Kbuild).
+ */
+#include "ksound_simd.c"
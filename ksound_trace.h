@@ -0,0 +1,115 @@
+/*
+ * Точки трассировки модуля, система ksound:
+ *
+ *   $ sudo perf record -e 'ksound:*' -a -- sleep 5
+ *   $ sudo sh -c 'echo 1 > /sys/kernel/tracing/events/ksound/enable'
+ *
+ * Подключается только из ksound_main.c, там же CREATE_TRACE_POINTS.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ksound
+
+#if !defined(KSOUND_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define KSOUND_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Начало рендера периода period (счёт от START), voices - волны ioctl и
+ * кольца.
+ */
+TRACE_EVENT(ksound_render_start,
+            TP_PROTO(int stream, unsigned long period, int voices),
+            TP_ARGS(stream, period, voices),
+            TP_STRUCT__entry(__field(int, stream)
+                                 __field(unsigned long, period)
+                                     __field(int, voices)),
+            TP_fast_assign(__entry->stream = stream; __entry->period = period;
+                           __entry->voices = voices;),
+            TP_printk("stream=%d period=%lu voices=%d", __entry->stream,
+                      __entry->period, __entry->voices));
+
+/*
+ * Конец рендера периода, ns - сколько он занял.
+ */
+TRACE_EVENT(ksound_render_end,
+            TP_PROTO(int stream, unsigned long period, int voices, u64 ns),
+            TP_ARGS(stream, period, voices, ns),
+            TP_STRUCT__entry(__field(int, stream)
+                                 __field(unsigned long, period)
+                                     __field(int, voices) __field(u64, ns)),
+            TP_fast_assign(__entry->stream = stream; __entry->period = period;
+                           __entry->voices = voices; __entry->ns = ns;),
+            TP_printk("stream=%d period=%lu voices=%d ns=%llu",
+                      __entry->stream, __entry->period, __entry->voices,
+                      __entry->ns));
+
+/*
+ * Тик таймера захвата, late_ns - насколько он позже заказанного момента.
+ */
+TRACE_EVENT(ksound_timer,
+            TP_PROTO(int stream, unsigned long hw_period, s64 late_ns,
+                     bool idle),
+            TP_ARGS(stream, hw_period, late_ns, idle),
+            TP_STRUCT__entry(__field(int, stream)
+                                 __field(unsigned long, hw_period)
+                                     __field(s64, late_ns) __field(bool, idle)),
+            TP_fast_assign(__entry->stream = stream;
+                           __entry->hw_period = hw_period;
+                           __entry->late_ns = late_ns; __entry->idle = idle;),
+            TP_printk("stream=%d hw_period=%lu late_ns=%lld idle=%d",
+                      __entry->stream, __entry->hw_period, __entry->late_ns,
+                      __entry->idle));
+
+/*
+ * Команда ioctl выполнена за ns, ret - её результат.
+ */
+TRACE_EVENT(ksound_ioctl,
+            TP_PROTO(int stream, unsigned int nr, u64 ns, long ret),
+            TP_ARGS(stream, nr, ns, ret),
+            TP_STRUCT__entry(__field(int, stream) __field(unsigned int, nr)
+                                 __field(u64, ns) __field(long, ret)),
+            TP_fast_assign(__entry->stream = stream; __entry->nr = nr;
+                           __entry->ns = ns; __entry->ret = ret;),
+            TP_printk("stream=%d nr=%u ns=%llu ret=%ld", __entry->stream,
+                      __entry->nr, __entry->ns, __entry->ret));
+
+/*
+ * Рендер перенёс changes изменений пула одной сессии волн ioctl, самое старое
+ * из них ждало ns. voices - волн сессии после переноса.
+ */
+TRACE_EVENT(ksound_set_apply,
+            TP_PROTO(int stream, int changes, int voices, u64 ns),
+            TP_ARGS(stream, changes, voices, ns),
+            TP_STRUCT__entry(__field(int, stream) __field(int, changes)
+                                 __field(int, voices) __field(u64, ns)),
+            TP_fast_assign(__entry->stream = stream;
+                           __entry->changes = changes;
+                           __entry->voices = voices; __entry->ns = ns;),
+            TP_printk("stream=%d changes=%d voices=%d ns=%llu",
+                      __entry->stream, __entry->changes, __entry->voices,
+                      __entry->ns));
+
+/*
+ * Подстройка сменила глубину render_ahead потока, slack_ns - запас рендера
+ * который к этому привёл.
+ */
+TRACE_EVENT(ksound_render_ahead,
+            TP_PROTO(int stream, int depth, s64 slack_ns),
+            TP_ARGS(stream, depth, slack_ns),
+            TP_STRUCT__entry(__field(int, stream) __field(int, depth)
+                                 __field(s64, slack_ns)),
+            TP_fast_assign(__entry->stream = stream; __entry->depth = depth;
+                           __entry->slack_ns = slack_ns;),
+            TP_printk("stream=%d depth=%d slack_ns=%lld", __entry->stream,
+                      __entry->depth, __entry->slack_ns));
+
+#endif  // KSOUND_TRACE_H
+
+// NOTE: define_trace.h ищет этот файл по TRACE_INCLUDE_PATH, путь к нему
+// добавлен в Kbuild (-I$(src))
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ksound_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,369 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include "ksound_workers.h"
+
+#include <linux/atomic.h>
+#include <linux/err.h>
+#include <linux/kthread.h>  // kthread_create, kthread_bind, ...
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>     // kvmalloc_array, kvfree, ...
+#include <linux/sched.h>  // sched_set_fifo, ...
+#include <linux/slab.h>
+#include <linux/smp.h>    // get_cpu, put_cpu, ...
+#include <linux/string.h>  // memcpy, memset, ...
+#include <linux/sysfs.h>  // sysfs_emit_at, ...
+#include <linux/wait.h>
+
+// NOTE: помощник не успевший к сроку ждётся не дольше окна самого рендера,
+// но не меньше задержки пробуждения потока реального времени
+#define KSOUND_WORKERS_WAIT_MIN_NS (50 * NSEC_PER_USEC)
+
+/*
+ * Состояние помощника. Задание даёт рендер (IDLE -> QUEUED), помощник берёт
+ * его (QUEUED -> RUNNING) и отдаёт (RUNNING -> DONE). Не дождавшись срока,
+ * рендер отбирает окно: QUEUED -> IDLE или RUNNING -> DROPPED, тогда помощник
+ * досчитывает в свой буфер и сам становится IDLE.
+ */
+enum {
+    KSOUND_WORKER_IDLE,
+    KSOUND_WORKER_QUEUED,
+    KSOUND_WORKER_RUNNING,
+    KSOUND_WORKER_DONE,
+    KSOUND_WORKER_DROPPED,
+};
+
+/*
+ * Помощник на одном процессоре. Задание пишет только рендер и только пока
+ * помощник IDLE. Помощник считает фазы окна в своей копии, в набор их
+ * переносит рендер, когда забирает готовое окно, поэтому отобранное окно
+ * помощник уже не испортит.
+ */
+struct ksound_worker {
+    struct ksound_workers *pool;
+    struct task_struct *task;
+    int cpu;
+    s32 *accum;  // частичная сумма окна, max_frames кадров
+    u32 *phase;  // фазы окна, max_voices волн
+    wait_queue_head_t wq;
+    atomic_t state;  // KSOUND_WORKER_*
+
+    // NOTE: задание
+    struct ksound_voices window;  // окно в наборе рендера
+    struct ksound_voices slice;   // то же окно с фазами phase
+    size_t frame_count;
+    struct ksound_render_kernel const *kernel;
+    bool active;  // участвует в текущем раунде, пишет рендер
+
+    // NOTE: время рендера окна, пишет только помощник
+    u64 jobs;
+    u64 busy_ns;
+    u64 max_ns;
+    u64 dropped;  // окон отобранных рендером, пишет только рендер
+};
+
+struct ksound_workers {
+    int count;
+    size_t max_frames;
+    int max_voices;
+    atomic_t busy;  // пул занят рендером одного из потоков
+    wait_queue_head_t idle_wq;  // помощник досчитал отобранное окно
+
+    // NOTE: сколько рендер ждал помощников после своего окна и сколько окон
+    // посчитал сам после срока, пишет только владелец busy
+    u64 rounds;
+    u64 wait_ns;
+    u64 max_wait_ns;
+    u64 fallbacks;
+
+    struct ksound_worker workers[];
+};
+
+static int ksound_worker_thread(void *data) {
+    struct ksound_worker *const w = data;
+
+    while (!kthread_should_stop()) {
+        u64 start, ns;
+
+        wait_event_interruptible(
+            w->wq, kthread_should_stop() ||
+                       atomic_read(&w->state) == KSOUND_WORKER_QUEUED);
+
+        // NOTE: окно могли отобрать пока помощник просыпался
+        if (atomic_cmpxchg(&w->state, KSOUND_WORKER_QUEUED,
+                           KSOUND_WORKER_RUNNING) != KSOUND_WORKER_QUEUED)
+            continue;
+
+        start = ktime_get_ns();
+        memset(w->accum, 0, w->frame_count * sizeof(*w->accum));
+        ksound_render_run(w->kernel, w->accum, w->frame_count, &w->slice);
+        ns = ktime_get_ns() - start;
+
+        w->jobs++;
+        w->busy_ns += ns;
+        if (ns > w->max_ns) w->max_ns = ns;
+
+        // NOTE: частичная сумма и фазы окна видны рендеру раньше чем DONE.
+        // Отобранное окно рендер уже посчитал сам, результат не нужен
+        if (atomic_cmpxchg(&w->state, KSOUND_WORKER_RUNNING,
+                           KSOUND_WORKER_DONE) != KSOUND_WORKER_RUNNING) {
+            atomic_set_release(&w->state, KSOUND_WORKER_IDLE);
+            wake_up(&w->pool->idle_wq);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Отбирает у помощника окно которое он не посчитал. Возвращает false если
+ * помощник успел и окно готово.
+ */
+static bool ksound_worker_cancel(struct ksound_worker *w) {
+    if (atomic_cmpxchg(&w->state, KSOUND_WORKER_QUEUED, KSOUND_WORKER_IDLE) ==
+        KSOUND_WORKER_QUEUED)
+        return true;
+
+    if (atomic_cmpxchg(&w->state, KSOUND_WORKER_RUNNING,
+                       KSOUND_WORKER_DROPPED) == KSOUND_WORKER_RUNNING)
+        return true;
+
+    // NOTE: помощник успел между проверками, его записи видны после барьера
+    smp_rmb();
+    return false;
+}
+
+struct ksound_workers *ksound_workers_create(struct cpumask const *cpus,
+                                             size_t max_frames,
+                                             int max_voices) {
+    struct ksound_workers *pool;
+    int cpu, err;
+
+    pool = kzalloc(struct_size(pool, workers, cpumask_weight(cpus)),
+                   GFP_KERNEL);
+    if (!pool) return ERR_PTR(-ENOMEM);
+
+    pool->max_frames = max_frames;
+    pool->max_voices = max_voices;
+    atomic_set(&pool->busy, 0);
+    init_waitqueue_head(&pool->idle_wq);
+
+    for_each_cpu(cpu, cpus) {
+        // NOTE: count растёт сразу, ksound_workers_destroy освободит и
+        // недостроенного помощника
+        struct ksound_worker *const w = &pool->workers[pool->count++];
+
+        w->pool = pool;
+        w->cpu = cpu;
+        init_waitqueue_head(&w->wq);
+        atomic_set(&w->state, KSOUND_WORKER_IDLE);
+
+        w->accum = kvmalloc_array(max_frames, sizeof(s32), GFP_KERNEL);
+        w->phase = kvmalloc_array(max_voices, sizeof(u32), GFP_KERNEL);
+        if (!w->accum || !w->phase) {
+            pr_info("failed to allocate worker buffer for cpu %d\n", cpu);
+            err = -ENOMEM;
+            goto __error;
+        }
+
+        w->task = kthread_create(ksound_worker_thread, w, "ksound_worker/%d",
+                                 cpu);
+        if (IS_ERR(w->task)) {
+            pr_info("failed to create worker thread for cpu %d\n", cpu);
+            err = PTR_ERR(w->task);
+            w->task = NULL;
+            goto __error;
+        }
+
+        kthread_bind(w->task, cpu);
+
+        // NOTE: помощник должен успеть за тот же период что и рендер
+        sched_set_fifo(w->task);
+        wake_up_process(w->task);
+    }
+
+    return pool;
+
+__error:
+    ksound_workers_destroy(pool);
+    return ERR_PTR(err);
+}
+
+void ksound_workers_destroy(struct ksound_workers *pool) {
+    int i;
+
+    if (!pool) return;
+
+    for (i = 0; i < pool->count; i++) {
+        struct ksound_worker *const w = &pool->workers[i];
+
+        if (w->task) kthread_stop(w->task);
+        kvfree(w->phase);
+        kvfree(w->accum);
+    }
+
+    kfree(pool);
+}
+
+void ksound_workers_quiesce(struct ksound_workers *pool) {
+    int i;
+
+    if (!pool) return;
+
+    // NOTE: после возврата ksound_workers_render окна набора держат только
+    // помощники в DROPPED, новое окно они получат уже из другого набора
+    for (i = 0; i < pool->count; i++) {
+        struct ksound_worker const *const w = &pool->workers[i];
+
+        wait_event(pool->idle_wq,
+                   atomic_read_acquire(&w->state) != KSOUND_WORKER_DROPPED);
+    }
+}
+
+int ksound_workers_render(struct ksound_workers *pool, s32 *accum,
+                          size_t frame_count, struct ksound_voices *v,
+                          struct ksound_render_kernel const *kernel) {
+    struct ksound_voices own;
+    int helpers = 0, parts, share, extra, start = 0;
+    int cpu, i;
+    u64 own_start, deadline, wait_start, wait_ns;
+
+    if (!pool || frame_count > pool->max_frames) return 0;
+
+    // NOTE: пул один на все потоки, второй поток рендерит сам
+    if (atomic_cmpxchg(&pool->busy, 0, 1) != 0) return 0;
+
+    // NOTE: помощник на процессоре рендера не получит время пока рендер его
+    // ждёт, поэтому свой процессор всегда пропускается. Помощник ещё не
+    // досчитавший отобранное окно тоже
+    cpu = get_cpu();
+    for (i = 0; i < pool->count; i++) {
+        struct ksound_worker *const w = &pool->workers[i];
+
+        w->active = w->cpu != cpu && cpu_online(w->cpu) &&
+                    atomic_read_acquire(&w->state) == KSOUND_WORKER_IDLE;
+        helpers += w->active;
+    }
+
+    parts = min(helpers + 1, v->count);
+    if (parts < 2) {
+        put_cpu();
+        atomic_set_release(&pool->busy, 0);
+        return 0;
+    }
+
+    // NOTE: окна почти равные, остаток по одной волне в первые окна
+    share = v->count / parts;
+    extra = v->count % parts;
+
+    for (i = 0; i < pool->count; i++) {
+        struct ksound_worker *const w = &pool->workers[i];
+        int len;
+
+        if (!w->active) continue;
+
+        // NOTE: помощников больше чем волн, лишние пропускают раунд. Последнее
+        // окно всегда остаётся рендеру
+        if (parts == 1) {
+            w->active = false;
+            continue;
+        }
+
+        parts--;
+        len = share + (extra > 0);
+        if (extra > 0) extra--;
+
+        ksound_voices_slice(&w->window, v, start, len);
+        w->slice = w->window;
+        w->slice.phase = w->phase;
+        memcpy(w->phase, w->window.phase, len * sizeof(*w->phase));
+        w->frame_count = frame_count;
+        w->kernel = kernel;
+        start += len;
+
+        atomic_set_release(&w->state, KSOUND_WORKER_QUEUED);
+        wake_up(&w->wq);
+    }
+
+    // NOTE: пока помощники работают, рендер считает последнее окно сам
+    own_start = ktime_get_ns();
+    ksound_voices_slice(&own, v, start, v->count - start);
+    ksound_render_run(kernel, accum, frame_count, &own);
+
+    // NOTE: помощник может не ответить вовсе: его вытеснила задача с большим
+    // приоритетом, его троттлит планировщик или его процессор ушёл в
+    // offline. Поэтому ждём не дольше своего окна, дальше его окно считается
+    // здесь
+    wait_start = ktime_get_ns();
+    deadline = wait_start + max_t(u64, wait_start - own_start,
+                                  KSOUND_WORKERS_WAIT_MIN_NS);
+    do {
+        bool ready = true;
+
+        for (i = 0; i < pool->count; i++) {
+            struct ksound_worker const *const w = &pool->workers[i];
+
+            if (w->active &&
+                atomic_read_acquire(&w->state) != KSOUND_WORKER_DONE) {
+                ready = false;
+                break;
+            }
+        }
+        if (ready) break;
+
+        cpu_relax();
+    } while (ktime_get_ns() < deadline);
+    wait_ns = ktime_get_ns() - wait_start;
+
+    for (i = 0; i < pool->count; i++) {
+        struct ksound_worker *const w = &pool->workers[i];
+
+        if (!w->active) continue;
+
+        if (atomic_read_acquire(&w->state) != KSOUND_WORKER_DONE &&
+            ksound_worker_cancel(w)) {
+            // NOTE: фазы окна в наборе не тронуты, помощник считал в копии
+            ksound_render_run(kernel, accum, frame_count, &w->window);
+            w->dropped++;
+            pool->fallbacks++;
+            continue;
+        }
+
+        ksound_accum_add(accum, w->accum, frame_count);
+        memcpy(w->window.phase, w->phase,
+               w->window.count * sizeof(*w->phase));
+        atomic_set(&w->state, KSOUND_WORKER_IDLE);
+    }
+
+    pool->rounds++;
+    pool->wait_ns += wait_ns;
+    if (wait_ns > pool->max_wait_ns) pool->max_wait_ns = wait_ns;
+
+    put_cpu();
+    atomic_set_release(&pool->busy, 0);
+    return 1;
+}
+
+int ksound_workers_stats(struct ksound_workers *pool, char *buffer) {
+    int len = 0, i;
+
+    if (!pool) return sysfs_emit(buffer, "disabled\n");
+
+    len += sysfs_emit_at(
+        buffer, len,
+        "render rounds %llu wait_avg_ns %llu wait_max_ns %llu fallbacks %llu\n",
+        pool->rounds, pool->rounds ? div64_u64(pool->wait_ns, pool->rounds) : 0,
+        pool->max_wait_ns, pool->fallbacks);
+
+    for (i = 0; i < pool->count; i++) {
+        struct ksound_worker const *const w = &pool->workers[i];
+
+        len += sysfs_emit_at(
+            buffer, len,
+            "cpu%d jobs %llu avg_ns %llu max_ns %llu dropped %llu\n", w->cpu,
+            w->jobs, w->jobs ? div64_u64(w->busy_ns, w->jobs) : 0, w->max_ns,
+            w->dropped);
+    }
+
+    return len;
+}
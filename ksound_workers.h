@@ -0,0 +1,56 @@
+#ifndef KSOUND_WORKERS_H
+#define KSOUND_WORKERS_H
+
+/*
+ * Параллельный рендер больших наборов волн. На каждом процессоре из заданного
+ * списка живёт поток реального времени со своим буфером накопления. Рендер
+ * делит набор на окна (ksound_voices_slice), одно оставляет себе, остальные
+ * раздаёт потокам и складывает их частичные суммы в свой буфер. Только для
+ * модуля ядра.
+ */
+
+#include <linux/cpumask.h>
+#include <linux/types.h>
+
+#include "ksound_render.h"  // ksound_voices, ksound_render_kernel, ...
+
+struct ksound_workers;
+
+/*
+ * Создаёт по потоку на каждый процессор из cpus, буферы на max_frames кадров
+ * и окна до max_voices волн. Возвращает ERR_PTR при ошибке.
+ */
+struct ksound_workers *ksound_workers_create(struct cpumask const *cpus,
+                                             size_t max_frames,
+                                             int max_voices);
+
+/*
+ * Останавливает потоки и освобождает пул. NULL допустим.
+ */
+void ksound_workers_destroy(struct ksound_workers *pool);
+
+/*
+ * Добавляет все волны v в accum силами пула, приращения v уже пересчитаны.
+ * Возвращает 0 если пул занят рендером другого потока или помощников нет,
+ * тогда рендерить должен вызывающий. Зовётся из softirq или потока, но не из
+ * hardirq. Помощников ждёт активно и не дольше чем считал своё окно, окна
+ * не готовые к сроку досчитывает сам.
+ */
+int ksound_workers_render(struct ksound_workers *pool, s32 *accum,
+                          size_t frame_count, struct ksound_voices *v,
+                          struct ksound_render_kernel const *kernel);
+
+/*
+ * Ждёт помощников, которые ещё досчитывают отобранные рендером окна: окно
+ * читает массивы набора, кроме фаз. Набор, который рендер больше не увидит,
+ * освобождается только после этого. Может спать. NULL допустим.
+ */
+void ksound_workers_quiesce(struct ksound_workers *pool);
+
+/*
+ * Пишет в buffer (размер PAGE_SIZE, как у sysfs) время работы каждого
+ * помощника. Возвращает количество записанных байт.
+ */
+int ksound_workers_stats(struct ksound_workers *pool, char *buffer);
+
+#endif  // KSOUND_WORKERS_H
@@ -1,18 +1,18 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-// NOTE:
-// https://embetronicx.com/tutorials/linux/device-drivers/ioctl-tutorial-in-linux/
-#define MYDEVMAGIC 's'
-#define CMDADDWAVE _IOW(MYDEVMAGIC, 0, uint32_t)
-#define CMDREMOVEWAVE _IOW(MYDEVMAGIC, 1, uint32_t)
+#include "ksound_ioctl.h"  // CMDADDWAVE, ksound_wave_batch, ...
 
 // NOTE: амплитуда 7 бит, фаза 9 бит, частота 16 бит
 #define MAKEWAVE(amp, phase, freq) \
@@ -36,14 +36,718 @@
         }                                                             \
     } while (0)
 
+/*
+ * Статистика команд ioctl: задержка каждого вызова и ошибки по кодам. Виды
+ * команд для нагрузки, всё остальное считается в OP_OTHER.
+ */
+enum op_kind { OP_ADD, OP_REMOVE, OP_UPDATE, OP_OTHER, OP_COUNT };
+
+static char const *const op_names[OP_COUNT] = {"add", "remove", "update",
+                                               "other"};
+
+// NOTE: коды ошибок больше этого считаются вместе в последнем
+#define MAX_ERRNO 256
+
+struct op_stats {
+    uint64_t *ns;  // задержки вызовов, растёт по мере надобности
+    size_t count, capacity;
+    uint64_t errors;
+};
+
+struct stats {
+    struct op_stats op[OP_COUNT];
+    uint64_t codes[MAX_ERRNO];
+    uint64_t late;  // нагрузка отстала от расписания больше чем на интервал
+    uint64_t parse_errors;  // команды сценария которые не удалось разобрать
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void stats_add(struct stats *st, int kind, uint64_t ns, int code) {
+    struct op_stats *const op = &st->op[kind];
+
+    if (op->count == op->capacity) {
+        size_t const capacity = op->capacity ? op->capacity * 2 : 4096;
+        uint64_t *const ns = realloc(op->ns, capacity * sizeof(*ns));
+
+        // NOTE: без памяти задержка теряется, а ошибка всё равно считается
+        if (ns) {
+            op->ns = ns;
+            op->capacity = capacity;
+        }
+    }
+
+    if (op->count < op->capacity) op->ns[op->count++] = ns;
+
+    if (code) {
+        op->errors++;
+        st->codes[code < MAX_ERRNO ? code : MAX_ERRNO - 1]++;
+    }
+}
+
+/*
+ * Вызывает ioctl и записывает его задержку в st. Возвращает код ошибки из errno
+ * или 0, старые CMDADDWAVE и CMDREMOVEWAVE возвращают код ошибки сами.
+ */
+static int timed_ioctl(struct stats *st, int kind, int fd, unsigned long cmd,
+                       void *arg) {
+    uint64_t const start = now_ns();
+    int ret = ioctl(fd, cmd, arg);
+    uint64_t const ns = now_ns() - start;
+
+    if (ret < 0) ret = errno;
+    stats_add(st, kind, ns, ret);
+    return ret;
+}
+
+/*
+ * Переносит статистику src в dst, src после этого пустая.
+ */
+static void stats_merge(struct stats *dst, struct stats *src) {
+    int k, i;
+
+    for (k = 0; k < OP_COUNT; k++) {
+        struct op_stats *const s = &src->op[k];
+        struct op_stats *const d = &dst->op[k];
+        size_t j;
+
+        for (j = 0; j < s->count; j++) stats_add(dst, k, s->ns[j], 0);
+        d->errors += s->errors;
+
+        free(s->ns);
+        memset(s, 0, sizeof(*s));
+    }
+
+    for (i = 0; i < MAX_ERRNO; i++) dst->codes[i] += src->codes[i];
+    dst->late += src->late;
+    dst->parse_errors += src->parse_errors;
+}
+
+static int compare_u64(void const *a, void const *b) {
+    uint64_t const x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Значение процентиля p (0..1) в отсортированном массиве.
+ */
+static uint64_t percentile(uint64_t const *sorted, size_t count, double p) {
+    size_t i = (size_t)(p * count);
+
+    if (count == 0) return 0;
+    return sorted[i < count ? i : count - 1];
+}
+
+static void print_row(char const *name, uint64_t *ns, size_t count,
+                      uint64_t errors) {
+    qsort(ns, count, sizeof(*ns), compare_u64);
+    printf("%-8s %10zu %8llu %10llu %10llu %10llu %10llu\n", name, count,
+           (unsigned long long)errors,
+           (unsigned long long)percentile(ns, count, 0.5),
+           (unsigned long long)percentile(ns, count, 0.99),
+           (unsigned long long)percentile(ns, count, 0.999),
+           (unsigned long long)(count ? ns[count - 1] : 0));
+}
+
+/*
+ * Печатает таблицу задержек по видам команд и итог, seconds - время замера
+ * для пропускной способности.
+ */
+static void stats_print(struct stats *st, double seconds) {
+    struct op_stats all = {0};
+    int k, i;
+
+    printf("%-8s %10s %8s %10s %10s %10s %10s\n", "op", "count", "errors",
+           "p50_ns", "p99_ns", "p999_ns", "max_ns");
+
+    for (k = 0; k < OP_COUNT; k++) {
+        struct op_stats *const op = &st->op[k];
+
+        if (op->count == 0 && op->errors == 0) continue;
+
+        all.ns = realloc(all.ns, (all.count + op->count) * sizeof(*all.ns));
+        if (all.ns && op->count) {
+            memcpy(all.ns + all.count, op->ns, op->count * sizeof(*op->ns));
+            all.count += op->count;
+        }
+        all.errors += op->errors;
+
+        print_row(op_names[k], op->ns, op->count, op->errors);
+    }
+
+    print_row("all", all.ns, all.count, all.errors);
+    if (seconds > 0)
+        printf("throughput %.0f ops/s in %.2f s\n", all.count / seconds,
+               seconds);
+    if (st->late) printf("late %llu ops\n", (unsigned long long)st->late);
+    if (st->parse_errors)
+        printf("parse errors %llu\n", (unsigned long long)st->parse_errors);
+
+    for (i = 1; i < MAX_ERRNO; i++)
+        if (st->codes[i])
+            printf("error %d (%s) %llu\n", i, strerror(i),
+                   (unsigned long long)st->codes[i]);
+
+    free(all.ns);
+}
+
+/*
+ * Отправляет пакет из count волн с частотами freq, freq + step, ... одной
+ * командой cmd (CMDADDWAVES, CMDSETWAVES или CMDUPDATEWAVES).
+ */
+static int send_batch(struct stats *st, int fd, unsigned long cmd, int count,
+                      int amp, int phase, int freq, int step) {
+    struct ksound_wave_batch batch = {0};
+    uint32_t *waves;
+    int i, err;
+
+    if (count <= 0) return 0;
+
+    waves = calloc(count, sizeof(*waves));
+    if (!waves) return -1;
+
+    for (i = 0; i < count; i++)
+        waves[i] = MAKEWAVE(amp, phase, freq + i * step);
+
+    batch.count = count;
+    batch.waves = (uintptr_t)waves;
+    err = timed_ioctl(st, cmd == CMDUPDATEWAVES ? OP_UPDATE : OP_ADD, fd, cmd,
+                      &batch);
+
+    free(waves);
+    return err;
+}
+
+/*
+ * Кладёт count команд ADD в кольцо команд. Волна i звучит с кадра frame + i *
+ * gap в течение duration кадров (frame = 0 - сразу, duration = 0 - пока не
+ * удалят). Если места нет, ждёт пока рендер разберёт кольцо (раз за период).
+ * Возвращает количество записанных команд.
+ */
+static int push_ring(struct ksound_ring *ring, int count, int amp, int phase,
+                     int freq, int step, uint64_t frame, int gap,
+                     int duration) {
+    uint32_t head = ring->head;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        struct ksound_ring_cmd *cmd;
+
+        // NOTE: кольцо полно, рендер потока захвата не запущен?
+        while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+               KSOUND_RING_SIZE)
+            usleep(1000);
+
+        cmd = &ring->cmds[head & (KSOUND_RING_SIZE - 1)];
+        memset(cmd, 0, sizeof(*cmd));
+        cmd->op = KSOUND_RING_ADD;
+        cmd->wave = MAKEWAVE(amp, phase, freq + i * step);
+        cmd->frame = frame ? frame + (uint64_t)i * gap : 0;
+        cmd->duration = duration;
+
+        // NOTE: команда видна рендеру только после публикации head
+        __atomic_store_n(&ring->head, ++head, __ATOMIC_RELEASE);
+    }
+
+    return i;
+}
+
+/*
+ * Отображает кольцо команд устройства, NULL если не получилось.
+ */
+static struct ksound_ring *map_ring(int fd) {
+    struct ksound_ring *const ring = mmap(
+        NULL, sizeof(*ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (ring == MAP_FAILED) {
+        printf("failed to map command ring\n");
+        return NULL;
+    }
+
+    return ring;
+}
+
+/*
+ * Открытый файл устройства и всё что к нему относится.
+ */
+struct client {
+    int fd;
+    struct ksound_ring *ring;
+    struct stats stats;
+};
+
+/*
+ * Печатает ошибку команды если она была.
+ */
+static void report(char cmd, int err) {
+    if (err) fprintf(stderr, "cmd=\"%c\" failed: %s\n", cmd, strerror(err));
+}
+
+/*
+ * Считает и печатает ошибку разбора команды cmd в строке line.
+ */
+static void parse_error(struct stats *st, int line, char cmd) {
+    fprintf(stderr, "line %d: bad command or arguments cmd=\"%c\"\n", line,
+            cmd);
+    st->parse_errors++;
+}
+
+/*
+ * Выполняет команды из in пока они не кончатся или не придёт q.
+ * interactive - печатать приглашение и разбор каждой команды, иначе in -
+ * сценарий: команды молча, # - комментарий до конца строки, w мс - пауза.
+ * Команда с неверными аргументами считается в st->parse_errors, остаток её
+ * строки пропускается.
+ */
+static void run_commands(struct client *c, FILE *in, int interactive) {
+    struct stats *const st = &c->stats;
+    int const fd = c->fd;
+    char *line = NULL;
+    size_t size = 0;
+    int line_no = 0;
+    int loop = 1;
+
+    // NOTE: разбор команды печатается только в интерактивном режиме
+#define echo(...) \
+    if (interactive) printf(__VA_ARGS__)
+
+    // NOTE: разбирает ровно count аргументов команды и сдвигает p за них,
+    // иначе ошибка и переход к следующей строке
+#define parse(count, format, ...)                                  \
+    if (sscanf(p, format "%n", __VA_ARGS__, &n) != (count)) {      \
+        parse_error(st, line_no, cmd);                             \
+        break;                                                     \
+    }                                                              \
+    p += n
+
+    while (loop) {
+        char const *p;
+        char cmd;
+        int n;
+
+        if (interactive)
+            printf("input command (a, h, o, r, x, b, s, u, c, p, n, i, q): ");
+        if (getline(&line, &size, in) < 0) break;
+        line_no++;
+
+        // NOTE: в строке может быть несколько команд подряд, пробел в
+        // формате пропускает все не печатные символы перед командой
+        for (p = line; loop && sscanf(p, " %c%n", &cmd, &n) == 1;) {
+            p += n;
+
+            if (cmd == 'a') {
+                int amp, phase, freq;
+                uint32_t wave;
+
+                parse(3, "%d %d %d", &amp, &phase, &freq);
+                echo("cmd=\"%c\", amp=%d, phase=%d, freq=%d\n", cmd, amp,
+                     phase, freq);
+
+                wave = MAKEWAVE(amp, phase, freq);
+                report(cmd, timed_ioctl(st, OP_ADD, fd, CMDADDWAVE, &wave));
+
+                expect(GETWAVEAMP(wave) == amp);
+                expect(GETWAVEPHASE(wave) == phase);
+                expect(GETWAVEFREQ(wave) == freq);
+            } else if (cmd == 'h') {
+                // NOTE: как a, но ядро возвращает дескриптор волны для x
+                struct ksound_voice_req req;
+                int amp, phase, freq, err;
+
+                parse(3, "%d %d %d", &amp, &phase, &freq);
+                req.wave = MAKEWAVE(amp, phase, freq);
+                req.handle = 0;
+
+                err = timed_ioctl(st, OP_ADD, fd, CMDADDVOICE, &req);
+                report(cmd, err);
+                if (!err)
+                    printf(
+                        "cmd=\"%c\", amp=%d, phase=%d, freq=%d, "
+                        "handle=0x%x\n",
+                        cmd, amp, phase, freq, req.handle);
+            } else if (cmd == 'o') {
+                // NOTE: банк гармоник: основной тон, затем count амплитуд
+                // гармоник 1, 2, ... Удаляется по дескриптору командой x
+                struct ksound_bank_req req = {0};
+                int amp, phase, freq, count, i, err;
+
+                parse(4, "%d %d %d %d", &amp, &phase, &freq, &count);
+                for (i = 0; i < count; i++) {
+                    int partial;
+
+                    if (sscanf(p, "%d%n", &partial, &n) != 1) break;
+                    p += n;
+                    if (i < KSOUND_PARTIALS) req.partials[i] = partial;
+                }
+                if (i < count) {
+                    parse_error(st, line_no, cmd);
+                    break;
+                }
+                req.wave = MAKEWAVE(amp, phase, freq);
+
+                err = timed_ioctl(st, OP_ADD, fd, CMDADDBANK, &req);
+                report(cmd, err);
+                if (!err)
+                    printf(
+                        "cmd=\"%c\", amp=%d, phase=%d, freq=%d, partials=%d, "
+                        "handle=0x%x\n",
+                        cmd, amp, phase, freq, count, req.handle);
+            } else if (cmd == 'x') {
+                uint32_t handle;
+
+                parse(1, "%x", &handle);
+                echo("cmd=\"%c\", handle=0x%x\n", cmd, handle);
+
+                report(cmd, timed_ioctl(st, OP_REMOVE, fd, CMDREMOVEVOICE,
+                                        &handle));
+            } else if (cmd == 'r') {
+                int freq;
+
+                parse(1, "%d", &freq);
+                echo("cmd=\"%c\", freq=%d\n", cmd, freq);
+
+                report(cmd,
+                       timed_ioctl(st, OP_REMOVE, fd, CMDREMOVEWAVE, &freq));
+            } else if (cmd == 'b' || cmd == 's' || cmd == 'u') {
+                // NOTE: b - добавить пакет, s - заменить набор пакетом, u -
+                // обновить амплитуду волн с теми же частотами
+                unsigned long const request = cmd == 'b'   ? CMDADDWAVES
+                                              : cmd == 's' ? CMDSETWAVES
+                                                           : CMDUPDATEWAVES;
+                int count, amp, phase, freq, step;
+
+                parse(5, "%d %d %d %d %d", &count, &amp, &phase, &freq,
+                      &step);
+                echo(
+                    "cmd=\"%c\", count=%d, amp=%d, phase=%d, freq=%d, "
+                    "step=%d\n",
+                    cmd, count, amp, phase, freq, step);
+
+                report(cmd, send_batch(st, fd, request, count, amp, phase,
+                                       freq, step));
+            } else if (cmd == 'p') {
+                // NOTE: добавить волны через кольцо команд, без ioctl
+                int count, amp, phase, freq, step;
+
+                parse(5, "%d %d %d %d %d", &count, &amp, &phase, &freq,
+                      &step);
+                echo(
+                    "cmd=\"%c\", count=%d, amp=%d, phase=%d, freq=%d, "
+                    "step=%d\n",
+                    cmd, count, amp, phase, freq, step);
+
+                if (!c->ring && !(c->ring = map_ring(fd))) continue;
+
+                expect(push_ring(c->ring, count, amp, phase, freq, step, 0, 0,
+                                 0) == count);
+            } else if (cmd == 'n') {
+                // NOTE: ноты через кольцо с метками времени: начало через
+                // 0.1 с от текущего кадра потока, между нотами gap кадров
+                int count, amp, freq, step, gap, duration;
+
+                parse(6, "%d %d %d %d %d %d", &count, &amp, &freq, &step,
+                      &gap, &duration);
+                echo(
+                    "cmd=\"%c\", count=%d, amp=%d, freq=%d, step=%d, gap=%d, "
+                    "duration=%d\n",
+                    cmd, count, amp, freq, step, gap, duration);
+
+                if (!c->ring && !(c->ring = map_ring(fd))) continue;
+
+                expect(push_ring(c->ring, count, amp, 0, freq, step,
+                                 __atomic_load_n(&c->ring->frame,
+                                                 __ATOMIC_RELAXED) +
+                                     4800,
+                                 gap, duration) == count);
+            } else if (cmd == 'c') {
+                echo("cmd=\"%c\"\n", cmd);
+
+                report(cmd,
+                       timed_ioctl(st, OP_REMOVE, fd, CMDCLEARWAVES, NULL));
+            } else if (cmd == 'i') {
+                // NOTE: выбрать поток захвата, у него свои волны и своё кольцо
+                uint32_t index, count = 0;
+
+                parse(1, "%u", &index);
+                report(cmd,
+                       timed_ioctl(st, OP_OTHER, fd, CMDGETSTREAMS, &count));
+                echo("cmd=\"%c\", index=%u, streams=%u\n", cmd, index, count);
+
+                if (index >= count) continue;
+
+                report(cmd,
+                       timed_ioctl(st, OP_OTHER, fd, CMDSETSTREAM, &index));
+
+                // NOTE: старое отображение смотрит на кольцо прежнего потока
+                if (c->ring) {
+                    munmap(c->ring, sizeof(*c->ring));
+                    c->ring = NULL;
+                }
+            } else if (cmd == 'w') {
+                // NOTE: пауза сценария в миллисекундах
+                int ms;
+
+                parse(1, "%d", &ms);
+                if (ms > 0) usleep(ms * 1000);
+            } else if (cmd == '#') {
+                // NOTE: комментарий до конца строки
+                break;
+            } else if (cmd == 'q') {
+                loop = 0;
+            } else {
+                parse_error(st, line_no, cmd);
+                break;
+            }
+        }
+    }
+
+    free(line);
+
+#undef parse
+#undef echo
+}
+
+/*
+ * Параметры нагрузки (режим -l).
+ */
+struct load_config {
+    int threads;
+    double rate;     // команд в секунду на все потоки, 0 - без паузы
+    double seconds;  // длительность
+    int weights[3];  // доли add, remove, update
+    int voices;      // предел волн на поток, дальше только удаления
+    int shared;      // все потоки через один файл (одна сессия драйвера)
+    int fd;          // общий файл для shared
+};
+
+struct load_thread {
+    pthread_t thread;
+    int index;
+    struct load_config const *config;
+    struct client client;
+    uint64_t start, end;  // общее расписание, нс CLOCK_MONOTONIC
+};
+
+/*
+ * xorshift32, своя последовательность на каждый поток.
+ */
+static uint32_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/*
+ * Один поток нагрузки: команды по расписанию start + i * interval, вид
+ * команды случайный по весам. Дескрипторы добавленных волн хранятся здесь
+ * же, удаляются и обновляются только свои волны.
+ */
+static void *load_run(void *data) {
+    struct load_thread *const t = data;
+    struct load_config const *const config = t->config;
+    struct stats *const st = &t->client.stats;
+    int const fd = t->client.fd;
+    int const total = config->weights[0] + config->weights[1] +
+                      config->weights[2];
+    uint64_t const interval =
+        config->rate > 0
+            ? (uint64_t)(1e9 * config->threads / config->rate)
+            : 0;
+    uint32_t *const handles = calloc(config->voices, sizeof(*handles));
+    uint32_t state = 2463534242u + t->index * 7919u;
+    uint64_t next = t->start;
+    int count = 0;
+
+    if (!handles) return NULL;
+
+    for (;;) {
+        uint64_t now = now_ns();
+        int pick = next_random(&state) % total;
+
+        if (now >= t->end) break;
+
+        // NOTE: расписание абсолютное, поэтому задержка одной команды не
+        // сдвигает остальные. Отставание больше интервала считается
+        if (interval) {
+            if (now < next) {
+                struct timespec const ts = {
+                    .tv_sec = next / 1000000000ull,
+                    .tv_nsec = next % 1000000000ull,
+                };
+
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            } else if (now - next > interval) {
+                st->late++;
+            }
+            next += interval;
+        }
+
+        // NOTE: пустому набору нечего удалять, полному некуда добавлять
+        if (count == 0)
+            pick = 0;
+        else if (count == config->voices && pick < config->weights[0])
+            pick = config->weights[0];
+
+        if (pick < config->weights[0]) {
+            struct ksound_voice_req req = {
+                .wave = MAKEWAVE(1 + next_random(&state) % 20, 0,
+                                 100 + next_random(&state) % 4000),
+            };
+
+            if (timed_ioctl(st, OP_ADD, fd, CMDADDVOICE, &req) == 0)
+                handles[count++] = req.handle;
+        } else if (pick < config->weights[0] + config->weights[1]) {
+            int const i = next_random(&state) % count;
+
+            timed_ioctl(st, OP_REMOVE, fd, CMDREMOVEVOICE, &handles[i]);
+            handles[i] = handles[--count];
+        } else {
+            struct ksound_voice_req req = {
+                .handle = handles[next_random(&state) % count],
+                .wave = MAKEWAVE(1 + next_random(&state) % 20, 0,
+                                 100 + next_random(&state) % 4000),
+            };
+
+            timed_ioctl(st, OP_UPDATE, fd, CMDUPDATEVOICE, &req);
+        }
+    }
+
+    // NOTE: свои волны убираются, остальные потоки могут ещё работать
+    for (; count > 0; count--)
+        ioctl(fd, CMDREMOVEVOICE, &handles[count - 1]);
+
+    free(handles);
+    return NULL;
+}
+
+/*
+ * Режим нагрузки: config->threads потоков шлют команды по расписанию,
+ * в конце печатается статистика всех потоков вместе. Возвращает код выхода.
+ */
+static int run_load(struct load_config *config) {
+    struct load_thread *const threads =
+        calloc(config->threads, sizeof(*threads));
+    struct stats total = {0};
+    uint64_t start, elapsed;
+    int i, err = 0;
+
+    if (!threads) return 1;
+
+    printf("load: threads %d, rate %.0f ops/s, %.1f s, add/remove/update "
+           "%d/%d/%d, voices %d per thread%s\n",
+           config->threads, config->rate, config->seconds, config->weights[0],
+           config->weights[1], config->weights[2], config->voices,
+           config->shared ? ", shared file" : "");
+
+    // NOTE: потоки стартуют по одному расписанию через 10 мс, чтобы создание
+    // потоков не попало в замер
+    start = now_ns() + 10000000ull;
+
+    for (i = 0; i < config->threads; i++) {
+        struct load_thread *const t = &threads[i];
+
+        t->index = i;
+        t->config = config;
+        t->start = start;
+        t->end = start + (uint64_t)(config->seconds * 1e9);
+        t->client.fd = config->shared ? config->fd
+                                      : open("/dev/ksound_device", O_RDWR);
+
+        if (t->client.fd < 0) {
+            printf("failed to open device file for thread %d\n", i);
+            err = 1;
+            break;
+        }
+
+        if (pthread_create(&t->thread, NULL, load_run, t) != 0) {
+            printf("failed to create thread %d\n", i);
+            if (!config->shared) close(t->client.fd);
+            err = 1;
+            break;
+        }
+    }
+
+    config->threads = i;
+    for (i = 0; i < config->threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        stats_merge(&total, &threads[i].client.stats);
+        if (!config->shared) close(threads[i].client.fd);
+    }
+
+    elapsed = now_ns() - start;
+    stats_print(&total, elapsed / 1e9);
+
+    free(threads);
+    return err || total.op[OP_ADD].errors + total.op[OP_REMOVE].errors +
+                          total.op[OP_UPDATE].errors !=
+                      0;
+}
+
+static void usage(char const *name) {
+    fprintf(stderr,
+            "usage: %s                  interactive commands\n"
+            "       %s -f script        replay a command script (- stdin)\n"
+            "       %s -l [-j threads] [-r ops/s] [-d seconds]\n"
+            "          [-m add,remove,update] [-v voices] [-S]\n"
+            "                           add/remove/update load\n",
+            name, name, name);
+}
+
 int main(int argc, char **argv) {
-    int fd, loop = 1;
+    struct load_config load = {
+        .threads = 1,
+        .rate = 1000,
+        .seconds = 5,
+        .weights = {40, 40, 20},
+        .voices = 256,
+    };
+    char const *script = NULL;
+    struct client client = {0};
     uint32_t wave;
+    int opt, load_mode = 0, err = 0;
 
-    fd = open("/dev/ksound_device", O_RDWR);
-    if (fd < 0) {
-        printf("failed to open device file %d\n", fd);
-        return -1;
+    while ((opt = getopt(argc, argv, "f:lj:r:d:m:v:S")) != -1) {
+        if (opt == 'f') {
+            script = optarg;
+        } else if (opt == 'l') {
+            load_mode = 1;
+        } else if (opt == 'j') {
+            load.threads = atoi(optarg);
+        } else if (opt == 'r') {
+            load.rate = atof(optarg);
+        } else if (opt == 'd') {
+            load.seconds = atof(optarg);
+        } else if (opt == 'm') {
+            if (sscanf(optarg, "%d,%d,%d", &load.weights[0], &load.weights[1],
+                       &load.weights[2]) != 3) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (opt == 'v') {
+            load.voices = atoi(optarg);
+        } else if (opt == 'S') {
+            load.shared = 1;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (load.threads < 1 || load.voices < 1 || load.rate < 0 ||
+        load.weights[0] < 0 || load.weights[1] < 0 || load.weights[2] < 0 ||
+        load.weights[0] + load.weights[1] + load.weights[2] <= 0 ||
+        load.weights[0] == 0) {
+        fprintf(stderr, "bad load parameters, add weight must be positive\n");
+        return 1;
     }
 
     // NOTE: проверка что макросы работают праильно
@@ -61,44 +765,35 @@ int main(int argc, char **argv) {
     expect(GETWAVEPHASE(wave) == 187);
     expect(GETWAVEFREQ(wave) == 21953);
 
-    while (loop) {
-        char cmd = 'q';
-
-        // NOTE:
-        // https://stackoverflow.com/questions/2507082/getc-vs-getchar-vs-scanf-for-reading-a-character-from-stdin
-        // NOTE:
-        // https://stackoverflow.com/questions/58294019/leading-whitespace-when-using-scanf-with-c
-        printf("input command (a, r, q): ");
-        scanf(" %c",
-              &cmd);  // пробел - пропустить все не печатные символы в начале
-        // cmd = getchar();
-
-        if (cmd == 'a') {
-            int amp, phase, freq;
-            uint32_t wave;
-
-            scanf("%d %d %d", &amp, &phase, &freq);
-            printf("cmd=\"%c\", amp=%d, phase=%d, freq=%d\n", cmd, amp, phase,
-                   freq);
-
-            wave = MAKEWAVE(amp, phase, freq);
-            ioctl(fd, CMDADDWAVE, &wave);
-
-            expect(GETWAVEAMP(wave) == amp);
-            expect(GETWAVEPHASE(wave) == phase);
-            expect(GETWAVEFREQ(wave) == freq);
-        } else if (cmd == 'r') {
-            int freq;
-
-            scanf("%d", &freq);
-            printf("cmd=\"%c\", freq=%d\n", cmd, freq);
-
-            ioctl(fd, CMDREMOVEWAVE, &freq);
-        } else if (cmd == 'q') {
-            loop = 0;
+    client.fd = open("/dev/ksound_device", O_RDWR);
+    if (client.fd < 0) {
+        printf("failed to open device file %d\n", client.fd);
+        return -1;
+    }
+
+    if (load_mode) {
+        load.fd = client.fd;
+        err = run_load(&load);
+    } else if (script) {
+        FILE *const in = strcmp(script, "-") ? fopen(script, "r") : stdin;
+        uint64_t const start = now_ns();
+
+        if (!in) {
+            printf("failed to open script %s\n", script);
+            close(client.fd);
+            return 1;
         }
+
+        run_commands(&client, in, 0);
+        stats_print(&client.stats, (now_ns() - start) / 1e9);
+        if (in != stdin) fclose(in);
+        // NOTE: сценарий с ошибками разбора выполнен не весь
+        err = client.stats.parse_errors != 0;
+    } else {
+        run_commands(&client, stdin, 1);
     }
 
-    close(fd);
-    return 0;
+    if (client.ring) munmap(client.ring, sizeof(*client.ring));
+    close(client.fd);
+    return err;
 }
@@ -0,0 +1,738 @@
+/*
+ * Проверка потока захвата KernelSoundCard для долгих прогонов без звуковой
+ * системы: читает PCM напрямую через ioctl ядра (sound/asound.h, без
+ * alsa-lib), считает xrun и разрывы указателя, а по окнам БПФ проверяет что
+ * каждая ожидаемая волна звучит на своей частоте и со своим уровнем.
+ *
+ * Вывод - по объекту JSON на строку (события, неудачные окна, итог), код
+ * выхода 0 если проверка пройдена, 1 если нет, 2 если запустить не удалось.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sound/asound.h>
+
+#include "ksound_ioctl.h"  // CMDSETWAVES, ksound_wave_batch, ...
+
+// NOTE: амплитуда 7 бит, фаза 9 бит, частота 16 бит (как в us_oscillator)
+#define MAKEWAVE(amp, phase, freq) \
+    (((amp)&0x7f) | (((phase)&0x1ff) << 7) | (((freq)&0xffff) << 16))
+
+#define CARD_NAME "KernelSoundCard"
+#define MAX_VOICES 64
+
+// NOTE: энергия волны в окне Ханна почти вся в ±GUARD бинах от пика, волны
+// должны отстоять друг от друга хотя бы на 4 * GUARD бинов, чтобы утечка
+// соседней не попадала в оценку уровня
+#define GUARD 4
+
+struct voice {
+    double freq;
+    int amp;               // сумма амплитуд волн этой частоты, не больше 127
+    double expected_dbfs;  // ожидаемый уровень с учётом headroom
+};
+
+struct config {
+    int card;  // -1 - найти карту по имени
+    int device, substream;
+    unsigned int rate, channels, period, periods;
+    int channel;     // какой канал анализировать
+    int fft;         // размер окна БПФ, степень двойки
+    double seconds;  // длительность, 0 - до сигнала
+    double warmup;   // секунд без анализа после старта и после xrun
+    double freq_tol, level_tol, spur_limit;
+    double jump;  // порог разрыва указателя в периодах
+    int headroom;
+    int set;      // выставить волны самому через /dev/ksound_device
+    int verbose;  // печатать все окна, а не только неудачные
+    struct voice voices[MAX_VOICES];
+    int voice_count;
+};
+
+struct result {
+    uint64_t frames;  // прочитано кадров всего
+    uint64_t xruns, discontinuities;
+    uint64_t windows, failed;
+    double max_freq_error, max_level_error, max_spur;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Номер карты с именем CARD_NAME или -1.
+ */
+static int find_card(void) {
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        struct snd_ctl_card_info info;
+        char path[64];
+        int fd, found;
+
+        snprintf(path, sizeof(path), "/dev/snd/controlC%d", i);
+        fd = open(path, O_RDONLY);
+        if (fd < 0) continue;
+
+        memset(&info, 0, sizeof(info));
+        found = ioctl(fd, SNDRV_CTL_IOCTL_CARD_INFO, &info) == 0 &&
+                (!strcmp((char *)info.name, CARD_NAME) ||
+                 !strcmp((char *)info.id, CARD_NAME));
+        close(fd);
+
+        if (found) return i;
+    }
+
+    return -1;
+}
+
+/*
+ * Параметры PCM без alsa-lib: всё разрешено, затем нужные значения
+ * фиксируются, остальное ядро выводит само в SNDRV_PCM_IOCTL_HW_PARAMS.
+ */
+static void params_any(struct snd_pcm_hw_params *p) {
+    int k;
+
+    memset(p, 0, sizeof(*p));
+    for (k = SNDRV_PCM_HW_PARAM_FIRST_MASK; k <= SNDRV_PCM_HW_PARAM_LAST_MASK;
+         k++)
+        memset(&p->masks[k - SNDRV_PCM_HW_PARAM_FIRST_MASK], 0xff,
+               sizeof(struct snd_mask));
+    for (k = SNDRV_PCM_HW_PARAM_FIRST_INTERVAL;
+         k <= SNDRV_PCM_HW_PARAM_LAST_INTERVAL; k++) {
+        p->intervals[k - SNDRV_PCM_HW_PARAM_FIRST_INTERVAL].min = 0;
+        p->intervals[k - SNDRV_PCM_HW_PARAM_FIRST_INTERVAL].max = UINT_MAX;
+    }
+    p->rmask = ~0u;
+    p->info = ~0u;
+}
+
+static void params_mask(struct snd_pcm_hw_params *p, int k, unsigned int val) {
+    struct snd_mask *const m = &p->masks[k - SNDRV_PCM_HW_PARAM_FIRST_MASK];
+
+    memset(m, 0, sizeof(*m));
+    m->bits[val >> 5] |= 1u << (val & 31);
+}
+
+static void params_int(struct snd_pcm_hw_params *p, int k, unsigned int val) {
+    struct snd_interval *const i =
+        &p->intervals[k - SNDRV_PCM_HW_PARAM_FIRST_INTERVAL];
+
+    i->min = i->max = val;
+    i->openmin = i->openmax = 0;
+    i->integer = 1;
+}
+
+/*
+ * Открывает и настраивает PCM захвата, S16_LE, чередование каналов.
+ * Возвращает дескриптор или -1.
+ */
+static int open_pcm(struct config const *c) {
+    struct snd_pcm_hw_params params;
+    char path[64];
+    int ctl, fd, sub = c->substream;
+
+    // NOTE: предпочтение substream действует на открытия PCM этим процессом
+    // пока открыт файл управления
+    snprintf(path, sizeof(path), "/dev/snd/controlC%d", c->card);
+    ctl = open(path, O_RDWR);
+    if (ctl < 0 || ioctl(ctl, SNDRV_CTL_IOCTL_PCM_PREFER_SUBDEVICE, &sub)) {
+        fprintf(stderr, "failed to select substream %d: %s\n", sub,
+                strerror(errno));
+        if (ctl >= 0) close(ctl);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "/dev/snd/pcmC%dD%dc", c->card, c->device);
+    fd = open(path, O_RDWR);
+    close(ctl);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    params_any(&params);
+    params_mask(&params, SNDRV_PCM_HW_PARAM_ACCESS,
+                SNDRV_PCM_ACCESS_RW_INTERLEAVED);
+    params_mask(&params, SNDRV_PCM_HW_PARAM_FORMAT, SNDRV_PCM_FORMAT_S16_LE);
+    params_mask(&params, SNDRV_PCM_HW_PARAM_SUBFORMAT,
+                SNDRV_PCM_SUBFORMAT_STD);
+    params_int(&params, SNDRV_PCM_HW_PARAM_CHANNELS, c->channels);
+    params_int(&params, SNDRV_PCM_HW_PARAM_RATE, c->rate);
+    params_int(&params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE, c->period);
+    params_int(&params, SNDRV_PCM_HW_PARAM_PERIODS, c->periods);
+
+    if (ioctl(fd, SNDRV_PCM_IOCTL_HW_PARAMS, &params)) {
+        fprintf(stderr,
+                "hw_params rate=%u channels=%u period=%u periods=%u: %s\n",
+                c->rate, c->channels, c->period, c->periods, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Перезапуск после xrun и первый старт.
+ */
+static int start_pcm(int fd) {
+    if (ioctl(fd, SNDRV_PCM_IOCTL_PREPARE) ||
+        ioctl(fd, SNDRV_PCM_IOCTL_START)) {
+        fprintf(stderr, "failed to start capture: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Выставляет ожидаемые волны сессии нового файла /dev/ksound_device на
+ * потоке substream. Волны живут пока файл открыт. Возвращает его или -1.
+ */
+static int set_voices(struct config const *c) {
+    uint32_t waves[MAX_VOICES];
+    struct ksound_wave_batch batch = {0};
+    uint32_t stream = c->substream;
+    int i, fd;
+
+    fd = open("/dev/ksound_device", O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open /dev/ksound_device: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < c->voice_count; i++)
+        waves[i] = MAKEWAVE(c->voices[i].amp, 0, (int)c->voices[i].freq);
+
+    batch.count = c->voice_count;
+    batch.waves = (uintptr_t)waves;
+
+    if (ioctl(fd, CMDSETSTREAM, &stream) || ioctl(fd, CMDSETWAVES, &batch)) {
+        fprintf(stderr, "failed to set voices: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * БПФ по основанию 2 на месте, n - степень двойки.
+ */
+static void fft(double *re, double *im, int n) {
+    int i, j, len;
+
+    for (i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+
+        if (i < j) {
+            double const r = re[i], m = im[i];
+
+            re[i] = re[j];
+            im[i] = im[j];
+            re[j] = r;
+            im[j] = m;
+        }
+    }
+
+    for (len = 2; len <= n; len <<= 1) {
+        double const angle = -2 * M_PI / len;
+        double const wr = cos(angle), wi = sin(angle);
+
+        for (i = 0; i < n; i += len) {
+            double ur = 1, ui = 0;
+
+            for (j = 0; j < len / 2; j++) {
+                double *const ar = &re[i + j], *const ai = &im[i + j];
+                double *const br = &re[i + j + len / 2],
+                              *const bi = &im[i + j + len / 2];
+                double const tr = *br * ur - *bi * ui;
+                double const ti = *br * ui + *bi * ur;
+                double const next = ur * wr - ui * wi;
+
+                *br = *ar - tr;
+                *bi = *ai - ti;
+                *ar += tr;
+                *ai += ti;
+
+                ui = ur * wi + ui * wr;
+                ur = next;
+            }
+        }
+    }
+}
+
+static double to_dbfs(double amplitude) {
+    double const db = 20 * log10(amplitude / 32767);
+
+    // NOTE: в JSON нет -inf
+    return db > -200 ? db : -200;
+}
+
+/*
+ * Анализ одного окна: samples - n отсчётов канала, power - рабочий буфер на
+ * n / 2 + 1 бинов. Печатает окно если оно неудачное или verbose. Возвращает 1
+ * если окно прошло проверку.
+ */
+static int analyze(struct config const *c, struct result *r, double *re,
+                   double *im, double *power, uint64_t frame) {
+    int const n = c->fft, half = n / 2;
+    double const bin_hz = (double)c->rate / n;
+    double spur = 0;
+    int i, k, ok = 1;
+    char line[256 * MAX_VOICES];
+    int len = 0;
+
+    // NOTE: окно Ханна, у синуса амплитуды A энергия бинов главного лепестка
+    // в сумме 3 * A^2 * n^2 / 32 при любом положении частоты между бинами
+    for (i = 0; i < n; i++) {
+        re[i] *= 0.5 - 0.5 * cos(2 * M_PI * i / n);
+        im[i] = 0;
+    }
+    fft(re, im, n);
+    for (k = 0; k <= half; k++) power[k] = re[k] * re[k] + im[k] * im[k];
+
+    for (i = 0; i < c->voice_count; i++) {
+        struct voice const *const v = &c->voices[i];
+        int const center = (int)lround(v->freq / bin_hz);
+        int const search = (int)ceil(c->freq_tol / bin_hz) + 1;
+        int peak = center;
+        double energy = 0, offset = 0, measured, level, freq_error, level_error;
+        int voice_ok;
+
+        for (k = center - search; k <= center + search; k++)
+            if (k > 0 && k < half && power[k] > power[peak]) peak = k;
+
+        // NOTE: уточнение частоты параболой по логарифму трёх бинов
+        if (peak > 0 && peak < half && power[peak] > 0) {
+            double const a = log(power[peak - 1] + 1e-30) / 2;
+            double const b = log(power[peak]) / 2;
+            double const d = log(power[peak + 1] + 1e-30) / 2;
+
+            if (a - 2 * b + d < 0) offset = 0.5 * (a - d) / (a - 2 * b + d);
+        }
+
+        for (k = peak - GUARD; k <= peak + GUARD; k++)
+            if (k > 0 && k < half) energy += power[k];
+
+        measured = (peak + offset) * bin_hz;
+        level = to_dbfs(sqrt(32 * energy / 3) / n);
+        freq_error = fabs(measured - v->freq);
+        level_error = fabs(level - v->expected_dbfs);
+        voice_ok = freq_error <= c->freq_tol && level_error <= c->level_tol;
+
+        if (freq_error > r->max_freq_error) r->max_freq_error = freq_error;
+        if (level_error > r->max_level_error) r->max_level_error = level_error;
+        ok &= voice_ok;
+
+        len += snprintf(line + len, sizeof(line) - len,
+                        "%s{\"freq\":%.0f,\"measured\":%.3f,"
+                        "\"level_dbfs\":%.2f,\"expected_dbfs\":%.2f,"
+                        "\"ok\":%s}",
+                        i ? "," : "", v->freq, measured, level,
+                        v->expected_dbfs, voice_ok ? "true" : "false");
+    }
+
+    // NOTE: самый сильный бин вне ожидаемых волн и постоянной составляющей,
+    // уровень по пику окна Ханна (когерентное усиление 1/2)
+    for (k = GUARD; k <= half; k++) {
+        int near = 0;
+
+        for (i = 0; i < c->voice_count && !near; i++)
+            near = fabs(k - c->voices[i].freq / bin_hz) <= 2 * GUARD;
+        if (!near && power[k] > spur) spur = power[k];
+    }
+    spur = to_dbfs(4 * sqrt(spur) / n);
+    if (spur > r->max_spur) r->max_spur = spur;
+    if (spur > c->spur_limit) ok = 0;
+
+    r->windows++;
+    if (!ok) r->failed++;
+
+    if (!ok || c->verbose)
+        printf("{\"event\":\"window\",\"index\":%llu,\"frame\":%llu,"
+               "\"ok\":%s,\"spur_dbfs\":%.2f,\"voices\":[%s]}\n",
+               (unsigned long long)r->windows - 1, (unsigned long long)frame,
+               ok ? "true" : "false", spur, line);
+
+    return ok;
+}
+
+/*
+ * Добавляет волну freq:amp к ожидаемым, амплитуды одной частоты
+ * складываются (фаза у всех 0).
+ */
+static int add_voice(struct config *c, char const *spec) {
+    double freq;
+    int amp, i;
+
+    if (sscanf(spec, "%lf:%d", &freq, &amp) != 2 || freq <= 0 ||
+        freq > 0xffff || amp < 1 || amp > 127) {
+        fprintf(stderr, "bad voice %s, expected freq:amp, amp 1..127\n",
+                spec);
+        return -1;
+    }
+
+    for (i = 0; i < c->voice_count; i++)
+        if (c->voices[i].freq == freq) {
+            if (c->voices[i].amp + amp > 127) {
+                fprintf(stderr, "voices at %.0f Hz sum above amp 127\n",
+                        freq);
+                return -1;
+            }
+            c->voices[i].amp += amp;
+            return 0;
+        }
+
+    if (c->voice_count == MAX_VOICES) {
+        fprintf(stderr, "too many voices, at most %d\n", MAX_VOICES);
+        return -1;
+    }
+
+    c->voices[c->voice_count].freq = freq;
+    c->voices[c->voice_count].amp = amp;
+    c->voice_count++;
+    return 0;
+}
+
+/*
+ * Headroom модуля из sysfs, если модуль загружен, иначе fallback.
+ */
+static int read_headroom(int fallback) {
+    FILE *const f = fopen("/sys/module/ex_oscillator/parameters/headroom", "r");
+    int value = fallback;
+
+    if (!f) return fallback;
+    if (fscanf(f, "%d", &value) != 1 || value < 1) value = fallback;
+    fclose(f);
+    return value;
+}
+
+/*
+ * Проверяет что волны различимы окном c->fft и считает их ожидаемые уровни.
+ */
+static int prepare_voices(struct config *c) {
+    double const bin_hz = (double)c->rate / c->fft;
+    double peak = 0;
+    int i, j;
+
+    for (i = 0; i < c->voice_count; i++) {
+        struct voice *const v = &c->voices[i];
+
+        if (v->freq / bin_hz < 2 * GUARD ||
+            v->freq / bin_hz > c->fft / 2 - 2 * GUARD) {
+            fprintf(stderr, "voice %.0f Hz is too close to 0 or rate/2\n",
+                    v->freq);
+            return -1;
+        }
+
+        for (j = 0; j < i; j++)
+            if (fabs(v->freq - c->voices[j].freq) / bin_hz < 4 * GUARD) {
+                fprintf(stderr,
+                        "voices %.0f and %.0f Hz are closer than %d bins, "
+                        "increase -n\n",
+                        v->freq, c->voices[j].freq, 4 * GUARD);
+                return -1;
+            }
+
+        // NOTE: волна amp 127 - полная шкала, затем общий множитель
+        // 1 / headroom
+        v->expected_dbfs = to_dbfs(32767.0 * v->amp / 127 / c->headroom);
+        peak += 32767.0 * v->amp / 127 / c->headroom;
+    }
+
+    // NOTE: выше колена мягкого ограничения уровни и гармоники уже не
+    // линейны, проверка всё равно идёт, но вероятно не пройдёт
+    if (peak > 32767 - 5215)
+        fprintf(stderr,
+                "warning: voices sum up to %.0f, above the soft clip knee, "
+                "raise headroom\n",
+                peak);
+
+    return 0;
+}
+
+static void usage(char const *name) {
+    fprintf(stderr,
+            "usage: %s [options] [freq:amp ...]\n"
+            "  -D card,device[,substream]  capture PCM (default: card %s, "
+            "0, 0)\n"
+            "  -r rate -c channels -p period -P periods  (48000 2 1024 4)\n"
+            "  -C channel     channel to analyze (0)\n"
+            "  -n fft         window size, power of two (8192)\n"
+            "  -d seconds     run time, 0 - until SIGINT/SIGTERM (10)\n"
+            "  -w seconds     skip analysis after start and xrun (0.2)\n"
+            "  -f hz          frequency tolerance (2)\n"
+            "  -l db          level tolerance (1)\n"
+            "  -x dbfs        spur limit outside expected voices (-60)\n"
+            "  -j periods     pointer jump counted as discontinuity (2)\n"
+            "  -H headroom    module headroom (read from sysfs, else 4)\n"
+            "  -s             set the voices through /dev/ksound_device\n"
+            "  -v             print every window, not only failed ones\n",
+            name, CARD_NAME);
+}
+
+int main(int argc, char **argv) {
+    struct config c = {
+        .card = -1,
+        .rate = 48000,
+        .channels = 2,
+        .period = 1024,
+        .periods = 4,
+        .fft = 8192,
+        .seconds = 10,
+        .warmup = 0.2,
+        .freq_tol = 2,
+        .level_tol = 1,
+        .spur_limit = -60,
+        .jump = 2,
+        .headroom = 0,
+    };
+    struct result r = {.max_spur = -200};
+    struct snd_pcm_status status;
+    struct sigaction sa;
+    int16_t *buffer;
+    double *re, *im, *power;
+    double start, skip_until, hw_start_time = 0, last_time = 0;
+    double last_drift = 0;
+    uint64_t hw_start = 0, appl_expected = 0, last_hw = 0;
+    int i, opt, pcm, voices_fd = -1, fill = 0, have_base = 0, pass;
+
+    while ((opt = getopt(argc, argv, "D:r:c:p:P:C:n:d:w:f:l:x:j:H:sv")) !=
+           -1) {
+        if (opt == 'D') {
+            if (sscanf(optarg, "%d,%d,%d", &c.card, &c.device, &c.substream) <
+                2) {
+                usage(argv[0]);
+                return 2;
+            }
+        } else if (opt == 'r') {
+            c.rate = atoi(optarg);
+        } else if (opt == 'c') {
+            c.channels = atoi(optarg);
+        } else if (opt == 'p') {
+            c.period = atoi(optarg);
+        } else if (opt == 'P') {
+            c.periods = atoi(optarg);
+        } else if (opt == 'C') {
+            c.channel = atoi(optarg);
+        } else if (opt == 'n') {
+            c.fft = atoi(optarg);
+        } else if (opt == 'd') {
+            c.seconds = atof(optarg);
+        } else if (opt == 'w') {
+            c.warmup = atof(optarg);
+        } else if (opt == 'f') {
+            c.freq_tol = atof(optarg);
+        } else if (opt == 'l') {
+            c.level_tol = atof(optarg);
+        } else if (opt == 'x') {
+            c.spur_limit = atof(optarg);
+        } else if (opt == 'j') {
+            c.jump = atof(optarg);
+        } else if (opt == 'H') {
+            c.headroom = atoi(optarg);
+        } else if (opt == 's') {
+            c.set = 1;
+        } else if (opt == 'v') {
+            c.verbose = 1;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    for (; optind < argc; optind++)
+        if (add_voice(&c, argv[optind])) return 2;
+
+    if (c.fft < 64 || (c.fft & (c.fft - 1)) || c.rate == 0 ||
+        c.channels == 0 || c.channel < 0 || c.channel >= (int)c.channels ||
+        c.period == 0 || c.periods == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (c.headroom <= 0) c.headroom = read_headroom(4);
+    if (prepare_voices(&c)) return 2;
+
+    if (c.card < 0 && (c.card = find_card()) < 0) {
+        fprintf(stderr, "card %s not found, is the module loaded?\n",
+                CARD_NAME);
+        return 2;
+    }
+
+    if (c.set && (voices_fd = set_voices(&c)) < 0) return 2;
+
+    pcm = open_pcm(&c);
+    buffer = calloc((size_t)c.period * c.channels, sizeof(*buffer));
+    re = calloc(c.fft, sizeof(*re));
+    im = calloc(c.fft, sizeof(*im));
+    power = calloc(c.fft / 2 + 1, sizeof(*power));
+    if (pcm < 0 || !buffer || !re || !im || !power || start_pcm(pcm)) return 2;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("{\"event\":\"start\",\"card\":%d,\"device\":%d,\"substream\":%d,"
+           "\"rate\":%u,\"channels\":%u,\"period\":%u,\"periods\":%u,"
+           "\"fft\":%d,\"headroom\":%d,\"voices\":[",
+           c.card, c.device, c.substream, c.rate, c.channels, c.period,
+           c.periods, c.fft, c.headroom);
+    for (i = 0; i < c.voice_count; i++)
+        printf("%s[%.0f,%d]", i ? "," : "", c.voices[i].freq,
+               c.voices[i].amp);
+    printf("]}\n");
+    fflush(stdout);
+
+    start = now_s();
+    skip_until = start + c.warmup;
+
+    while (!stop && (c.seconds <= 0 || now_s() - start < c.seconds)) {
+        struct snd_xferi xfer = {.buf = buffer, .frames = c.period};
+        double now, drift;
+        unsigned int j;
+
+        if (ioctl(pcm, SNDRV_PCM_IOCTL_READI_FRAMES, &xfer)) {
+            if (errno == EINTR) continue;
+            if (errno != EPIPE) {
+                fprintf(stderr, "read failed: %s\n", strerror(errno));
+                break;
+            }
+
+            // NOTE: окно с xrun внутри не анализируется, отсчёт указателя
+            // начинается заново
+            r.xruns++;
+            printf("{\"event\":\"xrun\",\"frame\":%llu,\"count\":%llu}\n",
+                   (unsigned long long)r.frames, (unsigned long long)r.xruns);
+            fflush(stdout);
+            if (start_pcm(pcm)) break;
+            fill = 0;
+            have_base = 0;
+            skip_until = now_s() + c.warmup;
+            continue;
+        }
+
+        r.frames += xfer.result;
+
+        // NOTE: разрыв указателя - hw_ptr пошёл назад, отошёл от часов больше
+        // чем на c.jump периодов, или appl_ptr не совпал с прочитанным
+        if (ioctl(pcm, SNDRV_PCM_IOCTL_STATUS, &status) == 0) {
+            char const *kind = NULL;
+            long long delta = 0;
+
+            now = now_s();
+            if (!have_base) {
+                hw_start = status.hw_ptr;
+                hw_start_time = now;
+                appl_expected = status.appl_ptr;
+                last_hw = status.hw_ptr;
+                last_time = now;
+                last_drift = 0;
+                have_base = 1;
+            } else {
+                appl_expected += xfer.result;
+                drift = (double)(status.hw_ptr - hw_start) -
+                        (now - hw_start_time) * c.rate;
+
+                if (status.hw_ptr < last_hw) {
+                    kind = "backward";
+                    delta = (long long)status.hw_ptr - (long long)last_hw;
+                } else if (fabs(drift - last_drift) > c.jump * c.period) {
+                    kind = "jump";
+                    delta = (long long)(drift - last_drift);
+                } else if (status.appl_ptr != appl_expected) {
+                    kind = "appl";
+                    delta = (long long)status.appl_ptr -
+                            (long long)appl_expected;
+                    appl_expected = status.appl_ptr;
+                }
+
+                last_hw = status.hw_ptr;
+                last_time = now;
+                last_drift = drift;
+            }
+
+            if (kind) {
+                r.discontinuities++;
+                printf("{\"event\":\"discontinuity\",\"frame\":%llu,"
+                       "\"kind\":\"%s\",\"frames\":%lld}\n",
+                       (unsigned long long)r.frames, kind, delta);
+                fflush(stdout);
+            }
+        }
+
+        if (now_s() < skip_until) continue;
+
+        for (j = 0; j < xfer.result; j++) {
+            re[fill++] = buffer[j * c.channels + c.channel];
+            if (fill == c.fft) {
+                analyze(&c, &r, re, im, power,
+                        r.frames - xfer.result + j + 1 - c.fft);
+                fflush(stdout);
+                fill = 0;
+            }
+        }
+    }
+
+    pass = r.xruns == 0 && r.discontinuities == 0 && r.windows > 0 &&
+           r.failed == 0;
+
+    // NOTE: частота по hw_ptr и часам с последнего старта, уход от rate
+    // означает что таймер драйвера отстаёт или спешит
+    {
+        double const elapsed = now_s() - start;
+        double const measured_rate =
+            last_time > hw_start_time
+                ? (last_hw - hw_start) / (last_time - hw_start_time)
+                : 0;
+
+        printf("{\"event\":\"summary\",\"seconds\":%.3f,\"frames\":%llu,"
+               "\"measured_rate\":%.1f,\"xruns\":%llu,"
+               "\"discontinuities\":%llu,\"windows\":%llu,\"failed\":%llu,"
+               "\"max_freq_error_hz\":%.3f,\"max_level_error_db\":%.3f,"
+               "\"max_spur_dbfs\":%.2f,\"pass\":%s}\n",
+               elapsed, (unsigned long long)r.frames, measured_rate,
+               (unsigned long long)r.xruns,
+               (unsigned long long)r.discontinuities,
+               (unsigned long long)r.windows, (unsigned long long)r.failed,
+               r.max_freq_error, r.max_level_error, r.max_spur,
+               pass ? "true" : "false");
+    }
+
+    ioctl(pcm, SNDRV_PCM_IOCTL_DROP);
+    close(pcm);
+    if (voices_fd >= 0) close(voices_fd);
+    free(buffer);
+    free(re);
+    free(im);
+    free(power);
+    return pass ? 0 : 1;
+}